@@ -0,0 +1,93 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "acpi.h"
+#include "../Paging/paging.h"
+#include "../Drivers/PIT/pit.h"
+
+static struct acpi_sdt_header *rsdt = NULL;
+
+static bool acpi_checksum(const void *table, uint32_t length) {
+    const uint8_t *bytes = (const uint8_t*)table;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static struct acpi_rsdp* scan_rsdp(uint32_t start, uint32_t length) {
+    for (uint32_t addr = start; addr < start + length; addr += 16) {
+        const char *sig = (const char*)addr;
+        if (sig[0] == 'R' && sig[1] == 'S' && sig[2] == 'D' && sig[3] == ' ' &&
+            sig[4] == 'P' && sig[5] == 'T' && sig[6] == 'R' && sig[7] == ' ' &&
+            acpi_checksum((const void*)addr, sizeof(struct acpi_rsdp))) {
+            return (struct acpi_rsdp*)addr;
+        }
+    }
+    return NULL;
+}
+
+// Tables usually live at the top of RAM, outside the identity map
+static struct acpi_sdt_header* map_table(uint32_t physical_addr) {
+    struct acpi_sdt_header *table = map_physical_region(physical_addr, sizeof(struct acpi_sdt_header), 0);
+    return map_physical_region(physical_addr, table->length, 0);
+}
+
+bool init_ACPI() {
+    // The RSDP is in the first KB of the EBDA or in the BIOS area below 1 MB
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t*)0x40E) << 4;
+    struct acpi_rsdp *rsdp = NULL;
+
+    if (ebda) {
+        rsdp = scan_rsdp(ebda, 1024);
+    }
+    if (!rsdp) {
+        rsdp = scan_rsdp(0xE0000, 0x20000);
+    }
+    if (!rsdp) {
+        dbg_printf("[%d] ACPI RSDP not found\n", ticks);
+        return false;
+    }
+
+    rsdt = map_table(rsdp->rsdt_address);
+    if (!acpi_checksum(rsdt, rsdt->length)) {
+        dbg_printf("[%d] ACPI RSDT checksum mismatch\n", ticks);
+        rsdt = NULL;
+        return false;
+    }
+
+    dbg_printf("[%d] ACPI revision %u, RSDT at 0x%x\n", ticks, rsdp->revision, rsdp->rsdt_address);
+    return true;
+}
+
+struct acpi_sdt_header* acpi_find_table(const char *signature) {
+    if (!rsdt) {
+        return NULL;
+    }
+
+    uint32_t entries = (rsdt->length - sizeof(struct acpi_sdt_header)) / sizeof(uint32_t);
+    uint32_t *pointers = (uint32_t*)((uint8_t*)rsdt + sizeof(struct acpi_sdt_header));
+
+    for (uint32_t i = 0; i < entries; i++) {
+        struct acpi_sdt_header *table = map_table(pointers[i]);
+        if (table->signature[0] == signature[0] && table->signature[1] == signature[1] &&
+            table->signature[2] == signature[2] && table->signature[3] == signature[3] &&
+            acpi_checksum(table, table->length)) {
+            return table;
+        }
+    }
+    return NULL;
+}
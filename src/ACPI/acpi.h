@@ -0,0 +1,82 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+}__attribute__((packed));
+
+struct acpi_sdt_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+}__attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_sdt_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+}__attribute__((packed));
+
+struct acpi_madt_entry {
+    uint8_t type;
+    uint8_t length;
+}__attribute__((packed));
+
+#define ACPI_MADT_LAPIC 0
+
+struct acpi_madt_lapic {
+    struct acpi_madt_entry entry;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+}__attribute__((packed));
+
+#define ACPI_MADT_LAPIC_ENABLED 0x1
+#define ACPI_MADT_LAPIC_ONLINE_CAPABLE 0x2
+
+struct acpi_gas {
+    uint8_t address_space; // 0 = memory, 1 = I/O
+    uint8_t bit_width;
+    uint8_t bit_offset;
+    uint8_t access_size;
+    uint64_t address;
+}__attribute__((packed));
+
+struct acpi_hpet {
+    struct acpi_sdt_header header;
+    uint32_t event_timer_block_id;
+    struct acpi_gas base;
+    uint8_t hpet_number;
+    uint16_t minimum_tick;
+    uint8_t page_protection;
+}__attribute__((packed));
+
+bool init_ACPI();
+struct acpi_sdt_header* acpi_find_table(const char *signature);
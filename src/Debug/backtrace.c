@@ -0,0 +1,73 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "backtrace.h"
+#include "ksyms.h"
+#include "../Paging/paging.h"
+#include "../Drivers/VGA/vga.h"
+
+// Follows the saved EBP chain, every C function keeps its frame pointer:
+// [ebp] is the caller's ebp, [ebp + 4] the return address into it. Fills in up
+// to max return addresses, innermost first. Only reads identity mapped memory
+// and stops at anything that doesn't look like a frame, so a corrupt stack or
+// the garbage the boot loader left in ebp ends the walk instead of faulting.
+uint32_t unwind_stack(uint32_t ebp, uint32_t *addresses, uint32_t max) {
+    uint32_t limit = ebp + BACKTRACE_STACK_LIMIT;
+    uint32_t depth = 0;
+
+    while (depth < max && ebp >= PAGE_SIZE && ebp <= IDENTITY_MAP_SIZE - 8 && ebp < limit && !(ebp & 3)) {
+        const uint32_t *frame = (const uint32_t*)ebp;
+
+        if (ksym_index(frame[1]) < 0) {
+            break;
+        }
+        addresses[depth++] = frame[1];
+        if (frame[0] <= ebp) { // Stacks grow down, callers' frames sit higher
+            break;
+        }
+        ebp = frame[0];
+    }
+    return depth;
+}
+
+static void backtrace_line(uint32_t index, uint32_t address) {
+    char name[64];
+
+    ksym_snprint(name, sizeof(name), address);
+    dbg_printf("  #%-2u 0x%08x %s\n", index, address, name);
+}
+
+// eip is where the code stopped, 0 if it isn't known, ebp its frame pointer
+void backtrace_print(uint32_t eip, uint32_t ebp) {
+    uint32_t addresses[BACKTRACE_MAX_DEPTH];
+    uint32_t depth = unwind_stack(ebp, addresses, BACKTRACE_MAX_DEPTH);
+    uint32_t index = 0;
+
+    dbg_printf("Backtrace:\n");
+    if (eip) {
+        backtrace_line(index++, eip);
+    }
+    for (uint32_t i = 0; i < depth; i++) {
+        backtrace_line(index++, addresses[i]);
+    }
+    if (depth == BACKTRACE_MAX_DEPTH) {
+        dbg_printf("  ...\n");
+    }
+}
+
+// The callers of whoever calls this
+void dump_stack() {
+    backtrace_print(0, (uint32_t)__builtin_frame_address(0));
+}
@@ -0,0 +1,26 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+#define BACKTRACE_MAX_DEPTH   16
+#define BACKTRACE_STACK_LIMIT 0x10000 // Furthest a chain may reach past its first frame, the boot stack's size
+
+uint32_t unwind_stack(uint32_t ebp, uint32_t *addresses, uint32_t max);
+void backtrace_print(uint32_t eip, uint32_t ebp);
+void dump_stack();
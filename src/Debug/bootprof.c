@@ -0,0 +1,122 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "bootprof.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Log/ftrace.h"
+#include "../SMP/smp.h"
+#include "../Time/tsc.h"
+
+volatile bool booting = false;
+
+static struct boot_phase phases[BOOT_MAX_PHASES];
+static uint32_t phase_count = 0;
+static struct boot_phase *current = NULL;
+static uint64_t phase_start = 0;
+static uint64_t boot_start = 0; // rdtsc() on entry to main()
+
+static uint64_t cycles_to_us(uint64_t cycles) {
+    return cycles * 1000 / tsc_khz;
+}
+
+// First thing in main(). The TSC counts from reset, so whatever it reads now
+// went to the firmware and the boot loader.
+void boot_profile_start() {
+    boot_start = rdtsc();
+    booting = true;
+}
+
+// Ends the open phase, if any, and starts the next one
+void boot_phase_begin(const char *name) {
+    if (!booting) {
+        return;
+    }
+    boot_phase_end();
+    if (phase_count == BOOT_MAX_PHASES) {
+        return;
+    }
+
+    current = &phases[phase_count++];
+    current->name = name;
+    current->cycles = 0;
+    current->wait_cycles = 0;
+    trace_begin(TRACEPOINT_INIT, name, 0);
+    phase_start = rdtsc();
+}
+
+void boot_phase_end() {
+    if (!current) {
+        return;
+    }
+    current->cycles = rdtsc() - phase_start;
+    trace_end(TRACEPOINT_INIT, current->name, 0);
+    current = NULL;
+}
+
+// Only the BSP runs the init sequence, waits elsewhere aren't on its path
+void boot_wait_account(uint64_t cycles) {
+    if (current && (!cpus[0].self || this_cpu()->id == 0)) {
+        current->wait_cycles += cycles;
+    }
+}
+
+// Insertion sort, most expensive first
+static void sort_phases() {
+    for (uint32_t i = 1; i < phase_count; i++) {
+        struct boot_phase phase = phases[i];
+        uint32_t j = i;
+
+        for (; j > 0 && phases[j - 1].cycles < phase.cycles; j--) {
+            phases[j] = phases[j - 1];
+        }
+        phases[j] = phase;
+    }
+}
+
+// The end of boot. Prints every phase by cost, with the ones that mostly
+// waited on hardware flagged as the first places to look for boot time.
+void boot_report() {
+    uint64_t total;
+    uint64_t accounted = 0;
+    uint64_t us;
+
+    boot_phase_end();
+    booting = false;
+    if (!tsc_khz) {
+        dbg_printf("[%d] No TSC, no boot profile\n", ticks);
+        return;
+    }
+
+    total = rdtsc() - boot_start;
+    sort_phases();
+
+    us = cycles_to_us(boot_start);
+    dbg_printf("[%d] Boot profile: %u.%03u ms before main(), then:\n", ticks, (uint32_t)(us / 1000), (uint32_t)(us % 1000));
+    for (uint32_t i = 0; i < phase_count; i++) {
+        const struct boot_phase *phase = &phases[i];
+        uint32_t share = (uint32_t)(phase->cycles * 100 / total);
+        uint32_t wait = phase->cycles ? (uint32_t)(phase->wait_cycles * 100 / phase->cycles) : 0;
+
+        us = cycles_to_us(phase->cycles);
+        accounted += phase->cycles;
+        dbg_printf("[%d]   %6u.%03u ms %3u%%  wait %3u%%  %s%s\n", ticks, (uint32_t)(us / 1000), (uint32_t)(us % 1000),
+                   share, wait, phase->name, wait >= BOOT_WAIT_PERCENT ? "  <- spin-wait" : "");
+    }
+    us = cycles_to_us(total - accounted);
+    dbg_printf("[%d]   %6u.%03u ms       outside any phase\n", ticks, (uint32_t)(us / 1000), (uint32_t)(us % 1000));
+    us = cycles_to_us(total);
+    dbg_printf("[%d]   %6u.%03u ms       main() to ready\n", ticks, (uint32_t)(us / 1000), (uint32_t)(us % 1000));
+}
@@ -0,0 +1,56 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+#define BOOT_MAX_PHASES   48
+#define BOOT_WAIT_PERCENT 50 // Phases waiting this much of their time get flagged
+
+// One step of main()'s init sequence, timed with the TSC
+struct boot_phase {
+    const char *name;
+    uint64_t cycles;
+    uint64_t wait_cycles; // Spent in boot_wait_begin()/boot_wait_end() loops
+};
+
+extern volatile bool booting;
+
+void boot_profile_start();
+void boot_phase_begin(const char *name);
+void boot_phase_end();
+void boot_wait_account(uint64_t cycles);
+void boot_report();
+
+// Brackets a busy-wait or a poll on hardware so the report can tell waiting from
+// work. A branch once boot is over.
+static inline uint64_t boot_wait_begin() {
+    return booting ? rdtsc() : 0;
+}
+
+static inline void boot_wait_end(uint64_t start) {
+    if (start) {
+        boot_wait_account(rdtsc() - start);
+    }
+}
+
+// Times one statement as a phase named after its source text
+#define boot_step(call) do {       \
+    boot_phase_begin(#call);       \
+    call;                          \
+    boot_phase_end();              \
+} while (0)
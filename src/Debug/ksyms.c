@@ -0,0 +1,62 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ksyms.h"
+#include "../Headers/format.h"
+
+// The function containing address, -1 outside the kernel's text. Binary search
+// for the last symbol at or below it.
+int32_t ksym_index(uint32_t address) {
+    uint32_t low = 0;
+    uint32_t high = ksym_count;
+
+    if (address < (uint32_t)kernel_text_start || address >= (uint32_t)kernel_text_end ||
+        !ksym_count || address < ksym_addresses[0]) {
+        return -1;
+    }
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (ksym_addresses[middle] <= address) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    return (int32_t)low;
+}
+
+// Name of the function containing address, NULL if there's none
+const char *ksym_lookup(uint32_t address, uint32_t *offset) {
+    int32_t index = ksym_index(address);
+
+    if (index < 0) {
+        return NULL;
+    }
+    if (offset) {
+        *offset = address - ksym_addresses[index];
+    }
+    return ksym_names[index];
+}
+
+// "name+0x1f", or the bare address when it isn't in the kernel
+int ksym_snprint(char *buffer, uint32_t size, uint32_t address) {
+    uint32_t offset;
+    const char *name = ksym_lookup(address, &offset);
+
+    if (!name) {
+        return snprintf(buffer, size, "0x%08x", address);
+    }
+    return snprintf(buffer, size, "%s+0x%x", name, offset);
+}
@@ -0,0 +1,33 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+// Every function in the kernel by address, sorted. Generated from the linked
+// kernel by tools/ksyms.py and linked in on a second pass, see the Makefile.
+extern const uint32_t ksym_count;
+extern const uint32_t ksym_addresses[];
+extern const char *const ksym_names[];
+
+// From linker.ld
+extern uint8_t kernel_text_start[];
+extern uint8_t kernel_text_end[];
+
+int32_t ksym_index(uint32_t address);
+const char *ksym_lookup(uint32_t address, uint32_t *offset);
+int ksym_snprint(char *buffer, uint32_t size, uint32_t address);
@@ -0,0 +1,210 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "profile.h"
+#include "ksyms.h"
+#include "backtrace.h"
+#include "../Headers/format.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/APIC/apic.h"
+#include "../Lock/spinlock.h"
+
+#define PROFILE_USER   -2 // ksym_index() is -1 for anything else outside the kernel
+#define PROFILE_PIT_VECTOR 32
+
+volatile bool profiling = false;
+
+// Open addressing on a hash of the frames. Samplers run with interrupts off.
+static struct profile_stack stacks[PROFILE_STACKS];
+static struct spinlock profile_lock = SPINLOCK_INIT("profile_lock");
+static uint32_t samples = 0;
+static uint32_t lost = 0; // Taken with the table full
+
+// Samples per function, for the report
+static struct {
+    int32_t symbol;
+    uint32_t count;
+} functions[PROFILE_STACKS];
+
+static uint32_t hash_frames(const uint32_t *frames, uint32_t depth) {
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool same_stack(const struct profile_stack *stack, const uint32_t *frames, uint32_t depth) {
+    if (stack->depth != depth) {
+        return false;
+    }
+    for (uint32_t i = 0; i < depth; i++) {
+        if (stack->frames[i] != frames[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The PIT on the BSP and the LAPIC timer on the APs, both run at 1000 Hz while busy
+void profile_sample(struct InterruptRegisters *regs) {
+    uint32_t frames[PROFILE_MAX_DEPTH];
+    uint32_t depth = 1;
+
+    if (regs->int_no != PROFILE_PIT_VECTOR && regs->int_no != LAPIC_TIMER_VECTOR) {
+        return;
+    }
+    if ((regs->cs & 0x3) == 0x3) {
+        frames[0] = 0;
+    } else {
+        frames[0] = regs->eip;
+        depth += unwind_stack(regs->ebp, frames + 1, PROFILE_MAX_DEPTH - 1);
+    }
+
+    uint32_t hash = hash_frames(frames, depth);
+    spin_lock(&profile_lock);
+    samples++;
+    for (uint32_t probe = 0; probe < PROFILE_STACKS; probe++) {
+        struct profile_stack *stack = &stacks[(hash + probe) & (PROFILE_STACKS - 1)];
+
+        if (!stack->count) {
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(uint32_t));
+        } else if (!same_stack(stack, frames, depth)) {
+            continue;
+        }
+        stack->count++;
+        spin_unlock(&profile_lock);
+        return;
+    }
+    lost++;
+    spin_unlock(&profile_lock);
+}
+
+void profile_start() {
+    uint32_t flags = spin_lock_irqsave(&profile_lock);
+    memset(stacks, 0, sizeof(stacks));
+    samples = 0;
+    lost = 0;
+    spin_unlock_irqrestore(&profile_lock, flags);
+    profiling = true;
+}
+
+// Returns once no CPU is still in profile_sample()
+void profile_stop() {
+    profiling = false;
+    uint32_t flags = spin_lock_irqsave(&profile_lock);
+    spin_unlock_irqrestore(&profile_lock, flags);
+}
+
+static const char *frame_name(uint32_t address, bool caller, char *buffer, uint32_t size) {
+    // A return address may already be past the end of a call that doesn't return
+    const char *name = ksym_lookup(caller ? address - 1 : address, NULL);
+
+    if (name) {
+        return name;
+    }
+    if (!address) {
+        return "[user]";
+    }
+    snprintf(buffer, size, "0x%08x", address);
+    return buffer;
+}
+
+// Shell sort, by symbol or by count descending
+static void sort_functions(uint32_t count, bool by_count) {
+    for (uint32_t gap = count / 2; gap; gap /= 2) {
+        for (uint32_t i = gap; i < count; i++) {
+            int32_t symbol = functions[i].symbol;
+            uint32_t hits = functions[i].count;
+            uint32_t j = i;
+
+            for (; j >= gap; j -= gap) {
+                bool before = by_count ? functions[j - gap].count < hits : functions[j - gap].symbol > symbol;
+                if (!before) {
+                    break;
+                }
+                functions[j] = functions[j - gap];
+            }
+            functions[j].symbol = symbol;
+            functions[j].count = hits;
+        }
+    }
+}
+
+// Whole stacks in the folded format flamegraph.pl takes, root first: "a;b;c 12"
+static void profile_write_folded() {
+    char line[1024];
+    char address[16];
+
+    for (uint32_t i = 0; i < PROFILE_STACKS; i++) {
+        const struct profile_stack *stack = &stacks[i];
+        uint32_t length = 0;
+
+        if (!stack->count) {
+            continue;
+        }
+        for (uint32_t frame = stack->depth; frame-- > 0 && length < sizeof(line);) {
+            length += snprintf(line + length, sizeof(line) - length, "%s%s", frame + 1 < stack->depth ? ";" : "",
+                               frame_name(stack->frames[frame], frame > 0, address, sizeof(address)));
+        }
+        if (length < sizeof(line)) {
+            length += snprintf(line + length, sizeof(line) - length, " %u\n", stack->count);
+        }
+        outsb(PROFILE_PORT, line, length < sizeof(line) ? length : sizeof(line) - 1);
+    }
+}
+
+// Stops profiling, prints the top functions by samples taken in them and writes
+// every stack to the debug console for a flame graph
+void profile_report(uint32_t top) {
+    uint32_t count = 0;
+    uint32_t merged = 0;
+
+    profile_stop();
+    if (!samples) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < PROFILE_STACKS; i++) {
+        if (stacks[i].count) {
+            uint32_t eip = stacks[i].frames[0];
+            functions[count].symbol = eip ? ksym_index(eip) : PROFILE_USER;
+            functions[count].count = stacks[i].count;
+            count++;
+        }
+    }
+    sort_functions(count, false);
+    for (uint32_t i = 0; i < count; i++) {
+        if (merged && functions[merged - 1].symbol == functions[i].symbol) {
+            functions[merged - 1].count += functions[i].count;
+        } else {
+            functions[merged++] = functions[i];
+        }
+    }
+    sort_functions(merged, true);
+
+    dbg_printf("[%d] Profile: %u samples, %u lost, %u functions\n", ticks, samples, lost, merged);
+    for (uint32_t i = 0; i < merged && i < top; i++) {
+        int32_t symbol = functions[i].symbol;
+        uint32_t permille = functions[i].count * 1000 / samples;
+        const char *name = symbol >= 0 ? ksym_names[symbol] : symbol == PROFILE_USER ? "[user]" : "[unknown]";
+
+        dbg_printf("[%d]   %6u %3u.%u%%  %s\n", ticks, functions[i].count, permille / 10, permille % 10, name);
+    }
+    profile_write_folded();
+}
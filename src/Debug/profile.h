@@ -0,0 +1,45 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../IDT/idt.h"
+
+#define PROFILE_STACKS    2048 // Distinct call stacks kept, a power of two
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_PORT      0xe9 // Folded stacks go to the QEMU debug console
+
+// One distinct call stack and how often a timer interrupt found the CPU in it
+struct profile_stack {
+    uint32_t count;
+    uint32_t depth;
+    uint32_t frames[PROFILE_MAX_DEPTH]; // Interrupted EIP first, 0 for user mode
+};
+
+extern volatile bool profiling;
+
+// Called for every interrupt, costs a predicted branch while not profiling
+#define profile_tick(regs) do {                 \
+    if (__builtin_expect(profiling, 0)) {       \
+        profile_sample(regs);                   \
+    }                                           \
+} while (0)
+
+void profile_sample(struct InterruptRegisters *regs);
+void profile_start();
+void profile_stop();
+void profile_report(uint32_t top);
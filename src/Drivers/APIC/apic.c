@@ -0,0 +1,109 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "apic.h"
+#include "../../Paging/paging.h"
+#include "../PIT/pit.h"
+#include "../../Debug/bootprof.h"
+
+static volatile uint32_t *lapic_base = NULL;
+uint32_t lapic_ticks_per_ms = 0;
+
+void init_LAPIC(uint32_t base) {
+    lapic_base = map_physical_region(base, PAGE_SIZE, PAGE_NO_CACHE | PAGE_WRITE_THROUGH);
+}
+
+bool lapic_present() {
+    return lapic_base != NULL;
+}
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic_base[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_base[reg / 4] = value;
+}
+
+void lapic_enable() {
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SPURIOUS, LAPIC_SOFTWARE_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+uint32_t lapic_id() {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send_icr(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ESR, 0);
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile ("pause");
+    }
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT | LAPIC_ICR_LEVEL);
+    lapic_send_icr(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_LEVEL); // De-assert, needed by old APICs
+}
+
+void lapic_send_startup(uint32_t apic_id, uint8_t vector) {
+    lapic_send_icr(apic_id, LAPIC_ICR_STARTUP | vector);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send_icr(apic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+// Counts LAPIC timer ticks (divide by 16) over 10 PIT ticks. Needs the PIT running.
+void lapic_timer_calibrate() {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED);
+
+    uint64_t wait = boot_wait_begin();
+    uint32_t start = ticks;
+    while (ticks == start); // Line up with a tick edge
+
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    start = ticks;
+    while (ticks - start < 10);
+    boot_wait_end(wait);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    lapic_ticks_per_ms = elapsed / 10 * frequency / 1000;
+}
+
+void lapic_timer_start(uint32_t freq) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, lapic_ticks_per_ms * 1000 / freq);
+}
+
+void lapic_timer_oneshot(uint32_t ms) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, lapic_ticks_per_ms * ms);
+}
+
+void lapic_timer_stop() {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
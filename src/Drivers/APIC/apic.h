@@ -0,0 +1,70 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../../Headers/stdint.h"
+#include "../../Headers/util.h"
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+// Local APIC registers, offsets from the MMIO base
+#define LAPIC_ID             0x020
+#define LAPIC_VERSION        0x030
+#define LAPIC_TPR            0x080
+#define LAPIC_EOI            0x0B0
+#define LAPIC_SPURIOUS       0x0F0
+#define LAPIC_ESR            0x280
+#define LAPIC_ICR_LOW        0x300
+#define LAPIC_ICR_HIGH       0x310
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_TIMER_INITIAL  0x380
+#define LAPIC_TIMER_CURRENT  0x390
+#define LAPIC_TIMER_DIVIDE   0x3E0
+
+#define LAPIC_SOFTWARE_ENABLE 0x100
+
+#define LAPIC_TIMER_ONESHOT  0x00000
+#define LAPIC_TIMER_MASKED   0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+#define LAPIC_ICR_INIT       0x00500
+#define LAPIC_ICR_STARTUP    0x00600
+#define LAPIC_ICR_PENDING    0x01000
+#define LAPIC_ICR_ASSERT     0x04000
+#define LAPIC_ICR_LEVEL      0x08000
+
+// Interrupt vectors owned by the local APIC, right after the PIC range
+#define LAPIC_TIMER_VECTOR    48
+#define LAPIC_IPI_VECTOR      49
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+extern uint32_t lapic_ticks_per_ms;
+
+void init_LAPIC(uint32_t base);
+bool lapic_present();
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+void lapic_enable();
+uint32_t lapic_id();
+void lapic_eoi();
+void lapic_send_init(uint32_t apic_id);
+void lapic_send_startup(uint32_t apic_id, uint8_t vector);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+void lapic_timer_calibrate();
+void lapic_timer_start(uint32_t freq);
+void lapic_timer_oneshot(uint32_t ms);
+void lapic_timer_stop();
@@ -29,6 +29,9 @@
 // Total Amount of furries tried to fix this Code = 1 (Yes, even furries give up eventually)
 
 #include "ata.h"
+#include "../../Log/klog.h"
+#include "../../Log/ftrace.h"
+#include "../../Debug/bootprof.h"
 
 // ATA ports and commands for primary controller
 static uint16_t ATA_PRIMARY_COMMAND_PORT = 0x1F7;
@@ -48,16 +51,83 @@ void select_drive(bool is_secondary, bool is_slave) {
     outb(drive_select_port, drive_select_value);
 }
 
-void wait_for_ready(bool is_secondary) {
+// Woken by the channel's IRQ when a command completes
+static struct wait_queue ata_wq[2] = { WAIT_QUEUE_INIT(ata_wq[0]), WAIT_QUEUE_INIT(ata_wq[1]) };
+
+// One command at a time per channel, both drives share the task file and data port
+static struct spinlock ata_lock[2] = { SPINLOCK_INIT("ata_lock[0]"), SPINLOCK_INIT("ata_lock[1]") };
+static bool ata_busy[2] = { false, false };
+
+static bool ata_try_claim(bool is_secondary) {
+    uint32_t flags = spin_lock_irqsave(&ata_lock[is_secondary]);
+    bool claimed = !ata_busy[is_secondary];
+    ata_busy[is_secondary] = true;
+    spin_unlock_irqrestore(&ata_lock[is_secondary], flags);
+    return claimed;
+}
+
+// Sleeps while another thread owns the channel. It can take a while, so this
+// isn't a spinlock itself.
+static void ata_claim_channel(bool is_secondary) {
+    wait_event(ata_wq[is_secondary], ata_try_claim(is_secondary));
+}
+
+static void ata_release_channel(bool is_secondary) {
+    uint32_t flags = spin_lock_irqsave(&ata_lock[is_secondary]);
+    ata_busy[is_secondary] = false;
+    spin_unlock_irqrestore(&ata_lock[is_secondary], flags);
+    wake_up_all(&ata_wq[is_secondary]);
+}
+
+static void ata_irq_handler(struct InterruptRegisters *r) {
+    bool is_secondary = r->int_no == 32 + ATA_SECONDARY_IRQ;
+    inb(is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT); // Reading status acknowledges it
+    wake_up_all(&ata_wq[is_secondary]);
+}
+
+void install_ata_irq() {
+    irq_install_handler(ATA_PRIMARY_IRQ, ata_irq_handler);
+    irq_install_handler(ATA_SECONDARY_IRQ, ata_irq_handler);
+}
+
+// Done once BSY clears, or straight away on a floating bus. The alternate status
+// port doesn't acknowledge the IRQ.
+static bool ata_settled(uint16_t control_port) {
+    uint8_t status = inb(control_port);
+    return status == 0xFF || !(status & 0x80);
+}
+
+bool wait_for_ready(bool is_secondary) {
     uint16_t command_port = is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
-    while (true) {
-        uint8_t status = inb(command_port);
-        if ((status & 0x80) == 0) break; // Drive not busy
-        if (status & 0x01) {
-            dbg_printf("[%d] Drive error occurred.\n", ticks);
-            return;
-        }
+    uint16_t control_port = is_secondary ? ATA_SECONDARY_CONTROL_PORT : ATA_PRIMARY_CONTROL_PORT;
+    bool settled = false;
+    uint64_t wait = boot_wait_begin();
+
+    // PIO writes clear BSY without an IRQ once the drive wants the data, which takes
+    // microseconds, so a short poll catches them
+    for (uint32_t i = 0; i < ATA_POLL_READS && !settled; i++) {
+        settled = ata_settled(control_port);
     }
+    // Otherwise one sleep for the whole timeout. The completion IRQ (or a channel
+    // release, which shares the queue) wakes it and BSY is checked again each time.
+    if (!settled) {
+        settled = wait_event_timeout(ata_wq[is_secondary], ata_settled(control_port), ATA_TIMEOUT_MS);
+    }
+    boot_wait_end(wait);
+
+    uint8_t status = inb(command_port);
+    if (status == 0xFF) { // Floating bus, nothing attached
+        return false;
+    }
+    if (!settled) {
+        klog(KLOG_ERR, "[%d] Drive timed out.\n", ticks);
+        return false;
+    }
+    if (status & 0x01) {
+        klog(KLOG_ERR, "[%d] Drive error occurred.\n", ticks);
+        return false;
+    }
+    return true;
 }
 
 void identify_drive(struct DriveInfo *drive_info, bool is_slave, bool is_secondary) {
@@ -67,6 +137,7 @@ void identify_drive(struct DriveInfo *drive_info, bool is_slave, bool is_seconda
 
     uint16_t identify_data[256] = {0};
 
+    ata_claim_channel(is_secondary);
     select_drive(is_secondary, is_slave);
 
     // Send IDENTIFY command
@@ -74,11 +145,16 @@ void identify_drive(struct DriveInfo *drive_info, bool is_slave, bool is_seconda
     outb(command_port, ATA_IDENTIFY_COMMAND);
 
     // Polling until the drive is ready
-    wait_for_ready(is_secondary);
+    if (!wait_for_ready(is_secondary)) {
+        ata_release_channel(is_secondary);
+        drive_info->detected = false;
+        return;
+    }
 
     // Read the IDENTIFY data
     uint16_t data_port = is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
     insw(data_port, identify_data, 256);
+    ata_release_channel(is_secondary);
 
     // Check if the device is a drive
     if (identify_data[0] == 0x0000 || identify_data[0] == 0xFFFF) {
@@ -194,7 +270,7 @@ void write_command(uint16_t command_port, uint8_t command, uint64_t lba, uint32_
 
 void read_sector_lba48(uint64_t lba, void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % SECTOR_SIZE != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
         return;
     }
 
@@ -202,6 +278,7 @@ void read_sector_lba48(uint64_t lba, void *buffer, uint32_t buffer_size, struct
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
 
     for (uint32_t i = 0; i < sector_count; i++) {
@@ -213,17 +290,20 @@ void read_sector_lba48(uint64_t lba, void *buffer, uint32_t buffer_size, struct
         outb(command_port + 6, 0x40); // LBA mode
         outb(command_port + 7, 0x24); // READ SECTOR(S) EXT command
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         insw(data_port, buffer, SECTOR_SIZE / 2);
         buffer = (uint8_t *)buffer + SECTOR_SIZE;
         lba++;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void write_sector_lba48(uint64_t lba, const void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % SECTOR_SIZE != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
         return;
     }
 
@@ -231,8 +311,8 @@ void write_sector_lba48(uint64_t lba, const void *buffer, uint32_t buffer_size,
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
-retursector_numn;
     for (uint32_t i = 0; i < sector_count; i++) {
         outb(command_port + 1, (sector_count >> 8) & 0xFF);
         outb(command_port + 2, sector_count & 0xFF);
@@ -242,17 +322,20 @@ retursector_numn;
         outb(command_port + 6, 0x40); // LBA mode
         outb(command_port + 7, 0x34); // WRITE SECTOR(S) EXT command
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         outsw(data_port, buffer, SECTOR_SIZE / 2);
         buffer = (const uint8_t *)buffer + SECTOR_SIZE;
         lba++;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void read_sector_lba28(uint32_t lba, void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % drive_info->sector_size != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
         return;
     }
 
@@ -260,22 +343,26 @@ void read_sector_lba28(uint32_t lba, void *buffer, uint32_t buffer_size, struct
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
 
     for (uint32_t i = 0; i < sector_count; i++) {
         write_command(command_port, 0x20, lba, sector_count);
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         insw(data_port, buffer, drive_info->sector_size / 2);
         buffer = (uint8_t *)buffer + drive_info->sector_size;
         lba++;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void write_sector_lba28(uint32_t lba, const void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % drive_info->sector_size != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
         return;
     }
 
@@ -283,22 +370,26 @@ void write_sector_lba28(uint32_t lba, const void *buffer, uint32_t buffer_size,
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
 
     for (uint32_t i = 0; i < sector_count; i++) {
         write_command(command_port, 0x30, lba, sector_count);
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         outsw(data_port, buffer, drive_info->sector_size / 2);
         buffer = (const uint8_t *)buffer + drive_info->sector_size;
         lba++;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void read_sector_chs(uint16_t cylinder, uint8_t head, uint8_t sector, void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % drive_info->sector_size != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
         return;
     }
 
@@ -306,6 +397,7 @@ void read_sector_chs(uint16_t cylinder, uint8_t head, uint8_t sector, void *buff
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
 
     for (uint32_t i = 0; i < sector_count; i++) {
@@ -325,22 +417,26 @@ void read_sector_chs(uint16_t cylinder, uint8_t head, uint8_t sector, void *buff
         // Write the command
         outb(command_port + 7, 0x21); // Read sectors command
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         insw(data_port, buffer, drive_info->sector_size / 2);
         buffer = (uint8_t *)buffer + drive_info->sector_size;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void write_sector_chs(uint16_t cylinder, uint8_t head, uint8_t sector, const void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
     if (buffer == NULL || buffer_size == 0 || buffer_size % drive_info->sector_size != 0) {
-        dbg_printf("[%d] Invalid buffer or buffer size.\n", ticks);
+        klog(KLOG_ERR, "[%d] Invalid buffer or buffer size.\n", ticks);
     }
 
     uint32_t sector_count = buffer_size / drive_info->sector_size;
     uint16_t command_port = drive_info->is_secondary ? ATA_SECONDARY_COMMAND_PORT : ATA_PRIMARY_COMMAND_PORT;
     uint16_t data_port = drive_info->is_secondary ? ATA_SECONDARY_DATA_PORT : ATA_PRIMARY_DATA_PORT;
 
+    ata_claim_channel(drive_info->is_secondary);
     select_drive(drive_info->is_secondary, drive_info->is_slave);
 
     for (uint32_t i = 0; i < sector_count; i++) {
@@ -360,14 +456,18 @@ void write_sector_chs(uint16_t cylinder, uint8_t head, uint8_t sector, const voi
         // Write the command
         outb(command_port + 7, 0x31); // Write sectors command
 
-        wait_for_ready(drive_info->is_secondary);
+        if (!wait_for_ready(drive_info->is_secondary)) {
+            break;
+        }
 
         outsw(data_port, buffer, drive_info->sector_size / 2);
         buffer = (const uint8_t *)buffer + drive_info->sector_size;
     }
+    ata_release_channel(drive_info->is_secondary);
 }
 
 void read_sector(uint32_t sector, void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
+    trace_begin(TRACEPOINT_ATA, "read_sector", sector);
     if (drive_info->lba_48) {
         uint64_t lba_48 = (uint64_t)sector;
         read_sector_lba48(lba_48, buffer, buffer_size, drive_info);
@@ -379,11 +479,13 @@ void read_sector(uint32_t sector, void *buffer, uint32_t buffer_size, struct Dri
         uint8_t sector_num = (uint8_t)(((sector % drive_info->sectors_per_track) + 1) & 0xFF);
         read_sector_chs(cylinder, head, sector_num, buffer, buffer_size, drive_info);
     } else {
-        dbg_printf("[%d] Unsupported addressing mode.\n", ticks);
+        klog(KLOG_ERR, "[%d] Unsupported addressing mode.\n", ticks);
     }
+    trace_end(TRACEPOINT_ATA, "read_sector", sector);
 }
 
 void write_sector(uint32_t sector, const void *buffer, uint32_t buffer_size, struct DriveInfo *drive_info) {
+    trace_begin(TRACEPOINT_ATA, "write_sector", sector);
     if (drive_info->lba_48) {
         uint64_t lba_48 = (uint64_t)sector;
         write_sector_lba48(lba_48, buffer, buffer_size, drive_info);
@@ -395,8 +497,9 @@ void write_sector(uint32_t sector, const void *buffer, uint32_t buffer_size, str
         uint8_t sector_num = (uint8_t)(((sector % drive_info->sectors_per_track) + 1) & 0xFF);
         write_sector_chs(cylinder, head, sector_num, buffer, buffer_size, drive_info);
     } else {
-        dbg_printf("[%d] Unsupported addressing mode.\n", ticks);
+        klog(KLOG_ERR, "[%d] Unsupported addressing mode.\n", ticks);
     }
+    trace_end(TRACEPOINT_ATA, "write_sector", sector);
 }
 
 void print_drive_info(struct DriveInfo *drive_info) {
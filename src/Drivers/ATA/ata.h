@@ -21,6 +21,8 @@
 #include "../PCI/pci.h"
 #include "../CMOS/cmos.h"
 #include "../PS2/ps2.h"
+#include "../../Scheduler/wait.h"
+#include "../../Lock/spinlock.h"
 
 struct DriveInfo {
     bool detected;
@@ -44,9 +46,14 @@ struct DriveInfo {
 
 #define ATA_IDENTIFY_COMMAND 0xEC
 #define SECTOR_SIZE 512
+#define ATA_TIMEOUT_MS 5000
+#define ATA_POLL_READS 64 // Status reads before wait_for_ready() sleeps
+#define ATA_PRIMARY_IRQ 14
+#define ATA_SECONDARY_IRQ 15
 
 void select_drive(bool is_secondary, bool is_slave);
-void wait_for_ready(bool is_secondary);
+void install_ata_irq();
+bool wait_for_ready(bool is_secondary);
 void identify_drive(struct DriveInfo *drive_info, bool is_slave, bool is_secondary);
 bool check_ata_controller();
 void write_command(uint16_t command_port, uint8_t command, uint64_t lba, uint32_t sector_count);
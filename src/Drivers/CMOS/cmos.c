@@ -14,6 +14,7 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "cmos.h"
+#include "../../Debug/bootprof.h"
 
 uint32_t current_year = 2024;
 int32_t century_register = 0x00;
@@ -29,6 +30,13 @@ int32_t get_update_in_progress_flag() {
       return (inb(cmos_data) & 0x80);
 }
 
+// The RTC updates once a second and its registers aren't stable for up to 2 ms
+static void wait_for_update() {
+    uint64_t wait = boot_wait_begin();
+    while (get_update_in_progress_flag());
+    boot_wait_end(wait);
+}
+
 uint8_t get_RTC_register(int reg) {
       outb(cmos_address, (uint8_t)reg);
       return inb(cmos_data);
@@ -50,7 +58,7 @@ void read_rtc() {
     uint8_t last_century;
     uint8_t registerB;
 
-    while (get_update_in_progress_flag());
+    wait_for_update();
     second = get_RTC_register(0x00);
     minute = get_RTC_register(0x02);
     hour = get_RTC_register(0x04);
@@ -70,7 +78,7 @@ void read_rtc() {
         last_year = (uint8_t)year;
         last_century = century;
 
-        while (get_update_in_progress_flag());
+        wait_for_update();
         second = get_RTC_register(0x00);
         minute = get_RTC_register(0x02);
         hour = get_RTC_register(0x04);
@@ -144,7 +152,7 @@ void read_rtc() {
 
 void update_cmos() {
       // Ensure CMOS update is not in progress
-      while (get_update_in_progress_flag());
+      wait_for_update();
 
       // Set the RTC registers with the current date and time values
       outb(cmos_address, 0x00);
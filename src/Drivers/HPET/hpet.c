@@ -0,0 +1,251 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "hpet.h"
+#include "../../ACPI/acpi.h"
+#include "../../Paging/paging.h"
+#include "../PIT/pit.h"
+#include "../VGA/vga.h"
+#include "../../Time/clocksource.h"
+#include "../../Time/tick.h"
+
+static volatile uint8_t *hpet_base = NULL;
+static uint32_t hpet_period_fs = 0; // Femtoseconds per counter tick
+static uint32_t hpet_timers = 0;
+static bool hpet_64bit = false;
+static bool hpet_legacy_capable = false;
+static bool hpet_drives_tick = false; // Comparator 0 replaced the PIT on IRQ0
+
+static uint32_t hpet_read(uint32_t reg) {
+    return *(volatile uint32_t*)(hpet_base + reg);
+}
+
+static void hpet_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(hpet_base + reg) = value;
+}
+
+// Re-reads the high half until it's stable, so a carry between the two reads can't tear
+uint64_t hpet_read_counter() {
+    if (!hpet_64bit) {
+        return hpet_read(HPET_MAIN_COUNTER);
+    }
+
+    uint32_t high, low;
+    do {
+        high = hpet_read(HPET_MAIN_COUNTER + 4);
+        low = hpet_read(HPET_MAIN_COUNTER);
+    } while (high != hpet_read(HPET_MAIN_COUNTER + 4));
+    return ((uint64_t)high << 32) | low;
+}
+
+static struct clocksource hpet_clocksource = {
+    .name = "hpet",
+    .read = hpet_read_counter,
+    .rating = 250, // Beats a TSC that isn't invariant, loses to one that is
+};
+
+static uint32_t ns_to_hpet(uint64_t ns) {
+    uint64_t count = ns * HPET_FS_PER_NS / hpet_period_fs;
+    if (count > 0xFFFFFFFF) {
+        count = 0xFFFFFFFF;
+    }
+    return count ? (uint32_t)count : 1;
+}
+
+// Finds the HPET through ACPI, starts its main counter and registers it as a clocksource
+bool init_HPET() {
+    struct acpi_hpet *table = (struct acpi_hpet*)acpi_find_table("HPET");
+    if (!table || table->base.address_space != 0) {
+        dbg_printf("[%d] No memory mapped HPET\n", ticks);
+        return false;
+    }
+
+    hpet_base = map_physical_region((uint32_t)table->base.address, PAGE_SIZE, PAGE_NO_CACHE | PAGE_WRITE_THROUGH);
+
+    uint32_t capabilities = hpet_read(HPET_CAPABILITIES);
+    hpet_period_fs = hpet_read(HPET_CAPABILITIES + 4);
+    hpet_timers = HPET_CAP_TIMERS(capabilities);
+    hpet_64bit = capabilities & HPET_CAP_64BIT;
+    hpet_legacy_capable = capabilities & HPET_CAP_LEGACY;
+
+    // The spec caps the period at 100 ns
+    if (hpet_period_fs == 0 || hpet_period_fs > 100000000) {
+        dbg_printf("[%d] HPET reports a bogus period of %u fs\n", ticks, hpet_period_fs);
+        hpet_base = NULL;
+        return false;
+    }
+
+    // Comparators off until someone asks for them, then start counting
+    for (uint32_t i = 0; i < hpet_timers; i++) {
+        hpet_write(HPET_TIMER_CONFIG(i), hpet_read(HPET_TIMER_CONFIG(i)) & ~(HPET_TIMER_ENABLE | HPET_TIMER_PERIODIC));
+    }
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) | HPET_CONFIG_ENABLE);
+
+    // A 32-bit counter wraps every few minutes, too soon for ktime
+    if (hpet_64bit) {
+        hpet_clocksource.khz = (uint32_t)(1000000000000ULL / hpet_period_fs);
+        clocksource_register(&hpet_clocksource);
+    }
+
+    dbg_printf("[%d] HPET: %u comparators, %u fs period, %s counter\n",
+               ticks, hpet_timers, hpet_period_fs, hpet_64bit ? "64-bit" : "32-bit");
+    return true;
+}
+
+bool hpet_present() {
+    return hpet_base != NULL;
+}
+
+uint32_t hpet_timer_count() {
+    return hpet_timers;
+}
+
+// Fires once, ns from now. Comparators run in 32-bit mode so a single write
+// arms them; a deadline that slipped past before the write gets pushed out.
+bool hpet_timer_oneshot(uint32_t timer, uint64_t ns) {
+    if (!hpet_base || timer >= hpet_timers) {
+        return false;
+    }
+
+    uint32_t delta = ns_to_hpet(ns);
+    uint32_t config = hpet_read(HPET_TIMER_CONFIG(timer));
+    config &= ~(HPET_TIMER_PERIODIC | HPET_TIMER_LEVEL);
+    hpet_write(HPET_TIMER_CONFIG(timer), config | HPET_TIMER_ENABLE | HPET_TIMER_32BIT);
+
+    for (;;) {
+        uint32_t deadline = hpet_read(HPET_MAIN_COUNTER) + delta;
+        hpet_write(HPET_TIMER_COMPARATOR(timer), deadline);
+        if ((int32_t)(deadline - hpet_read(HPET_MAIN_COUNTER)) > 0) {
+            return true;
+        }
+        delta *= 2;
+    }
+}
+
+// Fires every ns. The counter is paused while the comparator and its period are set,
+// which is what the spec asks for.
+bool hpet_timer_periodic(uint32_t timer, uint64_t ns) {
+    if (!hpet_base || timer >= hpet_timers) {
+        return false;
+    }
+
+    uint32_t config = hpet_read(HPET_TIMER_CONFIG(timer));
+    if (!(config & HPET_TIMER_PERIODIC_CAP)) {
+        return false;
+    }
+
+    uint32_t period = ns_to_hpet(ns);
+    uint32_t flags = interrupts_save();
+
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) & ~HPET_CONFIG_ENABLE);
+
+    config &= ~HPET_TIMER_LEVEL;
+    hpet_write(HPET_TIMER_CONFIG(timer), config | HPET_TIMER_ENABLE | HPET_TIMER_PERIODIC |
+                                         HPET_TIMER_SET_VALUE | HPET_TIMER_32BIT);
+    hpet_write(HPET_TIMER_COMPARATOR(timer), hpet_read(HPET_MAIN_COUNTER) + period);
+    hpet_write(HPET_TIMER_COMPARATOR(timer), period); // Second write sets the period
+
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) | HPET_CONFIG_ENABLE);
+    interrupts_restore(flags);
+    return true;
+}
+
+void hpet_timer_stop(uint32_t timer) {
+    if (!hpet_base || timer >= hpet_timers) {
+        return;
+    }
+    hpet_write(HPET_TIMER_CONFIG(timer), hpet_read(HPET_TIMER_CONFIG(timer)) & ~(HPET_TIMER_ENABLE | HPET_TIMER_PERIODIC));
+}
+
+// Only the legacy routed comparators have an IRQ to hook
+void hpet_set_handler(uint32_t timer, void (*handler)(struct InterruptRegisters *r)) {
+    if (timer == 0) {
+        irq_install_handler(0, handler);
+    } else if (timer == 1) {
+        irq_install_handler(8, handler);
+    }
+}
+
+static void hpet_tick_oneshot(uint32_t ms) {
+    hpet_timer_oneshot(0, (uint64_t)ms * NSEC_PER_MSEC);
+}
+
+// Moves the system tick from the PIT to comparator 0 with legacy replacement
+// routing. The period is exact instead of rounded to a PIT divisor.
+bool hpet_take_over_tick() {
+    if (!hpet_base || !hpet_legacy_capable) {
+        return false;
+    }
+
+    uint32_t flags = interrupts_save();
+    if (tickless) {
+        hpet_tick_oneshot(TICK_MS);
+    } else if (!hpet_timer_periodic(0, 1000000000 / frequency)) {
+        interrupts_restore(flags);
+        return false;
+    }
+    hpet_write(HPET_CONFIG, hpet_read(HPET_CONFIG) | HPET_CONFIG_LEGACY);
+    tick_set_bsp_oneshot(hpet_tick_oneshot);
+    hpet_drives_tick = true;
+    interrupts_restore(flags);
+
+    dbg_printf("[%d] HPET comparator 0 drives the tick\n", ticks);
+    return true;
+}
+
+static uint64_t jitter_samples[HPET_JITTER_SAMPLES];
+static volatile uint32_t jitter_count = 0;
+
+static void jitter_irq_handler(struct InterruptRegisters *r) {
+    if (jitter_count < HPET_JITTER_SAMPLES) {
+        jitter_samples[jitter_count++] = ktime_get();
+    }
+    PIT_irq_handler(r);
+}
+
+// Timestamps HPET_JITTER_SAMPLES consecutive IRQ0 edges and reports how far the
+// average period is off the requested one and how much single periods wander
+static void measure_tick_jitter(const char *source) {
+    uint64_t expected = 1000000000 / frequency;
+    uint64_t min = ~0ULL, max = 0;
+
+    jitter_count = 0;
+    irq_install_handler(0, jitter_irq_handler);
+    while (jitter_count < HPET_JITTER_SAMPLES) {
+        asm volatile ("pause");
+    }
+    irq_install_handler(0, PIT_irq_handler);
+
+    for (uint32_t i = 1; i < HPET_JITTER_SAMPLES; i++) {
+        uint64_t period = jitter_samples[i] - jitter_samples[i - 1];
+        if (period < min) min = period;
+        if (period > max) max = period;
+    }
+    uint64_t average = (jitter_samples[HPET_JITTER_SAMPLES - 1] - jitter_samples[0]) / (HPET_JITTER_SAMPLES - 1);
+    int32_t error = (int32_t)(average - expected);
+
+    dbg_printf("[%d] %s tick: average %u ns (error %d ns), min %u ns, max %u ns, jitter %u ns\n",
+               ticks, source, (uint32_t)average, error, (uint32_t)min, (uint32_t)max, (uint32_t)(max - min));
+}
+
+// Measures whichever of the PIT and HPET comparator 0 drives the periodic tick,
+// without changing it. Boot with -machine hpet=off for the PIT numbers. Needs the
+// periodic tick, so run before tickless.
+void run_tick_jitter_benchmark() {
+    if (tickless) {
+        return;
+    }
+    measure_tick_jitter(hpet_drives_tick ? "HPET" : "PIT");
+}
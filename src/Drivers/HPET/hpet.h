@@ -0,0 +1,60 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../../Headers/stdint.h"
+#include "../../Headers/util.h"
+#include "../../IDT/idt.h"
+
+// Registers, offsets from the MMIO base
+#define HPET_CAPABILITIES   0x000
+#define HPET_CONFIG         0x010
+#define HPET_INT_STATUS     0x020
+#define HPET_MAIN_COUNTER   0x0F0
+#define HPET_TIMER_CONFIG(n)     (0x100 + 0x20 * (n))
+#define HPET_TIMER_COMPARATOR(n) (0x108 + 0x20 * (n))
+
+#define HPET_CAP_TIMERS(cap)  ((((cap) >> 8) & 0x1F) + 1)
+#define HPET_CAP_64BIT        (1 << 13)
+#define HPET_CAP_LEGACY       (1 << 15)
+
+#define HPET_CONFIG_ENABLE    (1 << 0)
+#define HPET_CONFIG_LEGACY    (1 << 1) // Timer 0 takes over IRQ0, timer 1 IRQ8
+
+#define HPET_TIMER_LEVEL      (1 << 1)
+#define HPET_TIMER_ENABLE     (1 << 2)
+#define HPET_TIMER_PERIODIC   (1 << 3)
+#define HPET_TIMER_PERIODIC_CAP (1 << 4)
+#define HPET_TIMER_SET_VALUE  (1 << 6)
+#define HPET_TIMER_32BIT      (1 << 8)
+
+#define HPET_FS_PER_NS 1000000
+
+// Without an I/O APIC only the legacy routes can interrupt: timer 0 on IRQ0, timer 1 on IRQ8
+#define HPET_LEGACY_TIMERS 2
+
+#define HPET_JITTER_SAMPLES 256
+
+bool init_HPET();
+bool hpet_present();
+uint64_t hpet_read_counter();
+uint32_t hpet_timer_count();
+bool hpet_timer_oneshot(uint32_t timer, uint64_t ns);
+bool hpet_timer_periodic(uint32_t timer, uint64_t ns);
+void hpet_timer_stop(uint32_t timer);
+void hpet_set_handler(uint32_t timer, void (*handler)(struct InterruptRegisters *r));
+bool hpet_take_over_tick();
+void run_tick_jitter_benchmark();
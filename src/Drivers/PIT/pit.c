@@ -14,6 +14,9 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "pit.h"
+#include "../../Scheduler/scheduler.h"
+#include "../../Time/tick.h"
+#include "../../Debug/bootprof.h"
 
 volatile uint32_t ticks = 0;
 volatile uint32_t frequency = 0;
@@ -22,7 +25,7 @@ void init_PIT(uint32_t freq) {
     frequency = freq;
     unsigned long long divisor = __udivdi3(PIT_FREQUENCY, freq);
 
-    outb(PIT_COMMAND, PIT_CMD_BINARY | PIT_CMD_MODE3);
+    outb(PIT_COMMAND, PIT_CMD_BINARY | PIT_CMD_LOHI | PIT_CMD_MODE3);
 
     outb(PIT_CHANNEL0, (uint8_t)(divisor & 0xFF));
     outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
@@ -30,14 +33,41 @@ void init_PIT(uint32_t freq) {
 
 void PIT_irq_handler(struct InterruptRegisters *r) {
     (void)r;
-    ticks++;
+    if (tickless) {
+        tick_update();
+    } else {
+        ticks++;
+    }
+    tick_timer_event();
 }
 
 void install_PIT_irq() {
     irq_install_handler(0, PIT_irq_handler);
 }
 
+// Mode 0 fires once when the count runs out and stays quiet until reprogrammed
+void pit_oneshot(uint32_t ms) {
+    if (ms > PIT_MAX_ONESHOT_MS) {
+        ms = PIT_MAX_ONESHOT_MS;
+    }
+    uint32_t count = PIT_FREQUENCY / 1000 * ms;
+
+    outb(PIT_COMMAND, PIT_CMD_BINARY | PIT_CMD_LOHI | PIT_CMD_MODE0);
+    outb(PIT_CHANNEL0, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)((count >> 8) & 0xFF));
+}
+
 void wait(uint32_t tick){
-    uint32_t end_ticks = ticks + tick;       
-    while(ticks != end_ticks);
+    if (scheduler_running()) {
+        thread_sleep(tick);
+        return;
+    }
+
+    // Every tick is an interrupt here, so hlt instead of spinning on the counter
+    uint64_t wait = boot_wait_begin();
+    uint32_t end_ticks = ticks + tick;
+    while((int32_t)(ticks - end_ticks) < 0) {
+        asm volatile ("sti; hlt");
+    }
+    boot_wait_end(wait);
 }
\ No newline at end of file
@@ -20,12 +20,23 @@
 #include "../../IDT/idt.h"
 
 #define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
 #define PIT_COMMAND  0x43
+#define PIT_PORT_B   0x61 // Channel 2 gate (bit 0), speaker (bit 1), channel 2 output (bit 5)
+
+#define PIT_PORT_B_GATE2   0x01
+#define PIT_PORT_B_SPEAKER 0x02
+#define PIT_PORT_B_OUT2    0x20
+
+#define PIT_CMD_CHANNEL2 0x80
 
 #define PIT_CMD_BINARY  0x00
+#define PIT_CMD_MODE0   0x00 // Interrupt on terminal count, one-shot
 #define PIT_CMD_MODE3   0x06
+#define PIT_CMD_LOHI    0x30
 
 #define PIT_FREQUENCY 1193182
+#define PIT_MAX_ONESHOT_MS 54 // 16-bit counter
 
 extern volatile uint32_t ticks;
 extern volatile uint32_t frequency;
@@ -33,4 +44,5 @@ extern volatile uint32_t frequency;
 void init_PIT(uint32_t frequency);
 void PIT_irq_handler(struct InterruptRegisters *r);
 void install_PIT_irq();
+void pit_oneshot(uint32_t ms);
 void wait(uint32_t tick);
\ No newline at end of file
@@ -0,0 +1,236 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "mouse.h"
+#include "../PIT/pit.h"
+#include "../../Time/clocksource.h"
+
+static uint8_t mouse_id = 0;
+static uint8_t packet_size = 3;
+static uint8_t packet[4];
+static uint8_t packet_index = 0;
+static uint32_t bad_packets = 0;  // Overflowed or out of sync
+static uint32_t lost_packets = 0; // Button changes that found the ring full
+static uint8_t last_buttons = 0;
+
+// Motion merged while the consumer lags. Only IRQ12 and the flush timer touch it,
+// under mouse_lock, and they're the ring's only producers.
+static struct mouse_event pending;
+static bool has_pending = false;
+static struct timer flush_timer;
+static struct spinlock mouse_lock = SPINLOCK_INIT("mouse_lock");
+
+static struct mouse_event event_buffer[MOUSE_EVENT_RING_SIZE];
+static struct ring event_ring = RING_INIT(event_buffer, MOUSE_EVENT_RING_SIZE, sizeof(struct mouse_event));
+static struct spinlock mouse_read_lock = SPINLOCK_INIT("mouse_read_lock");
+static struct wait_queue mouse_wq = WAIT_QUEUE_INIT(mouse_wq);
+
+// Polled replies from the mouse, only used before IRQ12 is installed
+static bool mouse_read(uint8_t *value) {
+    if (!ps2_poll_status(PS2_STATUS_OUTPUT_BUFFER, true)) {
+        return false;
+    }
+    *value = ps2_read_data();
+    return true;
+}
+
+static bool mouse_write(uint8_t value) {
+    uint8_t reply;
+
+    ps2_poll_status(PS2_STATUS_INPUT_BUFFER, false);
+    ps2_write_command(PS2_CMD_WRITE_AUX);
+    ps2_write_data(value);
+    return mouse_read(&reply) && reply == PS2_ACK;
+}
+
+static bool mouse_set_sample_rate(uint8_t rate) {
+    return mouse_write(MOUSE_CMD_SET_SAMPLE_RATE) && mouse_write(rate);
+}
+
+// Enables the second port and its IRQ, unlocks the wheel if there is one and turns
+// on reporting. Returns whether a mouse answered.
+bool init_mouse() {
+    uint8_t config;
+    bool found = false;
+    uint32_t flags = spin_lock_irqsave(&ps2_lock);
+
+    ps2_write_command(PS2_CMD_ENABLE_AUX);
+    ps2_write_command(PS2_CMD_READ_CONFIG);
+    if (!mouse_read(&config)) {
+        goto out;
+    }
+    config |= PS2_CONFIG_AUX_IRQ;
+    config &= ~PS2_CONFIG_AUX_CLOCK_DISABLE;
+    ps2_write_command(PS2_CMD_WRITE_CONFIG);
+    ps2_write_data(config);
+
+    if (!mouse_write(MOUSE_CMD_SET_DEFAULTS)) {
+        goto out;
+    }
+
+    // The IntelliMouse knock: sample rates 200, 100, 80 switch on 4-byte packets
+    mouse_id = 0;
+    if (mouse_set_sample_rate(200) && mouse_set_sample_rate(100) && mouse_set_sample_rate(80) &&
+        mouse_write(MOUSE_CMD_GET_ID)) {
+        mouse_read(&mouse_id);
+    }
+    packet_size = mouse_id == MOUSE_ID_INTELLIMOUSE ? 4 : 3;
+    packet_index = 0;
+
+    found = mouse_write(MOUSE_CMD_ENABLE_REPORTING);
+
+out:
+    spin_unlock_irqrestore(&ps2_lock, flags);
+    if (found) {
+        dbg_printf("[%d] PS/2 mouse ID %u, %u-byte packets\n", ticks, mouse_id, packet_size);
+    } else {
+        dbg_printf("[%d] No PS/2 mouse found\n", ticks);
+    }
+    return found;
+}
+
+// Needs mouse_lock. Keeps the motion pending if the ring is full, it gets retried.
+static bool flush_pending() {
+    if (!has_pending) {
+        return true;
+    }
+    if (!ring_push(&event_ring, &pending)) {
+        return false;
+    }
+    has_pending = false;
+    return true;
+}
+
+static void flush_timer_callback(void *arg) {
+    (void)arg;
+    uint32_t flags = spin_lock_irqsave(&mouse_lock);
+    bool flushed = flush_pending();
+    if (!flushed) {
+        timer_add(&flush_timer, MOUSE_COALESCE_MS);
+    }
+    spin_unlock_irqrestore(&mouse_lock, flags);
+    if (flushed) {
+        wake_up_all(&mouse_wq);
+    }
+}
+
+// Queues a packet straight away while the consumer keeps up, otherwise merges it
+// into the pending move. Button changes always get their own event. Needs mouse_lock.
+static void queue_packet(struct mouse_event *event) {
+    bool lagging = !ring_empty(&event_ring);
+    bool button_change = event->buttons != last_buttons;
+
+    last_buttons = event->buttons;
+
+    if (has_pending && !button_change) {
+        pending.dx += event->dx;
+        pending.dy += event->dy;
+        pending.wheel += event->wheel;
+        pending.packets++;
+        pending.timestamp = event->timestamp;
+        if (!lagging) {
+            flush_pending(); // Caught up, no need to wait for the timer
+        }
+        return;
+    }
+
+    // Older motion has to go first, with the ring full this change is lost
+    if (!flush_pending()) {
+        lost_packets++;
+        return;
+    }
+    if (!lagging || button_change) {
+        ring_push(&event_ring, event); // Counted as an overflow when full
+        return;
+    }
+
+    pending = *event;
+    has_pending = true;
+    if (!timer_pending(&flush_timer)) {
+        timer_add(&flush_timer, MOUSE_COALESCE_MS);
+    }
+}
+
+static void process_packet() {
+    uint8_t status = packet[0];
+    struct mouse_event event;
+
+    if (status & (MOUSE_X_OVERFLOW | MOUSE_Y_OVERFLOW)) {
+        bad_packets++;
+        return;
+    }
+
+    event.timestamp = ktime_get();
+    event.dx = (int32_t)packet[1] - ((status & MOUSE_X_SIGN) ? 256 : 0);
+    event.dy = (int32_t)packet[2] - ((status & MOUSE_Y_SIGN) ? 256 : 0);
+    event.wheel = packet_size == 4 ? (int8_t)packet[3] : 0;
+    event.buttons = status & MOUSE_BUTTONS;
+    event.packets = 1;
+
+    spin_lock(&mouse_lock);
+    queue_packet(&event);
+    spin_unlock(&mouse_lock);
+}
+
+// Builds packets a byte per interrupt. The first byte always has bit 3 set, anything
+// else there means we lost sync and waits for the next plausible first byte.
+static void mouse_byte(uint8_t value) {
+    if (packet_index == 0 && !(value & MOUSE_ALWAYS_SET)) {
+        bad_packets++;
+        return;
+    }
+    packet[packet_index++] = value;
+    if (packet_index == packet_size) {
+        packet_index = 0;
+        process_packet();
+    }
+}
+
+void mouse_irq_handler(struct InterruptRegisters *r) {
+    (void)r;
+    uint8_t status;
+
+    spin_lock(&ps2_lock);
+    while (((status = inb(PS2_STATUS_PORT)) & PS2_STATUS_OUTPUT_BUFFER) && (status & PS2_STATUS_AUX_DATA)) {
+        mouse_byte(ps2_read_data());
+    }
+    spin_unlock(&ps2_lock);
+
+    if (!ring_empty(&event_ring)) {
+        wake_up_all(&mouse_wq);
+    }
+}
+
+void install_mouse_irq() {
+    timer_setup(&flush_timer, flush_timer_callback, NULL);
+    irq_install_handler(MOUSE_IRQ, mouse_irq_handler);
+}
+
+// Takes the oldest event, readers are serialized to keep the ring single-consumer
+bool mouse_poll_event(struct mouse_event *event) {
+    uint32_t flags = spin_lock_irqsave(&mouse_read_lock);
+    bool found = ring_pop(&event_ring, event);
+    spin_unlock_irqrestore(&mouse_read_lock, flags);
+    return found;
+}
+
+void mouse_get_event(struct mouse_event *event) {
+    wait_event(mouse_wq, mouse_poll_event(event));
+}
+
+// Events lost to a full ring, plus packets thrown away for overflow or bad sync
+uint32_t mouse_dropped_events() {
+    return ring_overflows(&event_ring) + bad_packets + lost_packets;
+}
@@ -0,0 +1,61 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../../Headers/stdint.h"
+#include "../../Headers/util.h"
+#include "ps2.h"
+#include "../../Time/timer.h"
+
+// Commands for the device on the auxiliary port, sent after PS2_CMD_WRITE_AUX
+#define MOUSE_CMD_GET_ID 0xF2
+#define MOUSE_CMD_SET_SAMPLE_RATE 0xF3
+#define MOUSE_CMD_ENABLE_REPORTING 0xF4
+#define MOUSE_CMD_SET_DEFAULTS 0xF6
+
+#define MOUSE_ID_INTELLIMOUSE 3 // Answers GET_ID with 3 once the wheel is unlocked
+
+// First packet byte
+#define MOUSE_LEFT_BUTTON 0x01
+#define MOUSE_RIGHT_BUTTON 0x02
+#define MOUSE_MIDDLE_BUTTON 0x04
+#define MOUSE_BUTTONS 0x07
+#define MOUSE_ALWAYS_SET 0x08
+#define MOUSE_X_SIGN 0x10
+#define MOUSE_Y_SIGN 0x20
+#define MOUSE_X_OVERFLOW 0x40
+#define MOUSE_Y_OVERFLOW 0x80
+
+#define MOUSE_IRQ 12
+#define MOUSE_EVENT_RING_SIZE 256
+#define MOUSE_COALESCE_MS 10 // Longest a coalesced move waits before it's queued
+
+// Relative motion since the previous event, y grows upwards like the device reports it
+struct mouse_event {
+    uint64_t timestamp; // ktime_get() of the newest packet in it
+    int32_t dx;
+    int32_t dy;
+    int32_t wheel;
+    uint16_t packets;   // Packets merged into this event
+    uint8_t buttons;    // MOUSE_*_BUTTON held
+};
+
+bool init_mouse();
+void install_mouse_irq();
+void mouse_irq_handler(struct InterruptRegisters *r);
+bool mouse_poll_event(struct mouse_event *event);
+void mouse_get_event(struct mouse_event *event);
+uint32_t mouse_dropped_events();
@@ -14,35 +14,164 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "ps2.h"
+#include "../PIT/pit.h"
+#include "../../Time/clocksource.h"
+#include "../../Debug/bootprof.h"
 
-static bool shift_pressed = false;
-static bool ctrl_pressed = false;
-static bool alt_pressed = false;
-static bool extended_key_sequence_1 = false; // Flags to track extended key sequence
-static bool extended_key_sequence_2 = false; 
+// One line per key, in scancode set 1 order:
+// set 1 make code, set 2 make code, character, shifted character
+#define PS2_KEYS(K)                                              \
+    K(0x01, 0x76, 0x1b, 0x1b) /* Escape */                       \
+    K(0x02, 0x16, '1', '!')  K(0x03, 0x1E, '2', '@')             \
+    K(0x04, 0x26, '3', '#')  K(0x05, 0x25, '4', '$')             \
+    K(0x06, 0x2E, '5', '%')  K(0x07, 0x36, '6', '^')             \
+    K(0x08, 0x3D, '7', '&')  K(0x09, 0x3E, '8', '*')             \
+    K(0x0A, 0x46, '9', '(')  K(0x0B, 0x45, '0', ')')             \
+    K(0x0C, 0x4E, '-', '_')  K(0x0D, 0x55, '=', '+')             \
+    K(0x0E, 0x66, '\b', '\b') K(0x0F, 0x0D, '\t', '\t')          \
+    K(0x10, 0x15, 'q', 'Q')  K(0x11, 0x1D, 'w', 'W')             \
+    K(0x12, 0x24, 'e', 'E')  K(0x13, 0x2D, 'r', 'R')             \
+    K(0x14, 0x2C, 't', 'T')  K(0x15, 0x35, 'y', 'Y')             \
+    K(0x16, 0x3C, 'u', 'U')  K(0x17, 0x43, 'i', 'I')             \
+    K(0x18, 0x44, 'o', 'O')  K(0x19, 0x4D, 'p', 'P')             \
+    K(0x1A, 0x54, '[', '{')  K(0x1B, 0x5B, ']', '}')             \
+    K(0x1C, 0x5A, '\n', '\n') K(0x1D, 0x14, 0, 0) /* Ctrl */     \
+    K(0x1E, 0x1C, 'a', 'A')  K(0x1F, 0x1B, 's', 'S')             \
+    K(0x20, 0x23, 'd', 'D')  K(0x21, 0x2B, 'f', 'F')             \
+    K(0x22, 0x34, 'g', 'G')  K(0x23, 0x33, 'h', 'H')             \
+    K(0x24, 0x3B, 'j', 'J')  K(0x25, 0x42, 'k', 'K')             \
+    K(0x26, 0x4B, 'l', 'L')  K(0x27, 0x4C, ';', ':')             \
+    K(0x28, 0x52, '\'', '"') K(0x29, 0x0E, '`', '~')             \
+    K(0x2A, 0x12, 0, 0) /* Left shift */                         \
+    K(0x2B, 0x5D, '\\', '|') K(0x2C, 0x1A, 'z', 'Z')             \
+    K(0x2D, 0x22, 'x', 'X')  K(0x2E, 0x21, 'c', 'C')             \
+    K(0x2F, 0x2A, 'v', 'V')  K(0x30, 0x32, 'b', 'B')             \
+    K(0x31, 0x31, 'n', 'N')  K(0x32, 0x3A, 'm', 'M')             \
+    K(0x33, 0x41, ',', '<')  K(0x34, 0x49, '.', '>')             \
+    K(0x35, 0x4A, '/', '?')  K(0x36, 0x59, 0, 0) /* Right shift */ \
+    K(0x37, 0x7C, '*', '*')  K(0x38, 0x11, 0, 0) /* Alt */       \
+    K(0x39, 0x29, ' ', ' ')  K(0x3A, 0x58, 0, 0) /* Caps lock */ \
+    K(0x3B, 0x05, 0, 0)      K(0x3C, 0x06, 0, 0) /* F1, F2 */    \
+    K(0x3D, 0x04, 0, 0)      K(0x3E, 0x0C, 0, 0) /* F3, F4 */    \
+    K(0x3F, 0x03, 0, 0)      K(0x40, 0x0B, 0, 0) /* F5, F6 */    \
+    K(0x41, 0x83, 0, 0)      K(0x42, 0x0A, 0, 0) /* F7, F8 */    \
+    K(0x43, 0x01, 0, 0)      K(0x44, 0x09, 0, 0) /* F9, F10 */   \
+    K(0x45, 0x77, 0, 0)      K(0x46, 0x7E, 0, 0) /* Num, scroll lock */ \
+    K(0x47, 0x6C, 0, 0)      K(0x48, 0x75, 0, 0) /* Keypad 7, 8 */ \
+    K(0x49, 0x7D, 0, 0)      K(0x4A, 0x7B, '-', '-')             \
+    K(0x4B, 0x6B, 0, 0)      K(0x4C, 0x73, 0, 0) /* Keypad 4, 5 */ \
+    K(0x4D, 0x74, 0, 0)      K(0x4E, 0x79, '+', '+')             \
+    K(0x4F, 0x69, 0, 0)      K(0x50, 0x72, 0, 0) /* Keypad 1, 2 */ \
+    K(0x51, 0x7A, 0, 0)      K(0x52, 0x70, 0, 0) /* Keypad 3, 0 */ \
+    K(0x53, 0x71, 0, 0)                          /* Keypad . */  \
+    K(0x57, 0x78, 0, 0)      K(0x58, 0x07, 0, 0) /* F11, F12 */
 
-static bool numlock = false;
-static bool scroll_lock = false;
-static bool capslock = false;
+// Keypad keys that type with num lock on: set 1 code, character
+#define PS2_NUMPAD_KEYS(K)                                       \
+    K(0x47, '7') K(0x48, '8') K(0x49, '9')                       \
+    K(0x4B, '4') K(0x4C, '5') K(0x4D, '6')                       \
+    K(0x4F, '1') K(0x50, '2') K(0x51, '3')                       \
+    K(0x52, '0') K(0x53, '.')
 
-static bool key_released = false;
-static bool new_key_press = false;
+// Keys behind an 0xE0 prefix: set 1 code, set 2 code, character
+#define PS2_EXTENDED_KEYS(K)                                     \
+    K(0x1C, 0x5A, '\n') /* Keypad enter */                       \
+    K(0x1D, 0x14, 0)    /* Right ctrl */                         \
+    K(0x35, 0x4A, '/')  /* Keypad slash */                       \
+    K(0x38, 0x11, 0)    /* Right alt */                          \
+    K(0x47, 0x6C, 0)    K(0x48, 0x75, 0) K(0x49, 0x7D, 0)        \
+    K(0x4B, 0x6B, 0)    K(0x4D, 0x74, 0)                         \
+    K(0x4F, 0x69, 0)    K(0x50, 0x72, 0) K(0x51, 0x7A, 0)        \
+    K(0x52, 0x70, 0)    K(0x53, 0x71, 0)                         \
+    K(0x5B, 0x1F, 0)    K(0x5C, 0x27, 0) K(0x5D, 0x2F, 0)
 
-static uint8_t key = 0;
+#define IS_LETTER(c) ((c) >= 'a' && (c) <= 'z')
+
+#define NORMAL_ENTRY(s1, s2, c, shifted)     [s1] = (c),
+#define SHIFT_ENTRY(s1, s2, c, shifted)      [s1] = (shifted),
+#define CAPS_ENTRY(s1, s2, c, shifted)       [s1] = IS_LETTER(c) ? (shifted) : (c),
+#define CAPS_SHIFT_ENTRY(s1, s2, c, shifted) [s1] = IS_LETTER(c) ? (c) : (shifted),
+#define SET2_ENTRY(s1, s2, c, shifted)       [s2] = (s1),
+#define NUMPAD_ENTRY(s1, c)                  [s1] = (c),
+#define EXT_CHAR_ENTRY(s1, s2, c)            [s1] = (c),
+#define EXT_SET2_ENTRY(s1, s2, c)            [s2] = (s1),
+
+// Indexed by [caps lock][shift] and the set 1 code, all built at compile time
+static const uint8_t keymaps[2][2][PS2_KEYCODES] = {
+    { { PS2_KEYS(NORMAL_ENTRY) }, { PS2_KEYS(SHIFT_ENTRY) } },
+    { { PS2_KEYS(CAPS_ENTRY) },   { PS2_KEYS(CAPS_SHIFT_ENTRY) } },
+};
+static const uint8_t numpad_keymap[PS2_KEYCODES] = { PS2_NUMPAD_KEYS(NUMPAD_ENTRY) };
+static const uint8_t extended_keymap[PS2_KEYCODES] = { PS2_EXTENDED_KEYS(EXT_CHAR_ENTRY) };
+static const uint8_t set2_to_set1[PS2_SET2_CODES] = { PS2_KEYS(SET2_ENTRY) };
+static const uint8_t set2_extended_to_set1[PS2_SET2_CODES] = { PS2_EXTENDED_KEYS(EXT_SET2_ENTRY) };
+
+// Decoder state, only IRQ1 and ps2_init() touch it
+static uint8_t scancode_set = 1;
+static bool extended = false;     // Saw 0xE0
+static bool break_prefix = false; // Saw 0xF0, set 2 only
+static uint8_t skip_bytes = 0;    // Rest of a pause sequence
+static uint16_t modifiers = 0;
+static uint8_t led_stage = 0;     // 1 after sending PS2_CMD_SET_LED, 2 after the LED byte
+static uint8_t leds = 0;
+
+// Protects the decoder state between IRQ1 and ps2_init(), and the controller ports
+struct spinlock ps2_lock = SPINLOCK_INIT("ps2_lock");
+
+// Key events from IRQ1 to readers, big enough for a pasted line nobody reads yet.
+// IRQ1 is the only producer; readers take ps2_read_lock to stay a single consumer.
+static struct key_event event_buffer[PS2_EVENT_RING_SIZE];
+static struct ring event_ring = RING_INIT(event_buffer, PS2_EVENT_RING_SIZE, sizeof(struct key_event));
+static struct spinlock ps2_read_lock = SPINLOCK_INIT("ps2_read_lock");
+
+// Woken on every keyboard interrupt
+static struct wait_queue ps2_wq = WAIT_QUEUE_INIT(ps2_wq);
+
+// Busy-waits with a deadline, for init before the IRQs are installed. Also reached
+// from IRQ1 through ps2_set_leds(). Without a clocksource ktime_get() stays at 0,
+// so the wait is bounded by a poll count then.
+bool ps2_poll_status(uint8_t mask, bool set) {
+    bool timed = clocksource_current() != NULL;
+    uint64_t deadline = ktime_get() + (uint64_t)PS2_TIMEOUT_MS * NSEC_PER_MSEC;
+    uint64_t wait = boot_wait_begin();
+    uint32_t polls = 0;
+    bool ready = true;
+
+    while (((inb(PS2_STATUS_PORT) & mask) != 0) != set) {
+        if (timed ? ktime_get() > deadline : ++polls > PS2_TIMEOUT_POLLS) {
+            ready = false;
+            break;
+        }
+        asm volatile ("pause");
+    }
+    boot_wait_end(wait);
+    return ready;
+}
 
 // PS/2 initialization
 void ps2_init() {
-    // Disable interrupts
-    disable_interrupts();
+    uint32_t flags = spin_lock_irqsave(&ps2_lock);
     
+    // With translation on the controller turns the keyboard's set 2 into set 1
+    scancode_set = 1;
+    ps2_write_command(PS2_CMD_READ_CONFIG);
+    if (ps2_poll_status(PS2_STATUS_OUTPUT_BUFFER, true)) {
+        if (!(ps2_read_data() & PS2_CONFIG_TRANSLATION)) {
+            scancode_set = 2;
+        }
+    }
+
     // Enable keyboard
     ps2_write_command(PS2_CMD_ENABLE_KEYBOARD);
-    scroll_lock = false;
-    numlock = false;
-    capslock = false;
+    extended = false;
+    break_prefix = false;
+    skip_bytes = 0;
+    modifiers = 0;
+    led_stage = 0;
+    leds = 0;
     
-    // Re-enable interrupts
-    enable_interrupts();
+    spin_unlock_irqrestore(&ps2_lock, flags);
+    dbg_printf("[%d] PS/2 keyboard using scancode set %u\n", ticks, scancode_set);
 }
 
 // PS/2 write command
@@ -56,153 +185,194 @@ uint8_t ps2_read_data() {
 }
 
 void ps2_write_data(uint8_t data) {
+    ps2_poll_status(PS2_STATUS_INPUT_BUFFER, false);
     outb(PS2_DATA_PORT, data);
 }
 
 // Wait for PS/2 output buffer to be full
-void ps2_wait_output() {
-    while (!(inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_BUFFER));
+bool ps2_wait_output() {
+    return wait_event_timeout(ps2_wq, inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_BUFFER, PS2_TIMEOUT_MS);
 }
 
-// Keyboard interrupt handler
+// Keyboard interrupt handler, drains every byte the controller already holds
 void keyboard_irq_handler(struct InterruptRegisters *r) {
     (void)r;
-    uint8_t scan_code = ps2_read_data();
-    process_scan_code(scan_code);
+    spin_lock(&ps2_lock);
+    uint8_t status;
+    while (((status = inb(PS2_STATUS_PORT)) & PS2_STATUS_OUTPUT_BUFFER) && !(status & PS2_STATUS_AUX_DATA)) {
+        process_scan_code(ps2_read_data());
+    }
+    spin_unlock(&ps2_lock);
+    wake_up_all(&ps2_wq);
 }
 
 void install_keyboard_irq() {
     irq_install_handler(1, keyboard_irq_handler);
 }
 
-uint8_t keycodes_in_uppercase(uint8_t k){
-    switch(k){
-        case '1': k = '!'; break;
-        case '2': k = '@'; break;
-        case '3': k = '#'; break;
-        case '4': k = '$'; break;
-        case '5': k = '%'; break;
-        case '6': k = '^'; break;
-        case '7': k = '&'; break;
-        case '8': k = '*'; break;
-        case '9': k = '('; break;
-        case '0': k = ')'; break;
-        case '-': k = '_'; break;
-        case '=': k = '+'; break;
-        case 'q': k = 'Q'; break;
-        case 'w': k = 'W'; break;
-        case 'e': k = 'E'; break;
-        case 'r': k = 'R'; break;
-        case 't': k = 'T'; break;
-        case 'y': k = 'Y'; break;
-        case 'u': k = 'U'; break;
-        case 'i': k = 'I'; break;
-        case 'o': k = 'O'; break;
-        case 'p': k = 'P'; break;
-        case 'a': k = 'A'; break;
-        case 's': k = 'S'; break;
-        case 'd': k = 'D'; break;
-        case 'f': k = 'F'; break;
-        case 'g': k = 'G'; break;
-        case 'h': k = 'H'; break;
-        case 'j': k = 'J'; break;
-        case 'k': k = 'K'; break;
-        case 'l': k = 'L'; break;
-        case 'z': k = 'Z'; break;
-        case 'x': k = 'X'; break;
-        case 'c': k = 'C'; break;
-        case 'v': k = 'V'; break;
-        case 'b': k = 'B'; break;
-        case 'n': k = 'N'; break;
-        case 'm': k = 'M'; break;
-        case '[': k = '{'; break;
-        case ']': k = '}'; break;
-        case '\\': k = '|'; break;
-        case ';': k = ':'; break;
-        case '\'': k = '"'; break;
-        case ',': k = '<'; break;
-        case '.': k = '>'; break;
-        case '/': k = '?'; break;
-    }
-    return k;
+// Starts an LED update. The keyboard ACKs the command before it takes the value,
+// so the second byte goes out from process_scan_code(). Needs ps2_lock.
+void ps2_set_leds(uint8_t value) {
+    leds = value;
+    led_stage = 1;
+    ps2_write_data(PS2_CMD_SET_LED);
+}
+
+static uint16_t modifier_bit(uint16_t keycode) {
+    switch (keycode) {
+        case LEFT_SHIFT:  return KEY_MOD_LSHIFT;
+        case RIGHT_SHIFT: return KEY_MOD_RSHIFT;
+        case LEFT_CTRL:   return KEY_MOD_LCTRL;
+        case RIGHT_CTRL:  return KEY_MOD_RCTRL;
+        case LEFT_ALT:    return KEY_MOD_LALT;
+        case RIGHT_ALT:   return KEY_MOD_RALT;
+        default:          return 0;
+    }
+}
+
+// Character for a set 1 keycode under the given modifiers, 0 if it doesn't type one
+uint8_t ps2_translate(uint16_t keycode, uint16_t mods) {
+    uint8_t code = keycode & 0x7F;
+    uint8_t c;
+
+    if (keycode >> 8) {
+        return extended_keymap[code];
+    }
+    if (numpad_keymap[code]) {
+        return (mods & KEY_MOD_NUMLOCK) && !(mods & KEY_MOD_SHIFT) ? numpad_keymap[code] : 0;
+    }
+
+    c = keymaps[(mods & KEY_MOD_CAPSLOCK) != 0][(mods & KEY_MOD_SHIFT) != 0][code];
+    if ((mods & KEY_MOD_CTRL) && IS_LETTER(c | 0x20)) {
+        c &= 0x1F; // Ctrl+letter gives the control character
+    }
+    return c;
 }
 
+static void report_key(uint16_t keycode, bool released) {
+    uint16_t bit = modifier_bit(keycode);
+    uint16_t toggle = 0;
+
+    if (bit) {
+        modifiers = released ? modifiers & ~bit : modifiers | bit;
+    } else if (!released) {
+        switch (keycode) {
+            case CAPSLOCK:   toggle = KEY_MOD_CAPSLOCK; break;
+            case NUMLOCK:    toggle = KEY_MOD_NUMLOCK; break;
+            case SCROLLLOCK: toggle = KEY_MOD_SCROLLLOCK; break;
+        }
+    }
+    // Shift+PgUp/PgDn page through the console history and never reach readers,
+    // any other key press goes back to the live screen
+    if ((modifiers & KEY_MOD_SHIFT) && (keycode == PAGE_UP || keycode == PAGE_DOWN)) {
+        if (!released) {
+            console_scroll(keycode == PAGE_UP ? TEXT_ROWS / 2 : -(TEXT_ROWS / 2));
+        }
+        return;
+    }
+    if (!released && !bit) {
+        console_scroll(-CONSOLE_HISTORY_LINES);
+    }
+
+    if (toggle) {
+        modifiers ^= toggle;
+        ps2_set_leds(((modifiers & KEY_MOD_SCROLLLOCK) ? PS2_LED_SCROLL_LOCK : 0) |
+                     ((modifiers & KEY_MOD_NUMLOCK) ? PS2_LED_NUM_LOCK : 0) |
+                     ((modifiers & KEY_MOD_CAPSLOCK) ? PS2_LED_CAPS_LOCK : 0));
+    }
+
+    struct key_event event = {
+        .timestamp = ktime_get(),
+        .keycode = keycode,
+        .modifiers = modifiers,
+        .ascii = released ? 0 : ps2_translate(keycode, modifiers),
+        .released = released,
+    };
+    ring_push(&event_ring, &event); // Counted as an overflow when full
+}
+
+// Feeds one byte from the keyboard through the set 1 or set 2 decoder. Needs ps2_lock.
 void process_scan_code(uint8_t scan_code) {
-    // Check for extended key sequence (0xE0)
+    uint8_t code;
+    bool released;
+
+    if (scan_code == PS2_ACK) {
+        if (led_stage == 1) {
+            led_stage = 2;
+            ps2_write_data(leds);
+        } else {
+            led_stage = 0;
+        }
+        return;
+    }
+    if (scan_code == PS2_RESEND) {
+        return;
+    }
+    if (skip_bytes) {
+        skip_bytes--;
+        return;
+    }
+    if (scan_code == 0xE1) { // Pause sends a fixed sequence and never a break
+        skip_bytes = scancode_set == 1 ? 5 : 7;
+        return;
+    }
     if (scan_code == 0xE0) {
-        extended_key_sequence_1 = true;
-        return; // Wait for the next byte
-    }
-
-    else if (scan_code == 0xE1) {
-        extended_key_sequence_2 = true;
-        return; // Wait for the next byte
-    }
-
-    if (extended_key_sequence_1) {
-        scan_code = ps2_read_data();
-        extended_key_sequence_1 = false; // Reset the flag
-
-        switch (scan_code) {
-            case CURSOR_UP:
-                key = scan_code;
-                break;
-            case CURSOR_DOWN:
-                key = scan_code;
-                break;
-            case CURSOR_LEFT:
-                key = scan_code;
-                break;
-            case CURSOR_RIGHT:
-                key = scan_code;
-                break;
-            default:
-                break;
+        extended = true;
+        return;
+    }
+
+    if (scancode_set == 1) {
+        released = scan_code & 0x80;
+        code = scan_code & 0x7F;
+        // Fake shifts wrapped around extended keys
+        if (extended && (code == 0x2A || code == 0x36)) {
+            code = 0;
         }
     } else {
-        key_released = scan_code & 0x80;
-        scan_code &= 0x7F; // Mask out the release bit
-
-        if (key_released) {
-            switch (scan_code) {
-                case 0x2A: shift_pressed = false; break; // Left Shift
-                case 0x36: shift_pressed = false; break; // Right Shift
-                case 0x1D: ctrl_pressed = false; break;  // Ctrl
-                case 0x38: alt_pressed = false; break;   // Alt
-            }
-        } else {
-            switch (scan_code) {
-                case 0x2A: shift_pressed = true; break; // Left Shift
-                case 0x36: shift_pressed = true; break; // Right Shift
-                case 0x1D: ctrl_pressed = true; break;  // Ctrl
-                case 0x38: alt_pressed = true; break;   // Alt
-                default:
-                    if (keymap[scan_code]) {
-                        key = (uint8_t)keymap[scan_code];
-                        new_key_press = true; // Set new key press flag
-
-                        switch (key) {
-                            case ESCAPE:
-                                key = 0x1b;
-                                break;
-                            default:
-                                if (shift_pressed) {
-                                    key = keycodes_in_uppercase(key);
-                                }
-                                break;
-                        }
-                    }
-                    break;
-            }
+        if (scan_code == 0xF0) {
+            break_prefix = true;
+            return;
         }
+        released = break_prefix;
+        break_prefix = false;
+        code = scan_code < PS2_SET2_CODES ? (extended ? set2_extended_to_set1 : set2_to_set1)[scan_code] : 0;
+    }
+
+    uint16_t keycode = extended ? 0xE000 | code : code;
+    extended = false;
+    if (code) {
+        report_key(keycode, released);
     }
 }
 
+// Takes the oldest event, so two readers can't both return it
+bool ps2_poll_event(struct key_event *event) {
+    uint32_t flags = spin_lock_irqsave(&ps2_read_lock);
+    bool found = ring_pop(&event_ring, event);
+    spin_unlock_irqrestore(&ps2_read_lock, flags);
+    return found;
+}
+
+// Blocks until there's a key event
+void ps2_get_event(struct key_event *event) {
+    wait_event(ps2_wq, ps2_poll_event(event));
+}
+
+// Blocks until a key that types a character is pressed
 uint8_t getch() {
-    new_key_press = false; // Reset new key press flag
-    return key;
+    struct key_event event;
+    do {
+        ps2_get_event(&event);
+    } while (event.released || !event.ascii);
+    return event.ascii;
 }
 
+// Whether any key event is waiting, not necessarily a character
 bool kbhit() {
-    return new_key_press;
-}
\ No newline at end of file
+    return !ring_empty(&event_ring);
+}
+
+// Key events dropped because nobody read them in time
+uint32_t ps2_dropped_keys() {
+    return ring_overflows(&event_ring);
+}
@@ -19,6 +19,9 @@
 #include "../../Headers/util.h"
 #include "../Speaker/speaker.h"
 #include "../VGA/vga.h"
+#include "../../Scheduler/wait.h"
+#include "../../Lock/spinlock.h"
+#include "../../Lock/ring.h"
 
 // PS/2 controller ports
 #define PS2_DATA_PORT 0x60
@@ -29,14 +32,58 @@
 #define PS2_CMD_READ_CONFIG 0x20
 #define PS2_CMD_WRITE_CONFIG 0x60
 #define PS2_CMD_ENABLE_KEYBOARD 0xAE
+#define PS2_CMD_ENABLE_AUX 0xA8
+#define PS2_CMD_WRITE_AUX 0xD4
 #define PS2_CMD_SET_LED 0xED
 
 #define PS2_LED_NUM_LOCK 0x01
 #define PS2_LED_CAPS_LOCK 0x02
 #define PS2_LED_SCROLL_LOCK 0x04
 
+#define PS2_TIMEOUT_MS 100
+#define PS2_TIMEOUT_POLLS 100000 // Status reads instead while there's no clocksource, about 100 ms
+#define PS2_EVENT_RING_SIZE 1024
+
 // PS/2 controller status
 #define PS2_STATUS_OUTPUT_BUFFER 0x01
+#define PS2_STATUS_INPUT_BUFFER 0x02
+#define PS2_STATUS_AUX_DATA 0x20
+
+// Controller configuration byte
+#define PS2_CONFIG_AUX_IRQ 0x02
+#define PS2_CONFIG_AUX_CLOCK_DISABLE 0x20
+#define PS2_CONFIG_TRANSLATION 0x40
+
+// Keyboard replies
+#define PS2_ACK 0xFA
+#define PS2_RESEND 0xFE
+
+#define PS2_KEYCODES 0x80   // Set 1 make codes, the low byte of a keycode
+#define PS2_SET2_CODES 0x84
+
+// Modifier state carried by every key event
+#define KEY_MOD_LSHIFT     0x0001
+#define KEY_MOD_RSHIFT     0x0002
+#define KEY_MOD_LCTRL      0x0004
+#define KEY_MOD_RCTRL      0x0008
+#define KEY_MOD_LALT       0x0010
+#define KEY_MOD_RALT       0x0020
+#define KEY_MOD_CAPSLOCK   0x0040
+#define KEY_MOD_NUMLOCK    0x0080
+#define KEY_MOD_SCROLLLOCK 0x0100
+#define KEY_MOD_SHIFT (KEY_MOD_LSHIFT | KEY_MOD_RSHIFT)
+#define KEY_MOD_CTRL  (KEY_MOD_LCTRL | KEY_MOD_RCTRL)
+#define KEY_MOD_ALT   (KEY_MOD_LALT | KEY_MOD_RALT)
+
+// Keycodes are set 1 make codes whatever set the keyboard speaks, with 0xE0 in the
+// high byte for extended keys, the same values as enum SpecialKeys
+struct key_event {
+    uint64_t timestamp; // ktime_get() when the interrupt decoded it
+    uint16_t keycode;
+    uint16_t modifiers; // KEY_MOD_* after this event
+    uint8_t ascii;      // Character the press types, 0 for releases and non-printing keys
+    bool released;
+};
 
 // Special keys
 enum SpecialKeys {
@@ -63,9 +110,9 @@ enum SpecialKeys {
     LEFT_CTRL = 0x1D,
     LEFT_SHIFT = 0x2A,
     LEFT_ALT = 0x38,
-    RIGHT_CTRL = 0x9D,
+    RIGHT_CTRL = 0xE01D,
     RIGHT_SHIFT = 0x36,
-    RIGHT_ALT = 0xB8,
+    RIGHT_ALT = 0xE038,
     LEFT_GUI = 0x5B,
     RIGHT_GUI = 0x5C,
     APPS = 0x5D,
@@ -120,37 +167,23 @@ enum SpecialKeys {
     MULTIMEDIA_MEDIA_SELECT = 0xE06D
 };
 
-// Keyboard scan code set
-static const char keymap[256] = {
-    0, 0x1, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', BACKSPACE,
-    TAB, 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', ENTER, 0, 'a',
-    's', 'd', 'f', 'g', 'h', 'j', 'k','l', ';', '\'', '`', 0, '\\', 'z', 'x', 'c',
-    'v', 'b', 'n', 'm', ',', '.', '/', 0, '*', 0, SPACE, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '-', 0, 0, 0,
-    '+', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
+// Serializes controller port access between the keyboard and mouse drivers
+extern struct spinlock ps2_lock;
 
 // Function prototypes
 void ps2_init();
 void keyboard_irq_handler(struct InterruptRegisters *r);
 void install_keyboard_irq();
-void ps2_wait_output();
+bool ps2_wait_output();
+bool ps2_poll_status(uint8_t mask, bool set);
 uint8_t ps2_read_data();
 void ps2_write_data(uint8_t data);
 void ps2_write_command(uint8_t command);
-uint8_t keycodes_in_uppercase(uint8_t k);
 void process_scan_code(uint8_t scan_code);
-void ps2_handle_special(unsigned char scancode);
-void ps2_set_leds(unsigned char leds);
+uint8_t ps2_translate(uint16_t keycode, uint16_t mods);
+void ps2_set_leds(uint8_t value);
+bool ps2_poll_event(struct key_event *event);
+void ps2_get_event(struct key_event *event);
 uint8_t getch();
 bool kbhit();
+uint32_t ps2_dropped_keys();
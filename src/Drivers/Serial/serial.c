@@ -0,0 +1,271 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "serial.h"
+#include "../VGA/vga.h"
+#include "../PIT/pit.h"
+#include "../../Time/clocksource.h"
+#include "../../Scheduler/scheduler.h"
+
+static bool present = false;
+static bool irq_enabled = false;  // Polled until IRQ 4 is installed
+static uint32_t baud_rate = 0;
+static uint32_t fifo_size = 1;    // SERIAL_FIFO_SIZE once a working 16550A FIFO shows up
+static uint32_t thre_interrupts = 0;
+static uint32_t fifo_loads = 0;
+static uint32_t line_errors = 0;
+
+// Any CPU queues output, the UART side is serialized by serial_lock
+static uint8_t tx_buffer[SERIAL_TX_RING_SIZE];
+static struct ring tx_ring = RING_INIT(tx_buffer, SERIAL_TX_RING_SIZE, sizeof(uint8_t));
+static uint8_t rx_buffer[SERIAL_RX_RING_SIZE];
+static struct ring rx_ring = RING_INIT(rx_buffer, SERIAL_RX_RING_SIZE, sizeof(uint8_t));
+static struct spinlock serial_lock = SPINLOCK_INIT("serial_lock");
+static struct spinlock serial_read_lock = SPINLOCK_INIT("serial_read_lock");
+
+// Needs serial_lock
+static void set_divisor(uint16_t divisor) {
+    outb(COM1_PORT + SERIAL_LCR, SERIAL_LCR_8N1 | SERIAL_LCR_DLAB);
+    outb(COM1_PORT + SERIAL_DATA, divisor & 0xFF);
+    outb(COM1_PORT + SERIAL_IER, divisor >> 8);
+    outb(COM1_PORT + SERIAL_LCR, SERIAL_LCR_8N1);
+}
+
+// Needs serial_lock. An empty THR means an empty FIFO, so a whole load goes out
+// with one rep outsb instead of an I/O exit per byte.
+static bool tx_fill() {
+    uint8_t chunk[SERIAL_FIFO_SIZE];
+    uint32_t count;
+
+    if (!(inb(COM1_PORT + SERIAL_LSR) & SERIAL_LSR_THR_EMPTY)) {
+        return false;
+    }
+    if (!(count = ring_pop_batch(&tx_ring, chunk, fifo_size))) {
+        return false;
+    }
+    outsb(COM1_PORT + SERIAL_DATA, chunk, count);
+    fifo_loads++;
+    return true;
+}
+
+// Sets up COM1 as 8N1 at baud with the FIFOs on. A loopback echo tells whether
+// there's a UART at all, output falls back to the debug port without one.
+bool init_serial(uint32_t baud) {
+    uint32_t polls = 0;
+
+    if (!baud || baud > SERIAL_BASE_BAUD || SERIAL_BASE_BAUD % baud) {
+        baud = SERIAL_DEFAULT_BAUD;
+    }
+
+    outb(COM1_PORT + SERIAL_IER, 0);
+    set_divisor(SERIAL_BASE_BAUD / baud);
+    outb(COM1_PORT + SERIAL_FCR, SERIAL_FCR_ENABLE | SERIAL_FCR_CLEAR_RX | SERIAL_FCR_CLEAR_TX | SERIAL_FCR_TRIGGER_14);
+
+    outb(COM1_PORT + SERIAL_MCR, SERIAL_MCR_LOOPBACK | SERIAL_MCR_RTS | SERIAL_MCR_OUT1 | SERIAL_MCR_OUT2);
+    outb(COM1_PORT + SERIAL_DATA, 0xAE);
+    // Counted rather than timed, this runs before init_TSC() gives ktime_get() a clocksource
+    while (!(inb(COM1_PORT + SERIAL_LSR) & SERIAL_LSR_DATA_READY)) {
+        if (++polls > SERIAL_PROBE_POLLS) {
+            return false;
+        }
+    }
+    if (inb(COM1_PORT + SERIAL_DATA) != 0xAE) {
+        return false;
+    }
+
+    // Both FIFO bits read back only on a 16550A, older parts take a byte at a time
+    fifo_size = (inb(COM1_PORT + SERIAL_IIR) & 0xC0) == 0xC0 ? SERIAL_FIFO_SIZE : 1;
+    outb(COM1_PORT + SERIAL_MCR, SERIAL_MCR_DTR | SERIAL_MCR_RTS | SERIAL_MCR_OUT2);
+    baud_rate = baud;
+    present = true;
+
+    dbg_printf("[%d] COM1 at %u baud, %u-byte TX FIFO\n", ticks, baud_rate, fifo_size);
+    return true;
+}
+
+// Only exact divisors of SERIAL_BASE_BAUD. Waits for queued output first, it
+// would otherwise go out at the new rate.
+bool serial_set_baud(uint32_t baud) {
+    if (!present || !baud || baud > SERIAL_BASE_BAUD || SERIAL_BASE_BAUD % baud ||
+        SERIAL_BASE_BAUD / baud > 0xFFFF) {
+        return false;
+    }
+
+    serial_flush();
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    set_divisor(SERIAL_BASE_BAUD / baud);
+    baud_rate = baud;
+    spin_unlock_irqrestore(&serial_lock, flags);
+    return true;
+}
+
+bool serial_present() {
+    return present;
+}
+
+void install_serial_irq() {
+    if (!present) {
+        return;
+    }
+    irq_install_handler(COM1_IRQ, serial_irq_handler);
+
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    irq_enabled = true;
+    // An empty THR raises the first interrupt right away and drains the backlog
+    outb(COM1_PORT + SERIAL_IER, SERIAL_IER_RX_AVAILABLE | SERIAL_IER_THR_EMPTY | SERIAL_IER_LINE_STATUS);
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+void serial_irq_handler(struct InterruptRegisters *r) {
+    (void)r;
+    uint8_t iir;
+    uint8_t c;
+
+    spin_lock(&serial_lock);
+    while (!((iir = inb(COM1_PORT + SERIAL_IIR)) & SERIAL_IIR_NO_INTERRUPT)) {
+        switch (iir & SERIAL_IIR_ID_MASK) {
+        case SERIAL_IIR_THR_EMPTY: // Reading IIR acknowledged it
+            thre_interrupts++;
+            tx_fill();
+            break;
+        case SERIAL_IIR_RX_AVAILABLE:
+        case SERIAL_IIR_RX_TIMEOUT:
+            while (inb(COM1_PORT + SERIAL_LSR) & SERIAL_LSR_DATA_READY) {
+                c = inb(COM1_PORT + SERIAL_DATA);
+                ring_push(&rx_ring, &c); // Counted as an overflow when full
+            }
+            break;
+        case SERIAL_IIR_LINE_STATUS:
+            inb(COM1_PORT + SERIAL_LSR);
+            line_errors++;
+            break;
+        default:
+            inb(COM1_PORT + SERIAL_MSR);
+            break;
+        }
+    }
+    spin_unlock(&serial_lock);
+}
+
+// Queues bytes for the THRE interrupt and never waits on the line. Returns how
+// many fit, the rest count as dropped.
+uint32_t serial_write(const void *buffer, uint32_t count) {
+    if (!present) {
+        return 0;
+    }
+    uint32_t pushed = ring_mp_push_batch(&tx_ring, buffer, count);
+    serial_kick();
+    return pushed;
+}
+
+uint32_t serial_tx_space() {
+    return SERIAL_TX_RING_SIZE - ring_count(&tx_ring);
+}
+
+// Starts an idle transmitter, the THRE interrupt keeps it going from there.
+// Before the IRQ is installed it sends everything queued, polling.
+void serial_kick() {
+    if (!present) {
+        return;
+    }
+    uint32_t flags = spin_lock_irqsave(&serial_lock);
+    if (irq_enabled) {
+        tx_fill();
+    } else {
+        while (!ring_empty(&tx_ring)) {
+            tx_fill();
+        }
+    }
+    spin_unlock_irqrestore(&serial_lock, flags);
+}
+
+// Waits until everything queued is on the wire
+void serial_flush() {
+    if (!present) {
+        return;
+    }
+    while (!ring_empty(&tx_ring) || !(inb(COM1_PORT + SERIAL_LSR) & SERIAL_LSR_TX_EMPTY)) {
+        uint32_t flags = interrupts_save();
+        bool polled = !irq_enabled || !(flags & 0x200); // No THRE interrupt can come to us
+        interrupts_restore(flags);
+        if (polled) {
+            serial_kick();
+        }
+        asm volatile ("pause");
+    }
+}
+
+// Takes the oldest received byte, readers are serialized to keep the ring single-consumer
+bool serial_read(uint8_t *c) {
+    uint32_t flags = spin_lock_irqsave(&serial_read_lock);
+    bool found = ring_pop(&rx_ring, c);
+    spin_unlock_irqrestore(&serial_read_lock, flags);
+    return found;
+}
+
+uint32_t serial_dropped() {
+    return ring_overflows(&tx_ring) + ring_overflows(&rx_ring);
+}
+
+// Streams bytes at each rate and compares the time to the wire with the line's
+// 10 bits per byte (8N1). Rates the divisor latch can't produce are skipped.
+void run_serial_benchmark(uint32_t bytes) {
+    static const uint32_t rates[] = { 115200, 230400, 460800, 921600 };
+    static const char pattern[] = "RetroFlex serial throughput 0123456789abcdefghijklmnopqrstuvwxyz\r\n";
+    uint32_t old_baud = baud_rate;
+
+    if (!present) {
+        dbg_printf("[%d] Serial benchmark: no UART\n", ticks);
+        return;
+    }
+
+    for (uint32_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (!serial_set_baud(rates[i])) {
+            dbg_printf("[%d] Serial benchmark: %u baud needs a faster UART clock, skipped\n", ticks, rates[i]);
+            continue;
+        }
+
+        uint32_t interrupts = thre_interrupts;
+        uint32_t loads = fifo_loads;
+        uint32_t sent = 0;
+        uint64_t start = ktime_get();
+        while (sent < bytes) {
+            uint32_t offset = sent % (sizeof(pattern) - 1);
+            uint32_t count = sizeof(pattern) - 1 - offset;
+            uint32_t space = serial_tx_space();
+            if (count > bytes - sent) {
+                count = bytes - sent;
+            }
+            if (count > space) {
+                count = space;
+            }
+            if (!count) {
+                thread_sleep(1); // Full ring, the THRE interrupt drains it
+                continue;
+            }
+            sent += serial_write(pattern + offset, count);
+        }
+        serial_flush();
+        uint64_t elapsed = ktime_get() - start;
+        interrupts = thre_interrupts - interrupts;
+        loads = fifo_loads - loads;
+
+        dbg_printf("[%d] Serial %u baud: %u bytes in %u us, %u bytes/s of %u, %u FIFO loads, %u THRE interrupts\n",
+                   ticks, rates[i], bytes, (uint32_t)(elapsed / NSEC_PER_USEC),
+                   (uint32_t)((uint64_t)bytes * 1000000000ULL / elapsed), rates[i] / 10, loads, interrupts);
+    }
+
+    serial_set_baud(old_baud);
+}
@@ -0,0 +1,87 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../../Headers/stdint.h"
+#include "../../Headers/util.h"
+#include "../../IDT/idt.h"
+#include "../../Lock/spinlock.h"
+#include "../../Lock/ring.h"
+
+#define COM1_PORT 0x3F8
+#define COM1_IRQ 4
+
+// The divisor latch divides this, 1.8432 MHz / 16 on a PC. Boards with a faster
+// UART clock can raise it to reach rates above 115200.
+#define SERIAL_BASE_BAUD 115200
+#define SERIAL_DEFAULT_BAUD 115200
+#define SERIAL_FIFO_SIZE 16
+#define SERIAL_PROBE_POLLS 1000 // LSR reads for the loopback byte, about 1 ms of ISA port reads
+#define SERIAL_TX_RING_SIZE 8192
+#define SERIAL_RX_RING_SIZE 256
+
+// Registers, offsets from the base port
+#define SERIAL_DATA 0     // RBR/THR, divisor low byte while LCR_DLAB is set
+#define SERIAL_IER 1      // Divisor high byte while LCR_DLAB is set
+#define SERIAL_IIR 2      // Read
+#define SERIAL_FCR 2      // Write
+#define SERIAL_LCR 3
+#define SERIAL_MCR 4
+#define SERIAL_LSR 5
+#define SERIAL_MSR 6
+
+#define SERIAL_IER_RX_AVAILABLE 0x01
+#define SERIAL_IER_THR_EMPTY 0x02
+#define SERIAL_IER_LINE_STATUS 0x04
+
+#define SERIAL_IIR_NO_INTERRUPT 0x01
+#define SERIAL_IIR_ID_MASK 0x0E
+#define SERIAL_IIR_MODEM_STATUS 0x00
+#define SERIAL_IIR_THR_EMPTY 0x02
+#define SERIAL_IIR_RX_AVAILABLE 0x04
+#define SERIAL_IIR_LINE_STATUS 0x06
+#define SERIAL_IIR_RX_TIMEOUT 0x0C
+
+#define SERIAL_FCR_ENABLE 0x01
+#define SERIAL_FCR_CLEAR_RX 0x02
+#define SERIAL_FCR_CLEAR_TX 0x04
+#define SERIAL_FCR_TRIGGER_14 0xC0
+
+#define SERIAL_LCR_8N1 0x03
+#define SERIAL_LCR_DLAB 0x80
+
+#define SERIAL_MCR_DTR 0x01
+#define SERIAL_MCR_RTS 0x02
+#define SERIAL_MCR_OUT1 0x04
+#define SERIAL_MCR_OUT2 0x08 // Gates the interrupt line to the PIC
+#define SERIAL_MCR_LOOPBACK 0x10
+
+#define SERIAL_LSR_DATA_READY 0x01
+#define SERIAL_LSR_THR_EMPTY 0x20 // Room for a full FIFO load
+#define SERIAL_LSR_TX_EMPTY 0x40  // Shift register drained too, the line is idle
+
+bool init_serial(uint32_t baud);
+bool serial_set_baud(uint32_t baud);
+bool serial_present();
+void install_serial_irq();
+void serial_irq_handler(struct InterruptRegisters *r);
+uint32_t serial_write(const void *buffer, uint32_t count);
+uint32_t serial_tx_space();
+void serial_kick();
+void serial_flush();
+bool serial_read(uint8_t *c);
+uint32_t serial_dropped();
+void run_serial_benchmark(uint32_t bytes);
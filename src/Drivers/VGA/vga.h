@@ -26,6 +26,10 @@ extern volatile uint32_t cursor_y;
 extern volatile uint8_t current_color;
 
 #define DEFAULT_COLOR 7
+#define TEXT_COLS 80
+#define TEXT_ROWS 25
+#define TEXT_WINDOW_ROWS (0x8000 / 2 / TEXT_COLS) // Rows that fit in the 32 KiB at 0xB8000
+#define CONSOLE_HISTORY_LINES 1024 // Scrollback, a power of two
 
 void wait_for_retrace();
 void set_palette(uint8_t index, uint8_t r, uint8_t g, uint8_t b);
@@ -36,13 +40,20 @@ void update_cursor(uint32_t x, uint32_t y);
 uint16_t get_cursor_position(void);
 void clear_screen();
 void scroll_up();
+void console_scroll(int32_t lines);
 void putc(char c);
 void puts(const char *s);
 void printf(const char* fmt, ...);
 void print_buffer(const char* msg, const void* buffer, uint32_t count);
+void run_console_benchmark(uint32_t lines);
 void dbg_putc(char c);
 void dbg_puts(const char *str);
-void dbg_printf_unsigned(unsigned long long number, int radix);
-void dbg_printf_signed(long long number, int radix);
 void dbg_printf(const char* fmt, ...);
+
+// make TRACE=1 turns every dbg_printf() into a binary trace event, decoded on
+// the host by tools/tracedecode.py
+#ifdef TRACE_BINARY
+#include "../../Log/trace.h"
+#define dbg_printf(...) trace(__VA_ARGS__)
+#endif
 void dbg_print_buffer(const char* msg, const void* buffer, uint32_t count);
\ No newline at end of file
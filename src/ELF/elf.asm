@@ -0,0 +1,76 @@
+; Copyright (C) 2024 Ahmed
+;
+; This program is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+;
+; This program is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+bits 32
+
+extern set_kernel_stack
+
+section .text
+
+; int32_t enter_usermode(uint32_t entry, uint32_t user_esp)
+; Returns the exit status passed to return_from_usermode
+global enter_usermode
+enter_usermode:
+    PUSH ebp
+    PUSH ebx
+    PUSH esi
+    PUSH edi
+    MOV [usermode_saved_esp], esp
+
+    ; Interrupts from ring 3 land just below the registers saved above
+    PUSH esp
+    CALL set_kernel_stack
+    ADD esp, 4
+
+    MOV eax, [esp+20] ; entry
+    MOV ecx, [esp+24] ; user stack
+
+    MOV dx, 0x23 ; User data segment
+    MOV ds, dx
+    MOV es, dx
+    MOV fs, dx
+    MOV gs, dx
+    XOR edx, edx ; No atexit handler for the program
+
+    PUSH LONG 0x23 ; ss
+    PUSH ecx       ; esp
+    PUSHFD
+    OR DWORD [esp], 0x200 ; Interrupts enabled in user mode
+    PUSH LONG 0x1B ; cs, user code segment
+    PUSH eax       ; eip
+    IRETD
+
+; void return_from_usermode(int32_t status)
+; Throws away the current interrupt frame and returns from enter_usermode
+global return_from_usermode
+return_from_usermode:
+    MOV eax, [esp+4]
+    MOV esp, [usermode_saved_esp]
+
+    MOV dx, 0x10
+    MOV ds, dx
+    MOV es, dx
+    MOV fs, dx
+    MOV dx, 0x30 ; Per-CPU data segment
+    MOV gs, dx
+
+    POP edi
+    POP esi
+    POP ebx
+    POP ebp
+    RET
+
+section .bss
+usermode_saved_esp: resd 1
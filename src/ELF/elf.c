@@ -0,0 +1,191 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "elf.h"
+#include "../Drivers/PIT/pit.h"
+
+static bool program_running = false;
+
+// Only validates the headers and records one vm_area per PT_LOAD segment.
+// Nothing is copied here, pages are filled in by handle_page_fault() when the
+// program first touches them.
+bool elf_load(const void *image, uint32_t size, struct elf_image *out) {
+    const uint8_t *data = (const uint8_t*)image;
+    const struct elf32_header *hdr = (const struct elf32_header*)image;
+
+    vm_clear_areas();
+    memset(out, 0, sizeof(struct elf_image));
+
+    if (size < sizeof(struct elf32_header) ||
+        hdr->ident[0] != ELF_MAGIC[0] || hdr->ident[1] != ELF_MAGIC[1] ||
+        hdr->ident[2] != ELF_MAGIC[2] || hdr->ident[3] != ELF_MAGIC[3] ||
+        hdr->ident[4] != ELF_CLASS_32 || hdr->ident[5] != ELF_DATA_LSB ||
+        hdr->type != ELF_TYPE_EXEC || hdr->machine != ELF_MACHINE_386) {
+        dbg_printf("[%d] Not a static i386 ELF executable\n", ticks);
+        return false;
+    }
+
+    if (hdr->phentsize != sizeof(struct elf32_program_header) || hdr->phoff > size ||
+        hdr->phnum > (size - hdr->phoff) / sizeof(struct elf32_program_header)) {
+        dbg_printf("[%d] ELF program headers out of bounds\n", ticks);
+        return false;
+    }
+
+    const struct elf32_program_header *phdrs = (const struct elf32_program_header*)(data + hdr->phoff);
+    uint32_t phdrs_size = hdr->phnum * sizeof(struct elf32_program_header);
+
+    out->entry = hdr->entry;
+    out->phnum = hdr->phnum;
+
+    for (uint32_t i = 0; i < hdr->phnum; i++) {
+        const struct elf32_program_header *ph = &phdrs[i];
+        if (ph->type != ELF_PT_LOAD || ph->memsz == 0) {
+            continue;
+        }
+
+        uint32_t end = ph->vaddr + ph->memsz;
+        if (ph->filesz > ph->memsz || ph->offset > size || ph->filesz > size - ph->offset ||
+            end < ph->vaddr || end > USER_STACK_TOP - USER_STACK_SIZE) {
+            dbg_printf("[%d] ELF segment %u is invalid\n", ticks, i);
+            vm_clear_areas();
+            return false;
+        }
+
+        uint32_t flags = (ph->flags & ELF_PF_W) ? PAGE_WRITE : 0;
+        if (!vm_add_area(ph->vaddr, end, flags, data + ph->offset, ph->filesz)) {
+            dbg_printf("[%d] ELF segment %u can't be mapped at 0x%x\n", ticks, i, ph->vaddr);
+            vm_clear_areas();
+            return false;
+        }
+
+        if (hdr->phoff >= ph->offset && hdr->phoff + phdrs_size <= ph->offset + ph->filesz) {
+            out->phdr_addr = ph->vaddr + (hdr->phoff - ph->offset);
+        }
+        if (end > out->brk) {
+            out->brk = end;
+        }
+    }
+
+    if (out->brk == 0) {
+        dbg_printf("[%d] ELF has no loadable segments\n", ticks);
+        return false;
+    }
+    return true;
+}
+
+// Lays out the initial process stack the way the i386 System V ABI expects:
+// argc, argv[], NULL, envp[], NULL, auxv pairs, AT_NULL, then the strings.
+uint32_t elf_setup_stack(const struct elf_image *img, const char *const argv[], const char *const envp[]) {
+    uint32_t argc = 0;
+    uint32_t envc = 0;
+    uint32_t strings = 0;
+
+    for (; argv && argv[argc]; argc++) strings += strlen(argv[argc]) + 1;
+    for (; envp && envp[envc]; envc++) strings += strlen(envp[envc]) + 1;
+
+    uint32_t words = 1 + argc + 1 + envc + 1 + 2 * 6;
+    uint32_t string_ptr = USER_STACK_TOP - ((strings + 3) & ~3u);
+    uint32_t sp = (string_ptr - words * sizeof(uint32_t)) & ~0xFu;
+
+    if (USER_STACK_TOP - sp > USER_STACK_SIZE / 2) {
+        dbg_printf("[%d] Arguments don't fit on the user stack\n", ticks);
+        return 0;
+    }
+
+    if (!vm_add_area(USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP, PAGE_WRITE, NULL, 0)) {
+        return 0;
+    }
+
+    // Only the pages holding the arguments are populated now, the rest grows on demand
+    for (uint32_t page = PAGE_ALIGN_DOWN(sp); page < USER_STACK_TOP; page += PAGE_SIZE) {
+        if (!vm_populate(page)) {
+            return 0;
+        }
+    }
+
+    uint32_t *stack = (uint32_t*)sp;
+    *stack++ = argc;
+    for (uint32_t i = 0; i < argc; i++) {
+        uint32_t len = strlen(argv[i]) + 1;
+        memcpy((void*)string_ptr, argv[i], len);
+        *stack++ = string_ptr;
+        string_ptr += len;
+    }
+    *stack++ = 0;
+    for (uint32_t i = 0; i < envc; i++) {
+        uint32_t len = strlen(envp[i]) + 1;
+        memcpy((void*)string_ptr, envp[i], len);
+        *stack++ = string_ptr;
+        string_ptr += len;
+    }
+    *stack++ = 0;
+
+    if (img->phdr_addr) {
+        *stack++ = AT_PHDR;
+        *stack++ = img->phdr_addr;
+    }
+    *stack++ = AT_PHENT;
+    *stack++ = sizeof(struct elf32_program_header);
+    *stack++ = AT_PHNUM;
+    *stack++ = img->phnum;
+    *stack++ = AT_PAGESZ;
+    *stack++ = PAGE_SIZE;
+    *stack++ = AT_ENTRY;
+    *stack++ = img->entry;
+    *stack++ = AT_NULL;
+    *stack++ = 0;
+
+    return sp;
+}
+
+// Runs a static executable in ring 3 and returns its exit status once it
+// calls the exit system call (int 128, eax = 2) or faults.
+int32_t elf_exec(const void *image, uint32_t size, const char *const argv[], const char *const envp[]) {
+    struct elf_image img;
+
+    if (!elf_load(image, size, &img)) {
+        return -1;
+    }
+
+    uint32_t user_esp = elf_setup_stack(&img, argv, envp);
+    if (!user_esp) {
+        vm_clear_areas();
+        return -1;
+    }
+
+    uint32_t faults_before = page_faults_handled;
+    dbg_printf("[%d] Entering user mode at 0x%x (%u bytes image)\n", ticks, img.entry, size);
+
+    program_running = true;
+    int32_t status = enter_usermode(img.entry, user_esp);
+    program_running = false;
+    enable_interrupts();
+
+    dbg_printf("[%d] Program exited with status %d, %u pages faulted in\n",
+               ticks, status, page_faults_handled - faults_before);
+
+    vm_clear_areas();
+    return status;
+}
+
+bool elf_running() {
+    return program_running;
+}
+
+void elf_exit(int32_t status) {
+    if (program_running) {
+        return_from_usermode(status);
+    }
+}
@@ -0,0 +1,88 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../Paging/paging.h"
+#include "../GDT/gdt.h"
+
+#define ELF_MAGIC "\x7F""ELF"
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define ELF_TYPE_EXEC 2
+#define ELF_MACHINE_386 3
+
+#define ELF_PT_LOAD 1
+
+#define ELF_PF_X 0x1
+#define ELF_PF_W 0x2
+#define ELF_PF_R 0x4
+
+// Auxiliary vector entries passed on the initial stack
+#define AT_NULL   0
+#define AT_PHDR   3
+#define AT_PHENT  4
+#define AT_PHNUM  5
+#define AT_PAGESZ 6
+#define AT_ENTRY  9
+
+#define USER_STACK_TOP  0xBFFF0000
+#define USER_STACK_SIZE 0x00040000
+
+struct elf32_header {
+    uint8_t ident[16];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+}__attribute__((packed));
+
+struct elf32_program_header {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+}__attribute__((packed));
+
+struct elf_image {
+    uint32_t entry;
+    uint32_t phdr_addr; // User address of the program headers, 0 if not loaded
+    uint32_t phnum;
+    uint32_t brk;       // First byte after the highest segment
+};
+
+bool elf_load(const void *image, uint32_t size, struct elf_image *out);
+uint32_t elf_setup_stack(const struct elf_image *img, const char *const argv[], const char *const envp[]);
+int32_t elf_exec(const void *image, uint32_t size, const char *const argv[], const char *const envp[]);
+bool elf_running();
+void elf_exit(int32_t status);
+
+extern int32_t enter_usermode(uint32_t entry, uint32_t user_esp);
+extern void return_from_usermode(int32_t status);
@@ -23,8 +23,9 @@ GDT_flush:
     MOV ds, ax
     MOV es, ax
     MOV fs, ax
-    MOV gs, ax
     MOV ss, ax
+    MOV ax, 0x30 ; Per-CPU data segment
+    MOV gs, ax
     JMP 0x08:.flush
 .flush:
     RET
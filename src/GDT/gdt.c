@@ -15,54 +15,78 @@
 
 #include "gdt.h"
 #include "../Headers/util.h"
+#include "../SMP/smp.h"
 
 
 extern void GDT_flush(uint32_t);
 extern void TSS_flush();
 
-struct GDT_entry_struct GDT_entries[6];
-struct GDT_ptr_struct GDT_ptr;
-struct TSS_entry_struct TSS_entry;
+// Every CPU has its own GDT so the TSS (entry 5) and the per-CPU segment (entry 6) can differ
+struct GDT_entry_struct GDT_entries[MAX_CPUS][GDT_ENTRIES];
+struct GDT_ptr_struct GDT_ptr[MAX_CPUS];
+struct TSS_entry_struct TSS_entry[MAX_CPUS];
 
 void init_GDT(){
-    GDT_ptr.limit = (sizeof(struct GDT_entry_struct) * 6) - 1;
-    GDT_ptr.base = (uint32_t)&GDT_entries;
+    init_cpu_GDT(0);
+}
+
+void init_cpu_GDT(uint32_t cpu){
+    GDT_ptr[cpu].limit = (sizeof(struct GDT_entry_struct) * GDT_ENTRIES) - 1;
+    GDT_ptr[cpu].base = (uint32_t)&GDT_entries[cpu];
 
-    set_GDT_gate(0,0,0,0,0); //Null segment
-    set_GDT_gate(1,0,0xffffffff, 0x9a, 0xcf); //Kernel code segment
-    set_GDT_gate(2,0,0xffffffff, 0x92, 0xcf); //Kernel data segment
-    set_GDT_gate(3,0,0xffffffff, 0xfa, 0xcf); //User code segment
-    set_GDT_gate(4,0,0xffffffff, 0xf2, 0xcf); //User data segment
-    write_TSS(5,0x10, 0x0);
+    cpus[cpu].self = &cpus[cpu];
+    cpus[cpu].id = cpu;
 
-    GDT_flush((uint32_t)&GDT_ptr);
+    set_GDT_gate(cpu,0,0,0,0,0); //Null segment
+    set_GDT_gate(cpu,1,0,0xffffffff, 0x9a, 0xcf); //Kernel code segment
+    set_GDT_gate(cpu,2,0,0xffffffff, 0x92, 0xcf); //Kernel data segment
+    set_GDT_gate(cpu,3,0,0xffffffff, 0xfa, 0xcf); //User code segment
+    set_GDT_gate(cpu,4,0,0xffffffff, 0xf2, 0xcf); //User data segment
+    write_TSS(cpu,5,0x10, 0x0);
+    set_GDT_gate(cpu,6,(uint32_t)&cpus[cpu], sizeof(struct cpu) - 1, 0x92, 0x40); //Per-CPU data, loaded in %gs
+
+    GDT_flush((uint32_t)&GDT_ptr[cpu]);
     TSS_flush();
 }
 
-void write_TSS(uint32_t num, uint16_t ss0, uint32_t esp0){
-    uint32_t base = (uint32_t) &TSS_entry;
-    uint32_t limit = base + sizeof(TSS_entry);
+void write_TSS(uint32_t cpu, uint32_t num, uint16_t ss0, uint32_t esp0){
+    struct TSS_entry_struct *tss = &TSS_entry[cpu];
+    uint32_t base = (uint32_t) tss;
+    uint32_t limit = sizeof(struct TSS_entry_struct) - 1;
+
+    set_GDT_gate(cpu, num, base, limit, 0xe9, 0x00);
+    memset(tss, 0, sizeof(struct TSS_entry_struct));
 
-    set_GDT_gate(num, base, limit, 0xe9, 0x00);
-    memset(&TSS_entry, 0, sizeof(TSS_entry));
+    tss->ss0 = ss0;
+    tss->esp0 = esp0;
 
-    TSS_entry.ss0 = ss0;
-    TSS_entry.esp0 = esp0;
+    tss->cs = 0x08 | 0x3;
+    tss->ss = tss->ds = tss->es = tss->fs = tss->gs = 0x10 | 0x3;
+
+    // No I/O permission bitmap, ring 3 gets a #GP on port access
+    tss->iomap_base = sizeof(struct TSS_entry_struct);
+}
+
+// Stack the CPU switches to when an interrupt arrives while running in ring 3
+void set_kernel_stack(uint32_t esp0){
+    TSS_entry[this_cpu()->id].esp0 = esp0;
+}
 
-    TSS_entry.cs = 0x08 | 0x3;
-    TSS_entry.ss = TSS_entry.ds = TSS_entry.es = TSS_entry.fs = TSS_entry.gs = 0x10 | 0x3;
+uint32_t get_kernel_stack(){
+    return TSS_entry[this_cpu()->id].esp0;
 }
 
-void set_GDT_gate(uint32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran){
+void set_GDT_gate(uint32_t cpu, uint32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran){
+    struct GDT_entry_struct *entry = &GDT_entries[cpu][num];
 
-    GDT_entries[num].base_low = (base & 0xFFFF);
-    GDT_entries[num].base_middle = (base >> 16) & 0xFF;
-    GDT_entries[num].base_high = (uint8_t)(base >> 24) & 0xFF;
+    entry->base_low = (base & 0xFFFF);
+    entry->base_middle = (base >> 16) & 0xFF;
+    entry->base_high = (uint8_t)(base >> 24) & 0xFF;
 
-    GDT_entries[num].limit = (limit & 0xFFFF);
-    GDT_entries[num].flags = (limit >> 16) & 0x0F;
-    GDT_entries[num].flags |= (gran & 0xF0);
+    entry->limit = (limit & 0xFFFF);
+    entry->flags = (limit >> 16) & 0x0F;
+    entry->flags |= (gran & 0xF0);
 
-    GDT_entries[num].access = access;
+    entry->access = access;
 
 }
@@ -61,6 +61,18 @@ struct TSS_entry_struct{
 	uint32_t iomap_base;
 } __attribute__((packed));
 
+#define GDT_ENTRIES 7
+
 void init_GDT();
-void set_GDT_gate(uint32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
-void write_TSS(uint32_t num, uint16_t ss0, uint32_t esp0);
+void init_cpu_GDT(uint32_t cpu);
+void set_GDT_gate(uint32_t cpu, uint32_t num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran);
+void write_TSS(uint32_t cpu, uint32_t num, uint16_t ss0, uint32_t esp0);
+void set_kernel_stack(uint32_t esp0);
+uint32_t get_kernel_stack();
+
+#define KERNEL_CODE_SELECTOR 0x08
+#define KERNEL_DATA_SELECTOR 0x10
+#define USER_CODE_SELECTOR (0x18 | 0x3)
+#define USER_DATA_SELECTOR (0x20 | 0x3)
+#define TSS_SELECTOR (0x28 | 0x3)
+#define PERCPU_SELECTOR 0x30
@@ -0,0 +1,398 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "format.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Time/clocksource.h"
+
+#define FORMAT_LEFT  0x01
+#define FORMAT_ZERO  0x02
+#define FORMAT_PLUS  0x04
+#define FORMAT_SPACE 0x08
+#define FORMAT_ALT   0x10
+
+#define LENGTH_DEFAULT    0
+#define LENGTH_CHAR       1
+#define LENGTH_SHORT      2
+#define LENGTH_LONG       3
+#define LENGTH_LONG_LONG  4
+
+static const char lower_digits[] = "0123456789abcdef";
+static const char upper_digits[] = "0123456789ABCDEF";
+
+// Two decimal digits per lookup, halves the divisions
+static const char digit_pairs[] =
+    "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+    "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+struct format_output {
+    char *buffer;
+    uint32_t size;
+    uint32_t length;  // Keeps counting past size
+    uint32_t flushed; // Part of length already handed to write
+    void (*write)(const char *text); // NULL for vsnprintf(), which truncates
+};
+
+static void emit(struct format_output *out, char c) {
+    uint32_t position = out->length - out->flushed;
+
+    if (position + 1 >= out->size && out->write) {
+        out->buffer[position] = '\0';
+        out->write(out->buffer);
+        out->flushed = out->length;
+        position = 0;
+    }
+    if (position + 1 < out->size) {
+        out->buffer[position] = c;
+    }
+    out->length++;
+}
+
+static void emit_repeat(struct format_output *out, char c, int32_t count) {
+    while (count-- > 0) {
+        emit(out, c);
+    }
+}
+
+// The converters write backwards and return the first digit, end is one past the last
+static char *format_u32_decimal(char *end, uint32_t value) {
+    while (value >= 100) {
+        uint32_t pair = (value % 100) * 2;
+        value /= 100;
+        *--end = digit_pairs[pair + 1];
+        *--end = digit_pairs[pair];
+    }
+    if (value >= 10) {
+        *--end = digit_pairs[value * 2 + 1];
+        *--end = digit_pairs[value * 2];
+    } else {
+        *--end = '0' + value;
+    }
+    return end;
+}
+
+// Peels off nine digits per 64-bit division, a uint64_t takes two at most
+static char *format_decimal(char *end, uint64_t value) {
+    while (value >> 32) {
+        uint64_t high = value / 1000000000;
+        char *start = format_u32_decimal(end, (uint32_t)(value - high * 1000000000));
+        while (start > end - 9) {
+            *--start = '0';
+        }
+        end = start;
+        value = high;
+    }
+    return format_u32_decimal(end, (uint32_t)value);
+}
+
+// Octal and hex only shift
+static char *format_power_of_two(char *end, uint64_t value, uint32_t shift, const char *digits) {
+    uint32_t mask = (1 << shift) - 1;
+    uint32_t low;
+
+    while (value >> 32) {
+        *--end = digits[value & mask];
+        value >>= shift;
+    }
+    low = (uint32_t)value;
+    do {
+        *--end = digits[low & mask];
+        low >>= shift;
+    } while (low);
+    return end;
+}
+
+static void format_number(struct format_output *out, uint64_t value, bool negative, char spec,
+                          uint32_t flags, int32_t width, int32_t precision) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start = end;
+    char prefix[2];
+    int32_t prefix_length = 0;
+
+    // An explicit zero precision prints nothing for zero
+    if (value || precision) {
+        switch (spec) {
+            case 'o':   start = format_power_of_two(end, value, 3, lower_digits); break;
+            case 'x':
+            case 'p':   start = format_power_of_two(end, value, 4, lower_digits); break;
+            case 'X':   start = format_power_of_two(end, value, 4, upper_digits); break;
+            default:    start = format_decimal(end, value); break;
+        }
+    }
+    int32_t length = end - start;
+
+    if (negative) {
+        prefix[prefix_length++] = '-';
+    } else if (flags & FORMAT_PLUS) {
+        prefix[prefix_length++] = '+';
+    } else if (flags & FORMAT_SPACE) {
+        prefix[prefix_length++] = ' ';
+    }
+    if (flags & FORMAT_ALT) {
+        if (spec == 'o' && precision <= length) {
+            precision = length + 1; // Leading zero
+        } else if ((spec == 'x' || spec == 'X' || spec == 'p') && value) {
+            prefix[prefix_length++] = '0';
+            prefix[prefix_length++] = spec == 'X' ? 'X' : 'x';
+        }
+    }
+
+    int32_t zeros = precision > length ? precision - length : 0;
+    int32_t padding = width - prefix_length - zeros - length;
+
+    if (precision < 0 && (flags & FORMAT_ZERO) && !(flags & FORMAT_LEFT)) {
+        zeros += padding > 0 ? padding : 0;
+        padding = 0;
+    }
+    if (!(flags & FORMAT_LEFT)) {
+        emit_repeat(out, ' ', padding);
+    }
+    for (int32_t i = 0; i < prefix_length; i++) {
+        emit(out, prefix[i]);
+    }
+    emit_repeat(out, '0', zeros);
+    for (; start < end; start++) {
+        emit(out, *start);
+    }
+    if (flags & FORMAT_LEFT) {
+        emit_repeat(out, ' ', padding);
+    }
+}
+
+static void format_string(struct format_output *out, const char *str, uint32_t flags,
+                          int32_t width, int32_t precision) {
+    int32_t length = 0;
+
+    if (!str) {
+        str = "(null)";
+    }
+    while (str[length] && (precision < 0 || length < precision)) {
+        length++;
+    }
+    if (!(flags & FORMAT_LEFT)) {
+        emit_repeat(out, ' ', width - length);
+    }
+    for (int32_t i = 0; i < length; i++) {
+        emit(out, str[i]);
+    }
+    if (flags & FORMAT_LEFT) {
+        emit_repeat(out, ' ', width - length);
+    }
+}
+
+static void format(struct format_output *out, const char *fmt, va_list args) {
+    for (; *fmt; fmt++) {
+        if (*fmt != '%') {
+            emit(out, *fmt);
+            continue;
+        }
+        fmt++;
+
+        uint32_t flags = 0;
+        for (;; fmt++) {
+            switch (*fmt) {
+                case '-':   flags |= FORMAT_LEFT; continue;
+                case '0':   flags |= FORMAT_ZERO; continue;
+                case '+':   flags |= FORMAT_PLUS; continue;
+                case ' ':   flags |= FORMAT_SPACE; continue;
+                case '#':   flags |= FORMAT_ALT; continue;
+            }
+            break;
+        }
+
+        int32_t width = 0;
+        if (*fmt == '*') {
+            width = va_arg(args, int);
+            if (width < 0) {
+                flags |= FORMAT_LEFT;
+                width = -width;
+            }
+            fmt++;
+        } else {
+            while (*fmt >= '0' && *fmt <= '9') {
+                width = width * 10 + (*fmt++ - '0');
+            }
+        }
+
+        int32_t precision = -1;
+        if (*fmt == '.') {
+            fmt++;
+            precision = 0;
+            if (*fmt == '*') {
+                precision = va_arg(args, int);
+                fmt++;
+            } else {
+                while (*fmt >= '0' && *fmt <= '9') {
+                    precision = precision * 10 + (*fmt++ - '0');
+                }
+            }
+        }
+
+        int length = LENGTH_DEFAULT;
+        switch (*fmt) {
+            case 'h':
+                length = fmt[1] == 'h' ? LENGTH_CHAR : LENGTH_SHORT;
+                fmt += length == LENGTH_CHAR ? 2 : 1;
+                break;
+            case 'l':
+                length = fmt[1] == 'l' ? LENGTH_LONG_LONG : LENGTH_LONG;
+                fmt += length == LENGTH_LONG_LONG ? 2 : 1;
+                break;
+            case 'z':   // size_t is 32 bits here
+                length = LENGTH_LONG;
+                fmt++;
+                break;
+        }
+
+        uint64_t value;
+        switch (*fmt) {
+            case 'd':
+            case 'i': {
+                int64_t number;
+                switch (length) {
+                    case LENGTH_CHAR:       number = (signed char)va_arg(args, int); break;
+                    case LENGTH_SHORT:      number = (short)va_arg(args, int); break;
+                    case LENGTH_LONG:       number = va_arg(args, long); break;
+                    case LENGTH_LONG_LONG:  number = va_arg(args, long long); break;
+                    default:                number = va_arg(args, int); break;
+                }
+                value = number < 0 ? -(uint64_t)number : (uint64_t)number;
+                format_number(out, value, number < 0, 'd', flags, width, precision);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                switch (length) {
+                    case LENGTH_CHAR:       value = (unsigned char)va_arg(args, unsigned int); break;
+                    case LENGTH_SHORT:      value = (unsigned short)va_arg(args, unsigned int); break;
+                    case LENGTH_LONG:       value = va_arg(args, unsigned long); break;
+                    case LENGTH_LONG_LONG:  value = va_arg(args, unsigned long long); break;
+                    default:                value = va_arg(args, unsigned int); break;
+                }
+                format_number(out, value, false, *fmt, flags & ~(FORMAT_PLUS | FORMAT_SPACE), width, precision);
+                break;
+            case 'p':
+                // Always the full pointer width
+                value = (uint32_t)va_arg(args, void*);
+                format_number(out, value, false, 'p', flags | FORMAT_ALT, width, precision < 0 ? 8 : precision);
+                break;
+            case 'c':
+                if (!(flags & FORMAT_LEFT)) {
+                    emit_repeat(out, ' ', width - 1);
+                }
+                emit(out, (char)va_arg(args, int));
+                if (flags & FORMAT_LEFT) {
+                    emit_repeat(out, ' ', width - 1);
+                }
+                break;
+            case 's':
+                format_string(out, va_arg(args, const char*), flags, width, precision);
+                break;
+            case '%':
+                emit(out, '%');
+                break;
+            case '\0':
+                fmt--; // A lone % at the end
+                break;
+            default:
+                break; // Unknown conversions are dropped
+        }
+    }
+
+}
+
+int vsnprintf(char *buffer, uint32_t size, const char *fmt, va_list args) {
+    struct format_output out = { buffer, size, 0, 0, NULL };
+
+    format(&out, fmt, args);
+    if (size) {
+        buffer[out.length < size ? out.length : size - 1] = '\0';
+    }
+    return out.length;
+}
+
+int vformat(char *buffer, uint32_t size, void (*write)(const char *text), const char *fmt, va_list args) {
+    struct format_output out = { buffer, size, 0, 0, write };
+
+    format(&out, fmt, args);
+    buffer[out.length - out.flushed] = '\0';
+    write(buffer);
+    return out.length;
+}
+
+int snprintf(char *buffer, uint32_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, size, fmt, args);
+    va_end(args);
+    return length;
+}
+
+// What printf() used to do per number: a 64-bit division for every digit
+static uint32_t divide_per_digit(char *buffer, unsigned long long number, int radix) {
+    char digits[32];
+    int pos = 0;
+    uint32_t length = 0;
+
+    do {
+        digits[pos++] = lower_digits[number % (unsigned long long)radix];
+        number /= (unsigned long long)radix;
+    } while (number > 0);
+    while (--pos >= 0) {
+        buffer[length++] = digits[pos];
+    }
+    return length;
+}
+
+static uint64_t time_format(uint32_t iterations, const char *fmt, ...) {
+    char buffer[PRINTF_BUFFER_SIZE];
+    va_list args;
+    uint64_t start = ktime_get();
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        va_start(args, fmt);
+        vsnprintf(buffer, sizeof(buffer), fmt, args);
+        va_end(args);
+    }
+    return ktime_get() - start;
+}
+
+// ns per call for a typical log line, for wide 64-bit numbers and for padded
+// hex, plus the old per-digit conversion of the same 64-bit numbers
+void run_format_benchmark(uint32_t iterations) {
+    char buffer[32];
+    uint64_t big = 18446744073709551615ULL;
+    uint64_t start, naive_ns;
+
+    uint64_t line_ns = time_format(iterations, "[%d] %s took %u us, %u%% idle\n", 123456, "Benchmark", 4000000u, 97u);
+    uint64_t wide_ns = time_format(iterations, "%llu %llu", big, big / 3);
+    uint64_t hex_ns = time_format(iterations, "%08x %#x %p", 0xdeadbeef, 0x1234u, (void*)0xb8000);
+
+    start = ktime_get();
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t length = divide_per_digit(buffer, big, 10);
+        buffer[length++] = ' ';
+        divide_per_digit(buffer + length, big / 3, 10);
+    }
+    naive_ns = ktime_get() - start;
+
+    dbg_printf("[%d] Format: log line %u ns, two %%llu %u ns (per-digit division %u ns), hex %u ns\n", ticks,
+               (uint32_t)(line_ns / iterations), (uint32_t)(wide_ns / iterations),
+               (uint32_t)(naive_ns / iterations), (uint32_t)(hex_ns / iterations));
+}
@@ -0,0 +1,31 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "stdint.h"
+#include <stdarg.h>
+
+#define PRINTF_BUFFER_SIZE 256 // printf()/dbg_printf() format on the stack, longer output goes out in pieces
+
+// C99 style: always terminates when size isn't 0 and returns the length the
+// whole output would have had. Supports the - + space # 0 flags, width and
+// precision (also as *), the hh h l ll z lengths and d i u o x X p c s %.
+int vsnprintf(char *buffer, uint32_t size, const char *fmt, va_list args);
+int snprintf(char *buffer, uint32_t size, const char *fmt, ...);
+// Formats through buffer and passes it to write() each time it fills up and once
+// at the end, so output of any length gets through. size must be at least 2.
+int vformat(char *buffer, uint32_t size, void (*write)(const char *text), const char *fmt, va_list args);
+void run_format_benchmark(uint32_t iterations);
@@ -80,5 +80,12 @@ struct multiboot_mmap_entry {
     uint32_t type;
 } __attribute__((packed));
 
+struct multiboot_mod_list {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t cmdline;
+    uint32_t pad;
+};
+
 const char* multiboot_mem_type_2_text(uint32_t type);
 void read_multiboot_header(uint32_t magic, struct multiboot_info* mb_info);
\ No newline at end of file
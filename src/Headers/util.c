@@ -22,6 +22,23 @@ void memset(void *dest, char val, uint32_t count){
     }
 }
 
+void *memcpy(void *dest, const void *src, uint32_t count){
+    char *d = (char*)dest;
+    const char *s = (const char*)src;
+    for(uint32_t i = 0; i < count; i++){
+        d[i] = s[i];
+    }
+    return dest;
+}
+
+uint32_t strlen(const char *str){
+    uint32_t len = 0;
+    while(str[len]){
+        len++;
+    }
+    return len;
+}
+
 void outb(uint16_t port, uint8_t value) {
     asm volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
 }
@@ -56,6 +73,11 @@ void insw(uint16_t port, void *buffer, uint32_t count) {
     asm volatile ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
 }
 
+// One string instruction, hypervisors can take the whole run in a single exit
+void outsb(uint16_t port, const void *buffer, uint32_t count) {
+    asm volatile ("rep outsb" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
 void outsw(uint16_t port, const void *buffer, uint32_t count) {
     const uint16_t *tmp = (const uint16_t*)buffer;
     for (uint32_t i = 0; i < count / sizeof(uint16_t); i++) {
@@ -71,18 +93,64 @@ void enable_interrupts(){
     asm volatile ("sti");
 }
 
-unsigned long long __udivdi3(unsigned long long a, unsigned long long b) {
+// Disables interrupts and returns the previous EFLAGS so the caller can put them back
+uint32_t interrupts_save(){
+    uint32_t flags;
+    asm volatile ("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+void interrupts_restore(uint32_t flags){
+    if (flags & 0x200) {
+        asm volatile ("sti" : : : "memory");
+    }
+}
+
+uint64_t rdtsc(){
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+// Shift-and-subtract long division, libgcc isn't linked in
+static unsigned long long udivmod64(unsigned long long a, unsigned long long b, unsigned long long *rem) {
     unsigned long long quotient = 0;
-    while (a >= b) {
-        a -= b;
-        quotient++;
+    int shift = 0;
+
+    if (b == 0 || a < b) {
+        *rem = a;
+        return 0;
+    }
+
+    while (!(b & 0x8000000000000000ULL) && (b << 1) <= a) {
+        b <<= 1;
+        shift++;
     }
+
+    for (; shift >= 0; shift--) {
+        quotient <<= 1;
+        if (a >= b) {
+            a -= b;
+            quotient |= 1;
+        }
+        b >>= 1;
+    }
+
+    *rem = a;
     return quotient;
 }
 
+unsigned long long __udivdi3(unsigned long long a, unsigned long long b) {
+    unsigned long long rem;
+    return udivmod64(a, b, &rem);
+}
+
 unsigned long long __umoddi3(unsigned long long a, unsigned long long b) {
-    while (a >= b) {
-        a -= b;
-    }
-    return a;
+    unsigned long long rem;
+    udivmod64(a, b, &rem);
+    return rem;
 }
@@ -18,6 +18,8 @@
 #include "stdint.h"
 
 void memset(void *dest, char val, uint32_t count);
+void *memcpy(void *dest, const void *src, uint32_t count);
+uint32_t strlen(const char *str);
 void outb(uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
 void outw(uint16_t port, uint16_t value);
@@ -25,9 +27,14 @@ uint16_t inw(uint16_t port);
 void outdw(uint16_t port, uint32_t value);
 uint32_t indw(uint16_t port);
 void insw(uint16_t port, void *buffer, uint32_t count);
+void outsb(uint16_t port, const void *buffer, uint32_t count);
 void outsw(uint16_t port, const void *buffer, uint32_t count);
 void disable_interrupts();
 void enable_interrupts();
+uint32_t interrupts_save();
+void interrupts_restore(uint32_t flags);
+uint64_t rdtsc();
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
 unsigned long long __udivdi3(unsigned long long a, unsigned long long b);
 unsigned long long __umoddi3(unsigned long long a, unsigned long long b);
 
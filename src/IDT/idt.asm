@@ -81,6 +81,7 @@ ISR_NOERRCODE 30
 ISR_NOERRCODE 31
 ISR_NOERRCODE 128
 ISR_NOERRCODE 177
+ISR_NOERRCODE 255 ; Local APIC spurious interrupt, no EOI
 
 IRQ 0, 32
 IRQ   1,    33
@@ -98,12 +99,16 @@ IRQ  12,    44
 IRQ  13,    45
 IRQ  14,    46
 IRQ  15,    47
+IRQ  16,    48 ; Local APIC timer
+IRQ  17,    49 ; Inter-processor interrupt
 
 extern isr_handler
 isr_common_stub:
     pusha
     mov eax,ds
     PUSH eax
+    mov eax,gs
+    PUSH eax
     MOV eax, cr2
     PUSH eax
 
@@ -111,6 +116,7 @@ isr_common_stub:
     MOV ds, ax
     MOV es, ax
     MOV fs, ax
+    MOV ax, 0x30 ; Per-CPU data segment
     MOV gs, ax
 
     PUSH esp
@@ -118,10 +124,11 @@ isr_common_stub:
 
     ADD esp, 8
     POP ebx
+    MOV gs, bx
+    POP ebx
     MOV ds, bx
     MOV es, bx
     MOV fs, bx
-    MOV gs, bx
 
     POPA
     ADD esp, 8
@@ -133,6 +140,8 @@ irq_common_stub:
     pusha
     mov eax,ds
     PUSH eax
+    mov eax,gs
+    PUSH eax
     MOV eax, cr2
     PUSH eax
 
@@ -140,6 +149,7 @@ irq_common_stub:
     MOV ds, ax
     MOV es, ax
     MOV fs, ax
+    MOV ax, 0x30 ; Per-CPU data segment
     MOV gs, ax
 
     PUSH esp
@@ -147,10 +157,11 @@ irq_common_stub:
 
     ADD esp, 8
     POP ebx
+    MOV gs, bx
+    POP ebx
     MOV ds, bx
     MOV es, bx
     MOV fs, bx
-    MOV gs, bx
 
     POPA
     ADD esp, 8
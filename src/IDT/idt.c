@@ -15,8 +15,23 @@
 
 #include "../Headers/stdint.h"
 #include "../Headers/util.h"
+#include "../Headers/format.h"
+#include "../Lock/spinlock.h"
+#include "../Lock/rcu.h"
 #include "../Drivers/VGA/vga.h"
+#include "../Log/klog.h"
+#include "../Log/ftrace.h"
+#include "../Debug/profile.h"
+#include "../Debug/ksyms.h"
+#include "../Debug/backtrace.h"
 #include "idt.h"
+#include "../Paging/paging.h"
+#include "../ELF/elf.h"
+#include "../Scheduler/scheduler.h"
+#include "../Drivers/APIC/apic.h"
+#include "../SMP/smp.h"
+
+#define SYSCALL_STRING_MAX 4096 // Longest string syscall 1 prints, the rest is dropped
 
 struct IDT_entry_struct IDT_entries[256];
 struct IDT_ptr_struct IDT_ptr;
@@ -96,22 +111,31 @@ void init_IDT(){
     set_IDT_gate(45, (uint32_t)irq13, 0x08, 0x8E);
     set_IDT_gate(46, (uint32_t)irq14, 0x08, 0x8E);
     set_IDT_gate(47, (uint32_t)irq15, 0x08, 0x8E);
+    set_IDT_gate(LAPIC_TIMER_VECTOR, (uint32_t)irq16, 0x08, 0x8E);
+    set_IDT_gate(LAPIC_IPI_VECTOR, (uint32_t)irq17, 0x08, 0x8E);
+    set_IDT_gate(LAPIC_SPURIOUS_VECTOR, (uint32_t)isr255, 0x08, 0x8E);
 
 
-    set_IDT_gate(128, (uint32_t)isr128, 0x08, 0x8E); //System calls
-    set_IDT_gate(177, (uint32_t)isr177, 0x08, 0x8E); //System calls
+    // Only the system call gates have DPL 3, an int n from ring 3 to any other vector is a #GP
+    set_IDT_gate(128, (uint32_t)isr128, 0x08, 0xEE); //System calls
+    set_IDT_gate(177, (uint32_t)isr177, 0x08, 0xEE); //System calls
 
     IDT_flush((uint32_t)&IDT_ptr);
 
 }
 
+// Application processors share the BSP's table
+void load_IDT(){
+    IDT_flush((uint32_t)&IDT_ptr);
+}
+
 void set_IDT_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags){
 
     IDT_entries[num].base_low = base & 0xFFFF;
     IDT_entries[num].base_high = (uint16_t)(base >> 16) & 0xFFFF;
     IDT_entries[num].sel = sel;
     IDT_entries[num].always0 = 0;
-    IDT_entries[num].flags = flags | 0x60;
+    IDT_entries[num].flags = flags;
 
 }
 
@@ -150,16 +174,74 @@ const char* exception_messages[] = {
     "Reserved"
 };
 
+// Where and why the kernel stopped: the faulting function, the registers and
+// the callers, on screen in short and in full on the debug console
+static void exception_report(struct InterruptRegisters* regs){
+    char where[64];
+    // Same privilege, the CPU pushed no esp and ss, the stack continues after eflags
+    uint32_t esp = (uint32_t)&regs->useresp;
+    uint32_t cpu = cpus[0].self ? this_cpu()->id : 0;
+
+    ksym_snprint(where, sizeof(where), regs->eip);
+    printf("%s at %s\n", exception_messages[regs->int_no], where);
+    dbg_printf("%s at %s on CPU %u", exception_messages[regs->int_no], where, cpu);
+    if (scheduler_running()){
+        dbg_printf(" in thread %s", thread_current()->name);
+    }
+    dbg_printf(", error code 0x%x\n", regs->err_code);
+    if (regs->int_no == 14){
+        printf("Page fault address 0x%08x\n", regs->cr2);
+        dbg_printf("Page fault address 0x%08x\n", regs->cr2);
+    }
+
+    dbg_printf("eax %08x ebx %08x ecx %08x edx %08x\n", regs->eax, regs->ebx, regs->ecx, regs->edx);
+    dbg_printf("esi %08x edi %08x ebp %08x esp %08x\n", regs->esi, regs->edi, regs->ebp, esp);
+    dbg_printf("eip %08x cs %04x ds %04x eflags %08x cr2 %08x\n", regs->eip, regs->cs, regs->ds, regs->eflags, regs->cr2);
+    backtrace_print(regs->eip, regs->ebp);
+}
+
+// The string is copied in a piece at a time, a pointer outside the program's
+// memory kills it rather than faulting with console_lock held
+static void syscall_puts(uint32_t user_addr) {
+    char text[PRINTF_BUFFER_SIZE];
+    uint32_t total = 0;
+    int32_t length;
+
+    do {
+        length = vm_copy_string(text, user_addr + total, sizeof(text));
+        if (length < 0) {
+            printf("Bad string pointer 0x%x in user program\n", user_addr);
+            dbg_printf("Bad string pointer 0x%x in user program\n", user_addr);
+            elf_exit(-1);
+            return;
+        }
+        puts(text);
+        total += length;
+    } while ((uint32_t)length == sizeof(text) - 1 && total < SYSCALL_STRING_MAX);
+}
+
 void isr_handler(struct InterruptRegisters* regs){
+    trace_begin(TRACEPOINT_ISR, "isr", regs->int_no);
+    if (regs->int_no == 14 && handle_page_fault(regs)){
+        trace_end(TRACEPOINT_ISR, "isr", regs->int_no);
+        return;
+    }
+
+    // A faulting user program is killed instead of taking the whole system down
+    if (regs->int_no < 32 && (regs->cs & 0x3) == 0x3 && elf_running()){
+        printf("%s at 0x%x in user program\n", exception_messages[regs->int_no], regs->eip);
+        dbg_printf("%s at 0x%x in user program (cr2 0x%x)\n", exception_messages[regs->int_no], regs->eip, regs->cr2);
+        elf_exit(-1);
+    }
+
     if (regs->int_no < 32){
         switch(regs->int_no){
             default:
-                printf(exception_messages[regs->int_no]);
-                putc('\n');
+                klog_emergency();
+                exception_report(regs);
                 printf("Exception! System Halted\n");
-                dbg_printf(exception_messages[regs->int_no]);
-                dbg_putc('\n');
-                dbg_printf("Exception! System Halted");
+                dbg_printf("Exception! System Halted\n");
+                klog_flush();
                 for(;;);
                 break;
         }
@@ -172,7 +254,10 @@ void isr_handler(struct InterruptRegisters* regs){
                         putc((int8_t)regs->ebx);
                         break;
                     case 1:
-                        puts((const char *)regs->esi);
+                        syscall_puts(regs->esi);
+                        break;
+                    case 2:
+                        elf_exit((int32_t)regs->ebx);
                         break;
                     default:
                         break;
@@ -182,30 +267,56 @@ void isr_handler(struct InterruptRegisters* regs){
                 break;
         }
     }
+    trace_end(TRACEPOINT_ISR, "isr", regs->int_no);
 }
 
-void (*irq_routines[16])(struct InterruptRegisters *r) = { 0 };
+void (*irq_routines[IRQ_COUNT])(struct InterruptRegisters *r) = { 0 };
+
+// Handlers run under rcu_read_lock(), so the interrupt path takes no lock. Only
+// writers serialize, and once irq_uninstall_handler() returns no CPU is still
+// inside the old handler.
+static struct spinlock irq_lock = SPINLOCK_INIT("irq_lock");
 
 void irq_install_handler (int irq, void (*handler)(struct InterruptRegisters *r)){
-    irq_routines[irq] = handler;
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    rcu_assign_pointer(irq_routines[irq], handler);
+    spin_unlock_irqrestore(&irq_lock, flags);
 }
 
+// Sleeps for a grace period
 void irq_uninstall_handler(int irq){
-    irq_routines[irq] = 0;
+    uint32_t flags = spin_lock_irqsave(&irq_lock);
+    rcu_assign_pointer(irq_routines[irq], NULL);
+    spin_unlock_irqrestore(&irq_lock, flags);
+    synchronize_rcu();
 }
 
 void irq_handler(struct InterruptRegisters* regs){
     void (*handler)(struct InterruptRegisters *regs);
 
-    handler = irq_routines[regs->int_no - 32];
+    trace_begin(TRACEPOINT_IRQ, "irq", regs->int_no);
+    profile_tick(regs);
+    rcu_read_lock();
+    handler = rcu_dereference(irq_routines[regs->int_no - 32]);
 
     if (handler){
         handler(regs);
     }
+    rcu_read_unlock();
 
-    if (regs->int_no >= 40){
-        outb(0xA0, 0x20);
+    if (regs->int_no >= LAPIC_TIMER_VECTOR){
+        lapic_eoi();
+    } else {
+        if (regs->int_no >= 40){
+            outb(0xA0, 0x20);
+        }
+
+        outb(0x20,0x20);
     }
+    trace_end(TRACEPOINT_IRQ, "irq", regs->int_no);
 
-    outb(0x20,0x20);
+    // Preempt only after the interrupt has been acknowledged
+    if (scheduler_running() && this_cpu()->need_resched && !this_cpu()->preempt_count){
+        schedule();
+    }
 }
\ No newline at end of file
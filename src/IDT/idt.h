@@ -32,13 +32,18 @@ struct IDT_ptr_struct{
 
 struct InterruptRegisters {
     uint32_t cr2;
+    uint32_t gs;
     uint32_t ds;
     uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
     uint32_t int_no, err_code;
     uint32_t eip, cs, eflags, useresp, ss;
 };
 
+// 16 PIC lines followed by the local APIC timer and IPI vectors
+#define IRQ_COUNT 18
+
 void init_IDT();
+void load_IDT();
 void set_IDT_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
 void irq_install_handler (int irq, void (*handler)(struct InterruptRegisters *r));
 void irq_uninstall_handler(int irq);
@@ -79,6 +84,7 @@ extern void isr31();
 
 extern void isr128();
 extern void isr177();
+extern void isr255();
 
 extern void irq0();
 extern void irq1();
@@ -95,4 +101,6 @@ extern void irq11();
 extern void irq12();
 extern void irq13();
 extern void irq14();
-extern void irq15();
\ No newline at end of file
+extern void irq15();
+extern void irq16();
+extern void irq17();
\ No newline at end of file
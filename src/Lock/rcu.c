@@ -0,0 +1,210 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "rcu.h"
+#include "spinlock.h"
+#include "../Drivers/APIC/apic.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Scheduler/scheduler.h"
+#include "../Scheduler/wait.h"
+#include "../Log/klog.h"
+#include "../Time/clocksource.h"
+
+static struct spinlock rcu_lock = SPINLOCK_INIT("rcu_lock"); // Protects the callback list
+static struct rcu_head *rcu_pending = NULL;
+static struct rcu_head **rcu_pending_tail = &rcu_pending;
+static struct wait_queue rcu_wq = WAIT_QUEUE_INIT(rcu_wq);
+static uint32_t rcu_grace_periods = 0;
+
+// Makes cpu pass through schedule(), the IPI also gets it out of hlt
+static void rcu_force_qs(struct cpu *cpu) {
+    cpu->need_resched = true;
+    if (lapic_present()) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_IPI_VECTOR);
+    }
+}
+
+// Returns once every reader that started before the call has finished. Sleeps,
+// so it can't be called from a read side or with interrupts off.
+void synchronize_rcu() {
+    uint32_t snapshot[MAX_CPUS];
+    uint32_t pending = 0;
+    uint64_t last_force = 0;
+
+    // Without other CPUs the caller being here is already a quiescent state
+    if (!scheduler_running() || cpus_online <= 1) {
+        return;
+    }
+
+    // Orders the caller's unpublishing before the snapshot
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    uint32_t flags = interrupts_save();
+    struct cpu *self = this_cpu();
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].online && &cpus[i] != self) {
+            snapshot[i] = cpus[i].rcu_qs;
+            pending |= 1 << i;
+        }
+    }
+    interrupts_restore(flags);
+
+    while (pending) {
+        // A CPU still in a read side when the IPI lands keeps need_resched, but
+        // tickless CPUs may not take another interrupt soon, so nudge again
+        uint64_t now = ktime_get();
+        bool force = now - last_force >= NSEC_PER_MSEC;
+        if (force) {
+            last_force = now;
+        }
+
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            if (!(pending & (1 << i))) {
+                continue;
+            }
+            if (cpus[i].rcu_qs != snapshot[i]) {
+                pending &= ~(1 << i);
+            } else if (force) {
+                rcu_force_qs(&cpus[i]);
+            }
+        }
+        if (pending) {
+            thread_yield();
+        }
+    }
+
+    // And the readers' last accesses before whatever the caller frees next
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&rcu_grace_periods, 1, __ATOMIC_RELAXED);
+}
+
+// Queues func to run after a grace period, from the rcu thread. Doesn't sleep.
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+    head->func = func;
+    head->next = NULL;
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    *rcu_pending_tail = head;
+    rcu_pending_tail = &head->next;
+    spin_unlock_irqrestore(&rcu_lock, flags);
+
+    wake_up_one(&rcu_wq);
+}
+
+// One grace period covers every callback queued before it started
+static void rcu_thread(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        wait_event(rcu_wq, __atomic_load_n(&rcu_pending, __ATOMIC_RELAXED));
+
+        uint32_t flags = spin_lock_irqsave(&rcu_lock);
+        struct rcu_head *batch = rcu_pending;
+        rcu_pending = NULL;
+        rcu_pending_tail = &rcu_pending;
+        spin_unlock_irqrestore(&rcu_lock, flags);
+
+        synchronize_rcu();
+
+        while (batch) {
+            struct rcu_head *next = batch->next;
+            batch->func(batch);
+            batch = next;
+        }
+    }
+}
+
+// Needs the scheduler
+void init_rcu() {
+    if (!thread_create("rcu", rcu_thread, NULL)) {
+        klog(KLOG_ERR, "[%d] Failed to start the rcu thread\n", ticks);
+    }
+}
+
+// Read-mostly lookup table, every reader hits the same entries
+static uint32_t *volatile bench_table;
+static uint32_t bench_tables[2][RCU_BENCH_ENTRIES];
+static struct rwlock bench_lock = RWLOCK_INIT("rcu_bench_lock");
+static uint32_t bench_lookups;
+static volatile uint32_t bench_remaining;
+static volatile uint32_t bench_sink;
+
+static void rcu_bench_worker(void *arg) {
+    bool use_rcu = arg != NULL;
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < bench_lookups; i++) {
+        if (use_rcu) {
+            rcu_read_lock();
+            sum += rcu_dereference(bench_table)[i % RCU_BENCH_ENTRIES];
+            rcu_read_unlock();
+        } else {
+            read_lock(&bench_lock);
+            sum += bench_table[i % RCU_BENCH_ENTRIES];
+            read_unlock(&bench_lock);
+        }
+    }
+
+    __atomic_add_fetch(&bench_sink, sum, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&bench_remaining, 1, __ATOMIC_SEQ_CST);
+}
+
+// Every online CPU does lookups lookups, returns the total throughput in lookups/us
+static uint32_t rcu_bench_run(bool use_rcu) {
+    uint32_t workers = 0;
+
+    bench_remaining = cpus_online;
+    uint64_t start = ktime_get();
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        if (thread_create_affinity("rcubench", rcu_bench_worker, use_rcu ? (void*)1 : NULL, 1 << i)) {
+            workers++;
+        } else {
+            __atomic_sub_fetch(&bench_remaining, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    while (bench_remaining) {
+        thread_sleep(1);
+    }
+    uint64_t ns = ktime_get() - start;
+
+    return (uint32_t)((uint64_t)workers * bench_lookups * NSEC_PER_USEC / (ns ? ns : 1));
+}
+
+// Lookup throughput on all CPUs with RCU readers versus rwlock readers, then one
+// update through synchronize_rcu() to time a grace period
+void run_rcu_benchmark(uint32_t lookups) {
+    for (uint32_t i = 0; i < RCU_BENCH_ENTRIES; i++) {
+        bench_tables[0][i] = i;
+        bench_tables[1][i] = i * 2;
+    }
+    bench_table = bench_tables[0];
+    bench_lookups = lookups;
+
+    uint32_t rcu_rate = rcu_bench_run(true);
+    uint32_t rwlock_rate = rcu_bench_run(false);
+
+    uint64_t start = ktime_get();
+    rcu_assign_pointer(bench_table, bench_tables[1]);
+    synchronize_rcu();
+    uint64_t gp_ns = ktime_get() - start;
+
+    dbg_printf("[%d] RCU bench: %u CPU(s), %u lookups each, rcu %u lookups/us, rwlock %u lookups/us, grace period %u us\n",
+               ticks, cpus_online, lookups, rcu_rate, rwlock_rate, (uint32_t)(gp_ns / NSEC_PER_USEC));
+    dbg_printf("[%d] RCU: %u grace periods so far\n", ticks, rcu_grace_periods);
+}
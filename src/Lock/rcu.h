@@ -0,0 +1,48 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../SMP/smp.h"
+
+// Classic RCU. Readers can't be preempted, so once every other CPU has gone
+// through a context switch or the idle loop, no reader can still hold a pointer
+// that was unpublished before. Read sides cost two non-atomic increments.
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#define RCU_BENCH_ENTRIES 16
+
+static inline void rcu_read_lock() {
+    preempt_disable();
+}
+
+static inline void rcu_read_unlock() {
+    preempt_enable();
+}
+
+// Plain moves on x86, the orderings only stop the compiler from reordering
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+
+void init_rcu();
+void synchronize_rcu();
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void run_rcu_benchmark(uint32_t lookups);
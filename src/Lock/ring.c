@@ -0,0 +1,158 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ring.h"
+
+void ring_init(struct ring *r, void *buffer, uint32_t size, uint32_t elem_size) {
+    // Round down to a power of two rather than index past the buffer
+    while (size & (size - 1)) {
+        size &= size - 1;
+    }
+    r->head = 0;
+    r->tail = 0;
+    r->claim = 0;
+    r->overflows = 0;
+    r->buffer = buffer;
+    r->mask = size - 1;
+    r->elem_size = elem_size;
+}
+
+// Exact on the consumer side, a lower bound anywhere else
+uint32_t ring_count(struct ring *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+}
+
+bool ring_empty(struct ring *r) {
+    return ring_count(r) == 0;
+}
+
+uint32_t ring_overflows(struct ring *r) {
+    return r->overflows;
+}
+
+// Exact for a single producer, which is the only one that should rely on it
+uint32_t ring_space(struct ring *r) {
+    return r->mask + 1 - (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE));
+}
+
+// Copies count elements starting at index pos, in at most two runs around the end
+static void copy_in(struct ring *r, uint32_t pos, const uint8_t *src, uint32_t count) {
+    uint32_t index = pos & r->mask;
+    uint32_t first = r->mask + 1 - index;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(r->buffer + index * r->elem_size, src, first * r->elem_size);
+    memcpy(r->buffer, src + first * r->elem_size, (count - first) * r->elem_size);
+}
+
+static void copy_out(struct ring *r, uint32_t pos, uint8_t *dest, uint32_t count) {
+    uint32_t index = pos & r->mask;
+    uint32_t first = r->mask + 1 - index;
+    if (first > count) {
+        first = count;
+    }
+    memcpy(dest, r->buffer + index * r->elem_size, first * r->elem_size);
+    memcpy(dest + first * r->elem_size, r->buffer, (count - first) * r->elem_size);
+}
+
+// Single producer. Pushes as many of the elements as fit and counts the rest as overflow.
+uint32_t ring_push_batch(struct ring *r, const void *elems, uint32_t count) {
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE); // Consumer is done with those slots
+    uint32_t space = r->mask + 1 - (tail - head);
+
+    if (count > space) {
+        __atomic_add_fetch(&r->overflows, count - space, __ATOMIC_RELAXED);
+        count = space;
+    }
+    if (count) {
+        copy_in(r, tail, elems, count);
+        __atomic_store_n(&r->tail, tail + count, __ATOMIC_RELEASE); // Publishes the copies
+    }
+    return count;
+}
+
+bool ring_push(struct ring *r, const void *elem) {
+    return ring_push_batch(r, elem, 1) == 1;
+}
+
+// Any number of producers. Slots are claimed with a CAS and published in claim order,
+// so the consumer never sees a hole. Interrupts stay off in between, otherwise an
+// IRQ producing on the same CPU would wait forever on the producer it interrupted.
+uint32_t ring_mp_push_batch(struct ring *r, const void *elems, uint32_t count) {
+    uint32_t flags = interrupts_save();
+    uint32_t claim = __atomic_load_n(&r->claim, __ATOMIC_RELAXED);
+    uint32_t claimed;
+
+    do {
+        uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint32_t space = r->mask + 1 - (claim - head);
+        claimed = count < space ? count : space;
+        if (!claimed) {
+            break;
+        }
+    } while (!__atomic_compare_exchange_n(&r->claim, &claim, claim + claimed, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (claimed < count) {
+        __atomic_add_fetch(&r->overflows, count - claimed, __ATOMIC_RELAXED);
+    }
+    if (claimed) {
+        copy_in(r, claim, elems, claimed);
+        while (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) != claim) {
+            asm volatile ("pause");
+        }
+        __atomic_store_n(&r->tail, claim + claimed, __ATOMIC_RELEASE);
+    }
+
+    interrupts_restore(flags);
+    return claimed;
+}
+
+bool ring_mp_push(struct ring *r, const void *elem) {
+    return ring_mp_push_batch(r, elem, 1) == 1;
+}
+
+// Single consumer, returns how many elements were copied out
+uint32_t ring_pop_batch(struct ring *r, void *elems, uint32_t count) {
+    uint32_t head = r->head;
+    uint32_t available = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+
+    if (count > available) {
+        count = available;
+    }
+    if (count) {
+        copy_out(r, head, elems, count);
+        __atomic_store_n(&r->head, head + count, __ATOMIC_RELEASE); // Hands the slots back
+    }
+    return count;
+}
+
+bool ring_pop(struct ring *r, void *elem) {
+    return ring_pop_batch(r, elem, 1) == 1;
+}
+
+// Single consumer. Copies out like ring_pop_batch() but leaves the elements queued.
+uint32_t ring_peek_batch(struct ring *r, void *elems, uint32_t count) {
+    uint32_t head = r->head;
+    uint32_t available = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+
+    if (count > available) {
+        count = available;
+    }
+    copy_out(r, head, elems, count);
+    return count;
+}
@@ -0,0 +1,49 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+// Bounded lock-free ring of fixed-size elements. Indices run freely and are masked
+// on access, so size must be a power of two. The consumer side is single-threaded
+// in both variants; producers use either the ring_push*() (one producer) or the
+// ring_mp_push*() (any number of producers) calls, never both on the same ring.
+struct ring {
+    volatile uint32_t head __attribute__((aligned(64))); // Next element to read, consumer owned
+    volatile uint32_t tail __attribute__((aligned(64))); // End of the published elements
+    volatile uint32_t claim;     // End of the slots handed to producers, multi-producer only
+    volatile uint32_t overflows; // Elements that didn't fit
+    uint8_t *buffer;
+    uint32_t mask;
+    uint32_t elem_size;
+};
+
+// size must already be a power of two here
+#define RING_INIT(buf, size, elem_size) { 0, 0, 0, 0, (uint8_t*)(buf), (size) - 1, (elem_size) }
+
+void ring_init(struct ring *r, void *buffer, uint32_t size, uint32_t elem_size);
+uint32_t ring_count(struct ring *r);
+bool ring_empty(struct ring *r);
+uint32_t ring_overflows(struct ring *r);
+uint32_t ring_space(struct ring *r);
+bool ring_push(struct ring *r, const void *elem);
+uint32_t ring_push_batch(struct ring *r, const void *elems, uint32_t count);
+bool ring_mp_push(struct ring *r, const void *elem);
+uint32_t ring_mp_push_batch(struct ring *r, const void *elems, uint32_t count);
+bool ring_pop(struct ring *r, void *elem);
+uint32_t ring_pop_batch(struct ring *r, void *elems, uint32_t count);
+uint32_t ring_peek_batch(struct ring *r, void *elems, uint32_t count);
@@ -0,0 +1,283 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "spinlock.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Time/tsc.h"
+#include "../Drivers/PIT/pit.h"
+#include "../SMP/smp.h"
+
+#ifdef LOCK_STATS
+static struct lock_stats *stats_list = NULL;
+
+// Locks register themselves the first time they're taken, statically
+// initialized ones never go through an init function
+static void stats_register(struct lock_stats *stats) {
+    if (stats->registered || __atomic_exchange_n(&stats->registered, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    struct lock_stats *head = __atomic_load_n(&stats_list, __ATOMIC_RELAXED);
+    do {
+        stats->next = head;
+    } while (!__atomic_compare_exchange_n(&stats_list, &head, stats, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Runs with the lock held, so plain updates are safe
+static void stats_acquired(struct lock_stats *stats, uint32_t spins) {
+    stats_register(stats);
+    stats->acquisitions++;
+    if (spins) {
+        stats->contended++;
+        stats->spins += spins;
+    }
+    stats->hold_start = rdtsc();
+}
+
+static void stats_released(struct lock_stats *stats) {
+    uint64_t held = rdtsc() - stats->hold_start;
+    if (held > stats->max_hold_cycles) {
+        stats->max_hold_cycles = held;
+    }
+}
+
+static void stats_init(struct lock_stats *stats, const char *name) {
+    memset(stats, 0, sizeof(struct lock_stats));
+    stats->name = name;
+}
+#endif
+
+// Holders can't be preempted, irq_handler() only switches threads while this
+// CPU's preempt_count is 0. The BSP takes locks before init_GDT() sets up %gs,
+// cpus[0].self is only set there.
+static inline void lock_preempt_disable() {
+    if (cpus[0].self) {
+        preempt_disable();
+    }
+}
+
+static inline void lock_preempt_enable() {
+    if (cpus[0].self) {
+        preempt_enable();
+    }
+}
+
+void spin_lock_init(struct spinlock *lock, const char *name) {
+    lock->value = 0;
+#ifdef LOCK_STATS
+    stats_init(&lock->stats, name);
+#else
+    (void)name;
+#endif
+}
+
+void spin_lock(struct spinlock *lock) {
+    uint16_t ticket;
+    uint32_t spins = 0;
+
+    lock_preempt_disable();
+    ticket = __atomic_fetch_add(&lock->tickets.next, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        uint16_t owner = __atomic_load_n(&lock->tickets.owner, __ATOMIC_ACQUIRE);
+        if (owner == ticket) {
+            break;
+        }
+        // Back off in proportion to our place in line, fewer reads of the contended line
+        for (uint16_t ahead = (uint16_t)(ticket - owner); ahead; ahead--) {
+            asm volatile ("pause");
+        }
+        spins++;
+    }
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, spins);
+#else
+    (void)spins;
+#endif
+}
+
+bool spin_trylock(struct spinlock *lock) {
+    uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+    uint16_t owner = value & 0xFFFF;
+    uint16_t next = value >> 16;
+
+    if (owner != next) {
+        return false;
+    }
+    lock_preempt_disable();
+    if (!__atomic_compare_exchange_n(&lock->value, &value, value + 0x10000, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        lock_preempt_enable();
+        return false;
+    }
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, 0);
+#endif
+    return true;
+}
+
+void spin_unlock(struct spinlock *lock) {
+#ifdef LOCK_STATS
+    stats_released(&lock->stats);
+#endif
+    // Only the holder writes owner, so the 16-bit increment can't race
+    __atomic_store_n(&lock->tickets.owner, (uint16_t)(lock->tickets.owner + 1), __ATOMIC_RELEASE);
+    lock_preempt_enable();
+}
+
+bool spin_is_locked(struct spinlock *lock) {
+    uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+    return (value & 0xFFFF) != (value >> 16);
+}
+
+// Disables interrupts before spinning, the returned flags nest correctly
+uint32_t spin_lock_irqsave(struct spinlock *lock) {
+    uint32_t flags = interrupts_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, uint32_t flags) {
+    spin_unlock(lock);
+    interrupts_restore(flags);
+}
+
+void rwlock_init(struct rwlock *lock, const char *name) {
+    lock->value = 0;
+#ifdef LOCK_STATS
+    stats_init(&lock->stats, name);
+#else
+    (void)name;
+#endif
+}
+
+void read_lock(struct rwlock *lock) {
+    uint32_t spins = 0;
+
+    lock_preempt_disable();
+    for (;;) {
+        uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+        if (!(value & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+            __atomic_compare_exchange_n(&lock->value, &value, value + 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        asm volatile ("pause");
+        spins++;
+    }
+
+#ifdef LOCK_STATS
+    // Readers race each other on the counters, good enough for finding hot locks
+    stats_register(&lock->stats);
+    __atomic_fetch_add(&lock->stats.acquisitions, 1, __ATOMIC_RELAXED);
+    if (spins) {
+        __atomic_fetch_add(&lock->stats.contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&lock->stats.spins, spins, __ATOMIC_RELAXED);
+    }
+#else
+    (void)spins;
+#endif
+}
+
+void read_unlock(struct rwlock *lock) {
+    __atomic_fetch_sub(&lock->value, 1, __ATOMIC_RELEASE);
+    lock_preempt_enable();
+}
+
+void write_lock(struct rwlock *lock) {
+    uint32_t spins = 0;
+
+    lock_preempt_disable();
+    for (;;) {
+        uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+        if (!(value & ~RWLOCK_WAITING)) {
+            // Taking it clears WAITING, other writers still spinning set it again
+            if (__atomic_compare_exchange_n(&lock->value, &value, RWLOCK_WRITER, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (!(value & RWLOCK_WAITING)) {
+            __atomic_fetch_or(&lock->value, RWLOCK_WAITING, __ATOMIC_RELAXED);
+        }
+        asm volatile ("pause");
+        spins++;
+    }
+
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, spins);
+#else
+    (void)spins;
+#endif
+}
+
+bool write_trylock(struct rwlock *lock) {
+    uint32_t value = __atomic_load_n(&lock->value, __ATOMIC_RELAXED);
+
+    if (value & ~RWLOCK_WAITING) {
+        return false;
+    }
+    lock_preempt_disable();
+    if (!__atomic_compare_exchange_n(&lock->value, &value, RWLOCK_WRITER, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        lock_preempt_enable();
+        return false;
+    }
+#ifdef LOCK_STATS
+    stats_acquired(&lock->stats, 0);
+#endif
+    return true;
+}
+
+void write_unlock(struct rwlock *lock) {
+#ifdef LOCK_STATS
+    stats_released(&lock->stats);
+#endif
+    // Keeps a WAITING bit another writer set meanwhile
+    __atomic_fetch_and(&lock->value, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+    lock_preempt_enable();
+}
+
+uint32_t read_lock_irqsave(struct rwlock *lock) {
+    uint32_t flags = interrupts_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(struct rwlock *lock, uint32_t flags) {
+    read_unlock(lock);
+    interrupts_restore(flags);
+}
+
+uint32_t write_lock_irqsave(struct rwlock *lock) {
+    uint32_t flags = interrupts_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(struct rwlock *lock, uint32_t flags) {
+    write_unlock(lock);
+    interrupts_restore(flags);
+}
+
+void lock_stats_print() {
+#ifdef LOCK_STATS
+    dbg_printf("[%d] Lock statistics:\n", ticks);
+    for (struct lock_stats *s = __atomic_load_n(&stats_list, __ATOMIC_ACQUIRE); s; s = s->next) {
+        uint64_t max_hold_us = tsc_khz ? s->max_hold_cycles * 1000 / tsc_khz : 0;
+        dbg_printf("[%d]   %s: %llu acquisitions, %llu contended, %llu spins, max hold %llu us\n",
+                   ticks, s->name ? s->name : "?", s->acquisitions, s->contended, s->spins, max_hold_us);
+    }
+#endif
+}
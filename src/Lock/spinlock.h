@@ -0,0 +1,89 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+// Build with LOCK_STATS=1 to count acquisitions, spins and hold times per lock
+struct lock_stats {
+    const char *name;
+    struct lock_stats *next;
+    volatile uint32_t registered;
+    uint64_t acquisitions;
+    uint64_t contended;       // Acquisitions that had to spin
+    uint64_t spins;
+    uint64_t max_hold_cycles; // Writers only for rwlocks
+    uint64_t hold_start;
+};
+
+#ifdef LOCK_STATS
+#define LOCK_STATS_INIT(lock_name) , { lock_name, NULL, 0, 0, 0, 0, 0, 0 }
+#else
+#define LOCK_STATS_INIT(lock_name)
+#endif
+
+// FIFO ticket lock, CPUs get the lock in the order they asked for it. Doesn't
+// touch interrupts, use the _irqsave variants for anything an IRQ handler takes.
+struct spinlock {
+    union {
+        volatile uint32_t value;
+        struct {
+            volatile uint16_t owner; // Ticket being served
+            volatile uint16_t next;  // Ticket handed to the next arrival
+        } tickets;
+    };
+#ifdef LOCK_STATS
+    struct lock_stats stats;
+#endif
+};
+
+#define SPINLOCK_INIT(lock_name) { { 0 } LOCK_STATS_INIT(lock_name) }
+
+// Readers share the lock, a writer excludes everyone. A waiting writer holds off
+// new readers so a steady stream of them can't starve it.
+struct rwlock {
+    volatile uint32_t value; // RWLOCK_WRITER | RWLOCK_WAITING | reader count
+#ifdef LOCK_STATS
+    struct lock_stats stats;
+#endif
+};
+
+#define RWLOCK_WRITER  0x80000000
+#define RWLOCK_WAITING 0x40000000
+
+#define RWLOCK_INIT(lock_name) { 0 LOCK_STATS_INIT(lock_name) }
+
+void spin_lock_init(struct spinlock *lock, const char *name);
+void spin_lock(struct spinlock *lock);
+bool spin_trylock(struct spinlock *lock);
+void spin_unlock(struct spinlock *lock);
+bool spin_is_locked(struct spinlock *lock);
+uint32_t spin_lock_irqsave(struct spinlock *lock);
+void spin_unlock_irqrestore(struct spinlock *lock, uint32_t flags);
+
+void rwlock_init(struct rwlock *lock, const char *name);
+void read_lock(struct rwlock *lock);
+void read_unlock(struct rwlock *lock);
+void write_lock(struct rwlock *lock);
+bool write_trylock(struct rwlock *lock);
+void write_unlock(struct rwlock *lock);
+uint32_t read_lock_irqsave(struct rwlock *lock);
+void read_unlock_irqrestore(struct rwlock *lock, uint32_t flags);
+uint32_t write_lock_irqsave(struct rwlock *lock);
+void write_unlock_irqrestore(struct rwlock *lock, uint32_t flags);
+
+void lock_stats_print();
@@ -0,0 +1,206 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ftrace.h"
+#include "../Headers/format.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/PIT/pit.h"
+#include "../GDT/gdt.h"
+#include "../Lock/ring.h"
+#include "../Lock/spinlock.h"
+#include "../SMP/smp.h"
+#include "../Time/tsc.h"
+#include "../Debug/ksyms.h"
+
+#define FTRACE_PORT 0xe9 // QEMU debug console, -debugcon file:...
+
+#if FTRACE >= 2
+volatile uint32_t tracepoints_enabled = TRACEPOINT_ALL;
+#elif FTRACE >= 1
+volatile uint32_t tracepoints_enabled = TRACEPOINT_ALL & ~TRACEPOINT_FUNCTIONS;
+#else
+volatile uint32_t tracepoints_enabled = 0;
+#endif
+
+// One ring per CPU, pushed with interrupts off so the CPU is its only producer
+static struct ftrace_event ftrace_buffers[MAX_CPUS][FTRACE_RING_EVENTS];
+static struct ring ftrace_rings[MAX_CPUS];
+static bool recording[MAX_CPUS]; // Anything the recorder calls that got instrumented anyway
+static struct spinlock ftrace_dump_lock = SPINLOCK_INIT("ftrace_dump_lock");
+
+// Only the BSP runs before init_GDT(). An AP isn't traced until init_cpu_GDT()
+// loads its %gs, until then it has the flat data segment there.
+static notrace int32_t ftrace_cpu() {
+    uint16_t selector;
+    struct cpu *cpu;
+
+    if (!cpus[0].self) {
+        return 0;
+    }
+    asm volatile ("mov %%gs, %0" : "=r"(selector));
+    if (selector != PERCPU_SELECTOR) {
+        return -1;
+    }
+    asm volatile ("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu->id;
+}
+
+notrace void ftrace_record(uint8_t type, uint32_t id, uint32_t arg) {
+    struct ftrace_event event;
+    uint32_t flags = interrupts_save();
+    int32_t cpu = ftrace_cpu();
+
+    if (cpu >= 0 && !recording[cpu]) {
+        recording[cpu] = true;
+        if (!ftrace_rings[cpu].buffer) {
+            ring_init(&ftrace_rings[cpu], ftrace_buffers[cpu], FTRACE_RING_EVENTS, sizeof(struct ftrace_event));
+        }
+        event.timestamp = rdtsc();
+        event.id = id;
+        event.arg = arg;
+        event.type = type;
+        ring_push(&ftrace_rings[cpu], &event);
+        recording[cpu] = false;
+    }
+    interrupts_restore(flags);
+}
+
+// Called by -finstrument-functions code at every entry and exit
+notrace void __cyg_profile_func_enter(void *function, void *call_site) {
+    if (tracepoints_enabled & TRACEPOINT_FUNCTIONS) {
+        ftrace_record(FTRACE_FUNC_ENTRY, (uint32_t)function, (uint32_t)call_site);
+    }
+}
+
+notrace void __cyg_profile_func_exit(void *function, void *call_site) {
+    if (tracepoints_enabled & TRACEPOINT_FUNCTIONS) {
+        ftrace_record(FTRACE_FUNC_EXIT, (uint32_t)function, (uint32_t)call_site);
+    }
+}
+
+void ftrace_enable(uint32_t categories) {
+    __atomic_or_fetch(&tracepoints_enabled, categories, __ATOMIC_RELAXED);
+}
+
+void ftrace_disable(uint32_t categories) {
+    __atomic_and_fetch(&tracepoints_enabled, ~categories, __ATOMIC_RELAXED);
+}
+
+uint32_t ftrace_dropped() {
+    uint32_t dropped = 0;
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        dropped += ring_overflows(&ftrace_rings[cpu]);
+    }
+    return dropped;
+}
+
+static void ftrace_puts(const char *text) {
+    outsb(FTRACE_PORT, text, strlen(text));
+}
+
+// Names are C strings from the kernel, quotes and backslashes are all JSON minds
+static void ftrace_put_name(const struct ftrace_event *event) {
+    char name[PRINTF_BUFFER_SIZE];
+    const char *text = (const char*)event->id;
+    uint32_t length = 0;
+
+    if (event->type == FTRACE_FUNC_ENTRY || event->type == FTRACE_FUNC_EXIT) {
+        text = ksym_lookup(event->id, NULL);
+        if (!text) {
+            snprintf(name, sizeof(name), "0x%08x", event->id);
+            ftrace_puts(name);
+            return;
+        }
+    }
+    for (const char *c = text; *c && length < sizeof(name) - 2; c++) {
+        if (*c == '"' || *c == '\\') {
+            name[length++] = '\\';
+        }
+        name[length++] = *c;
+    }
+    outsb(FTRACE_PORT, name, length);
+}
+
+// Microseconds since base, as Chrome's "ts" wants them
+static void ftrace_put_event(const struct ftrace_event *event, uint32_t cpu, uint64_t base) {
+    char line[PRINTF_BUFFER_SIZE];
+    char arg[64];
+    uint32_t khz = tsc_khz ? tsc_khz : 1000000;
+    uint64_t ns = (event->timestamp - base) * 1000000 / khz;
+    bool begin = event->type == FTRACE_BEGIN || event->type == FTRACE_FUNC_ENTRY;
+    bool function = event->type >= FTRACE_FUNC_ENTRY;
+
+    if (function) {
+        ksym_snprint(arg, sizeof(arg), event->arg);
+    } else {
+        snprintf(arg, sizeof(arg), "0x%x", event->arg);
+    }
+    ftrace_puts(",\n{\"name\":\"");
+    ftrace_put_name(event);
+    snprintf(line, sizeof(line), "\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":0,\"tid\":%u,\"args\":{\"%s\":\"%s\"}}",
+             begin ? 'B' : 'E', ns / 1000, (uint32_t)(ns % 1000), cpu, function ? "caller" : "arg", arg);
+    ftrace_puts(line);
+}
+
+// Writes out and forgets everything recorded so far as Chrome trace JSON, for
+// chrome://tracing or ui.perfetto.dev. Recording pauses meanwhile. Run QEMU with
+// -debugcon file:ftrace.json (make qemu_ftrace) to keep it.
+void ftrace_dump_chrome() {
+    struct ftrace_event event;
+    uint64_t base = ~0ULL;
+    uint32_t events = 0;
+    uint32_t enabled;
+    bool first = true;
+    char line[PRINTF_BUFFER_SIZE];
+
+    if (!spin_trylock(&ftrace_dump_lock)) {
+        return;
+    }
+    enabled = __atomic_exchange_n(&tracepoints_enabled, 0, __ATOMIC_SEQ_CST);
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (ring_peek_batch(&ftrace_rings[cpu], &event, 1) && event.timestamp < base) {
+            base = event.timestamp;
+        }
+    }
+    if (base == ~0ULL) {
+        tracepoints_enabled = enabled;
+        spin_unlock(&ftrace_dump_lock);
+        return;
+    }
+
+    ftrace_puts("{\"traceEvents\":[");
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (ring_empty(&ftrace_rings[cpu])) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"CPU %u\"}}",
+                 first ? "" : ",", cpu, cpu);
+        ftrace_puts(line);
+        first = false;
+        // Always after the thread_name record, so always after a comma
+        while (ring_pop(&ftrace_rings[cpu], &event)) {
+            ftrace_put_event(&event, cpu, base);
+            events++;
+        }
+    }
+    snprintf(line, sizeof(line), "\n],\"otherData\":{\"dropped\":\"%u\"}}\n", ftrace_dropped());
+    ftrace_puts(line);
+
+    tracepoints_enabled = enabled;
+    spin_unlock(&ftrace_dump_lock);
+    dbg_printf("[%d] Wrote %u trace events to port 0x%x, %u dropped\n", ticks, events, FTRACE_PORT, ftrace_dropped());
+}
@@ -0,0 +1,76 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+// make FTRACE=1 records the tracepoints from boot, FTRACE=2 every function entry
+// and exit as well (-finstrument-functions)
+#ifndef FTRACE
+#define FTRACE 0
+#endif
+
+// Tracepoint categories, bits of tracepoints_enabled
+#define TRACEPOINT_IRQ       (1 << 0) // irq_handler()
+#define TRACEPOINT_ISR       (1 << 1) // isr_handler()
+#define TRACEPOINT_ATA       (1 << 2) // read_sector(), write_sector()
+#define TRACEPOINT_INIT      (1 << 3) // init_*() during boot
+#define TRACEPOINT_FUNCTIONS (1 << 4) // Function entry and exit, FTRACE=2 builds only
+#define TRACEPOINT_ALL       0x1F
+
+// Events kept per CPU, a power of two. Recording stops when a ring is full.
+#if FTRACE >= 1
+#define FTRACE_RING_EVENTS 8192
+#else
+#define FTRACE_RING_EVENTS 256 // Only for ftrace_enable() at run time
+#endif
+
+#define FTRACE_BEGIN      0 // id is a name
+#define FTRACE_END        1
+#define FTRACE_FUNC_ENTRY 2 // id is the function, arg the call site
+#define FTRACE_FUNC_EXIT  3
+
+// Code the function tracer calls must not be instrumented itself
+#define notrace __attribute__((no_instrument_function))
+
+struct ftrace_event {
+    uint64_t timestamp; // rdtsc()
+    uint32_t id;
+    uint32_t arg;
+    uint8_t type;
+};
+
+extern volatile uint32_t tracepoints_enabled;
+
+// A disabled tracepoint costs one branch, predicted not taken
+#define tracepoint(category, type, id, arg) do {                    \
+    if (__builtin_expect(tracepoints_enabled & (category), 0)) {   \
+        ftrace_record((type), (uint32_t)(id), (uint32_t)(arg));    \
+    }                                                              \
+} while (0)
+
+#define trace_begin(category, name, arg) tracepoint(category, FTRACE_BEGIN, name, arg)
+#define trace_end(category, name, arg) tracepoint(category, FTRACE_END, name, arg)
+
+void ftrace_record(uint8_t type, uint32_t id, uint32_t arg);
+void ftrace_enable(uint32_t categories);
+void ftrace_disable(uint32_t categories);
+void ftrace_dump_chrome();
+uint32_t ftrace_dropped();
+
+void __cyg_profile_func_enter(void *function, void *call_site);
+void __cyg_profile_func_exit(void *function, void *call_site);
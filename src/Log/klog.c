@@ -0,0 +1,287 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "klog.h"
+#include "trace.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/Serial/serial.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Lock/ring.h"
+#include "../Lock/spinlock.h"
+#include "../SMP/smp.h"
+#include "../Scheduler/scheduler.h"
+#include "../Scheduler/wait.h"
+
+volatile uint8_t klog_level = KLOG_TRACE; // Everything queues until the sinks are known
+
+// One ring per CPU, pushed with interrupts off so the CPU is its only producer.
+// Drainers are serialized by klog_drain_lock and merge the rings by timestamp.
+static uint8_t klog_buffers[MAX_CPUS][KLOG_RING_SIZE];
+static struct ring klog_rings[MAX_CPUS];
+static struct spinlock klog_drain_lock = SPINLOCK_INIT("klog_drain_lock");
+static uint32_t dropped = 0;
+
+static struct klog_sink *sinks[KLOG_MAX_SINKS];
+static volatile uint32_t sink_count = 0;
+
+static struct wait_queue klog_wq = WAIT_QUEUE_INIT(klog_wq);
+static struct thread *klogd_thread = NULL;
+static volatile bool klogd_running = false; // Producers drain synchronously until then
+static volatile bool klogd_waiting = false;
+
+// The BSP logs before init_GDT() sets up %gs, cpus[0].self is only set there
+static uint32_t klog_cpu() {
+    return cpus[0].self ? this_cpu()->id : 0;
+}
+
+static bool klog_pending() {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (!ring_empty(&klog_rings[cpu])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sinks call this while their device is backed up, klogd sleeps, anyone else spins
+static void klog_wait() {
+    if (klogd_thread && thread_current() == klogd_thread) {
+        thread_sleep(1);
+    } else {
+        asm volatile ("pause");
+    }
+}
+
+static void console_sink_write(const struct klog_record *record, const char *text) {
+    (void)record;
+    puts(text);
+}
+
+// Binary trace events go out framed, the decoder tells them from text by the magic byte
+static void trace_frame_init(struct trace_frame *frame, const struct klog_record *record) {
+    frame->magic = TRACE_MAGIC;
+    frame->cpu = record->cpu;
+    frame->length = record->length;
+    frame->timestamp = record->timestamp;
+}
+
+// The TX ring can fill up under a flood, records are never cut short
+static void serial_send(const void *data, uint32_t length) {
+    uint32_t sent = 0;
+
+    while (sent < length) {
+        uint32_t count = length - sent;
+        uint32_t space = serial_tx_space();
+        if (!space) {
+            serial_kick();
+            klog_wait();
+            continue;
+        }
+        sent += serial_write((const uint8_t*)data + sent, count < space ? count : space);
+    }
+}
+
+static void serial_sink_write(const struct klog_record *record, const char *text) {
+    if (record->level == KLOG_TRACE) {
+        struct trace_frame frame;
+        trace_frame_init(&frame, record);
+        serial_send(&frame, sizeof(frame));
+    }
+    serial_send(text, record->length);
+}
+
+static void debugcon_sink_write(const struct klog_record *record, const char *text) {
+    if (record->level == KLOG_TRACE) {
+        struct trace_frame frame;
+        trace_frame_init(&frame, record);
+        outsb(0xe9, &frame, sizeof(frame));
+    }
+    outsb(0xe9, text, record->length);
+}
+
+static struct klog_sink console_sink = { "console", KLOG_WARNING, console_sink_write };
+static struct klog_sink serial_sink = { "serial", KLOG_TRACE, serial_sink_write };
+static struct klog_sink debugcon_sink = { "debugcon", KLOG_TRACE, debugcon_sink_write };
+
+bool klog_register_sink(struct klog_sink *sink) {
+    uint32_t count = sink_count;
+    uint8_t level = 0;
+
+    if (count == KLOG_MAX_SINKS) {
+        return false;
+    }
+    sinks[count] = sink;
+    __atomic_store_n(&sink_count, count + 1, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i <= count; i++) {
+        if (sinks[i]->max_level > level) {
+            level = sinks[i]->max_level;
+        }
+    }
+    klog_level = level;
+    return true;
+}
+
+// Serial when there's a UART, the debug port otherwise, and warnings and worse
+// on screen. Call after init_serial().
+void init_klog_sinks() {
+    klog_register_sink(serial_present() ? &serial_sink : &debugcon_sink);
+    klog_register_sink(&console_sink);
+    klog_flush();
+}
+
+// Needs klog_drain_lock. Hands the oldest record across all rings to the sinks.
+static bool klog_drain_one() {
+    struct klog_record record;
+    struct klog_record oldest;
+    struct ring *from = NULL;
+    char text[KLOG_MAX_TEXT + 1];
+
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (ring_peek_batch(&klog_rings[cpu], &record, sizeof(record)) == sizeof(record) &&
+            (!from || record.timestamp < oldest.timestamp)) {
+            oldest = record;
+            from = &klog_rings[cpu];
+        }
+    }
+    if (!from) {
+        return false;
+    }
+
+    // Records are pushed whole, the text is already there
+    ring_pop_batch(from, &oldest, sizeof(oldest));
+    ring_pop_batch(from, text, oldest.length);
+    text[oldest.length] = '\0';
+
+    uint32_t count = __atomic_load_n(&sink_count, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < count; i++) {
+        if (oldest.level <= sinks[i]->max_level) {
+            sinks[i]->write(&oldest, text);
+        }
+    }
+    return true;
+}
+
+// Drains every ring to the sinks now. A drainer that's already at it takes what
+// we queued, so this never waits on another CPU.
+void klog_flush() {
+    if (!__atomic_load_n(&sink_count, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    do {
+        if (!spin_trylock(&klog_drain_lock)) {
+            return;
+        }
+        while (klog_drain_one());
+        spin_unlock(&klog_drain_lock);
+    } while (klog_pending()); // Pushed after our last look, when the trylock still failed
+}
+
+// Queues a record for the sinks without touching any device. A full ring is
+// drained on the spot, from where interrupts were off the record is dropped
+// if that didn't make room.
+void klog_write(uint8_t level, const char *text, uint32_t length) {
+    uint8_t buffer[sizeof(struct klog_record) + KLOG_MAX_TEXT];
+    struct klog_record *record = (struct klog_record*)buffer;
+    bool flushed = false;
+
+    if (length > KLOG_MAX_TEXT) {
+        length = KLOG_MAX_TEXT;
+    }
+    record->length = length;
+    record->level = level;
+    memcpy(buffer + sizeof(*record), text, length);
+
+    for (;;) {
+        uint32_t flags = interrupts_save();
+        uint32_t cpu = klog_cpu();
+        struct ring *ring = &klog_rings[cpu];
+
+        // Set up by its producer on first use, drainers see it with the first record
+        if (!ring->buffer) {
+            ring_init(ring, klog_buffers[cpu], KLOG_RING_SIZE, sizeof(uint8_t));
+        }
+        if (ring_space(ring) >= sizeof(*record) + length) {
+            record->timestamp = rdtsc();
+            record->cpu = cpu;
+            ring_push_batch(ring, buffer, sizeof(*record) + length);
+            interrupts_restore(flags);
+            break;
+        }
+        interrupts_restore(flags);
+
+        if (flushed && !(flags & 0x200)) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        klog_flush();
+        flushed = true;
+        asm volatile ("pause");
+    }
+
+    if (!klogd_running) {
+        klog_flush();
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // Push before the check, klogd sets then checks
+    if (klogd_waiting) {
+        wake_up_one(&klog_wq);
+    }
+}
+
+void klog_vprintf(uint8_t level, const char *fmt, va_list args) {
+    char text[KLOG_MAX_TEXT];
+    int length = vsnprintf(text, sizeof(text), fmt, args);
+
+    klog_write(level, text, length < (int)sizeof(text) ? (uint32_t)length : sizeof(text) - 1);
+}
+
+void klog_printf(uint8_t level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    klog_vprintf(level, fmt, args);
+    va_end(args);
+}
+
+static void klogd(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        __atomic_store_n(&klogd_waiting, true, __ATOMIC_SEQ_CST);
+        wait_event(klog_wq, klog_pending());
+        klogd_waiting = false;
+        klog_flush();
+    }
+}
+
+// Needs the scheduler. Until klogd runs every record is drained by its writer.
+void init_klog() {
+    klogd_thread = thread_create("klogd", klogd, NULL);
+    if (!klogd_thread) {
+        klog(KLOG_ERR, "[%d] Failed to start klogd\n", ticks);
+        return;
+    }
+    klogd_running = true;
+}
+
+// Crash paths: back to writing synchronously, nothing may wait on klogd
+void klog_emergency() {
+    klogd_running = false;
+    klog_flush();
+}
+
+uint32_t klog_dropped() {
+    return dropped;
+}
@@ -0,0 +1,72 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../Headers/format.h"
+#include <stdarg.h>
+
+// Severities, lower is more urgent
+#define KLOG_EMERG   0
+#define KLOG_ALERT   1
+#define KLOG_CRIT    2
+#define KLOG_ERR     3
+#define KLOG_WARNING 4
+#define KLOG_NOTICE  5
+#define KLOG_INFO    6 // dbg_printf() and friends
+#define KLOG_DEBUG   7
+#define KLOG_TRACE   8 // Binary trace events, see trace.h
+
+#define KLOG_RING_SIZE 8192             // Per CPU, a power of two
+#define KLOG_MAX_TEXT PRINTF_BUFFER_SIZE // Longer records are cut
+#define KLOG_MAX_SINKS 4
+
+// Header of every record in the rings, the text follows without a terminator
+struct klog_record {
+    uint64_t timestamp; // rdtsc() when logged
+    uint16_t length;
+    uint8_t level;
+    uint8_t cpu;
+};
+
+// Gets the records at or below max_level in timestamp order, text terminated.
+// KLOG_TRACE records carry a binary payload instead of text.
+// Called by whoever drains the rings, normally the klogd thread.
+struct klog_sink {
+    const char *name;
+    uint8_t max_level;
+    void (*write)(const struct klog_record *record, const char *text);
+};
+
+extern volatile uint8_t klog_level; // Most verbose level any sink takes
+
+// Filters before the arguments are evaluated or anything is formatted
+#define klog(level, ...) do {              \
+    if ((level) <= klog_level) {           \
+        klog_printf((level), __VA_ARGS__); \
+    }                                      \
+} while (0)
+
+void klog_printf(uint8_t level, const char *fmt, ...);
+void klog_vprintf(uint8_t level, const char *fmt, va_list args);
+void klog_write(uint8_t level, const char *text, uint32_t length);
+bool klog_register_sink(struct klog_sink *sink);
+void init_klog_sinks();
+void init_klog();
+void klog_flush();
+void klog_emergency();
+uint32_t klog_dropped();
@@ -0,0 +1,39 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+// Every argument sits in its own 4-byte stack slots on i386, a long long in two,
+// so the words can be copied out without knowing the types
+void trace_event(uint32_t words, const char *fmt, ...) {
+    uint32_t payload[1 + TRACE_MAX_WORDS];
+    va_list args;
+
+    if (KLOG_TRACE > klog_level) {
+        return;
+    }
+    if (words > TRACE_MAX_WORDS) {
+        words = TRACE_MAX_WORDS;
+    }
+
+    payload[0] = (uint32_t)fmt;
+    va_start(args, fmt);
+    for (uint32_t i = 0; i < words; i++) {
+        payload[1 + i] = va_arg(args, uint32_t);
+    }
+    va_end(args);
+
+    klog_write(KLOG_TRACE, (const char*)payload, (1 + words) * sizeof(uint32_t));
+}
@@ -0,0 +1,56 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "klog.h"
+
+#define TRACE_MAGIC 0xFF    // Starts every frame on the wire, never part of log text
+#define TRACE_MAX_WORDS 16  // Argument words kept per event
+
+// A binary event on the wire: this header, the address of the format string and
+// the argument words as they were passed. tools/tracedecode.py finds the format
+// in the kernel ELF and does the formatting on the host.
+struct trace_frame {
+    uint8_t magic;
+    uint8_t cpu;
+    uint16_t length;    // Bytes after the header
+    uint64_t timestamp; // rdtsc() when logged
+} __attribute__((packed));
+
+// Stack words an argument takes through "...", promoted like the call promotes it
+#define TRACE_WORDS_1(a) ((sizeof((a) + 0) + 3) / 4)
+#define TRACE_WORDS_2(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_1(__VA_ARGS__))
+#define TRACE_WORDS_3(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_2(__VA_ARGS__))
+#define TRACE_WORDS_4(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_3(__VA_ARGS__))
+#define TRACE_WORDS_5(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_4(__VA_ARGS__))
+#define TRACE_WORDS_6(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_5(__VA_ARGS__))
+#define TRACE_WORDS_7(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_6(__VA_ARGS__))
+#define TRACE_WORDS_8(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_7(__VA_ARGS__))
+#define TRACE_WORDS_9(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_8(__VA_ARGS__))
+#define TRACE_WORDS_10(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_9(__VA_ARGS__))
+#define TRACE_WORDS_11(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_10(__VA_ARGS__))
+#define TRACE_WORDS_12(a, ...) (TRACE_WORDS_1(a) + TRACE_WORDS_11(__VA_ARGS__))
+#define TRACE_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, name, ...) name
+#define TRACE_WORDS(...) TRACE_PICK(__VA_ARGS__, TRACE_WORDS_12, TRACE_WORDS_11, TRACE_WORDS_10, \
+    TRACE_WORDS_9, TRACE_WORDS_8, TRACE_WORDS_7, TRACE_WORDS_6, TRACE_WORDS_5, TRACE_WORDS_4,      \
+    TRACE_WORDS_3, TRACE_WORDS_2, TRACE_WORDS_1, unused)(__VA_ARGS__)
+
+// trace(fmt, ...) takes the same arguments as dbg_printf() but only stores them
+#define trace(...) trace_event(TRACE_WORDS(__VA_ARGS__) - 1, __VA_ARGS__)
+
+void trace_event(uint32_t words, const char *fmt, ...);
@@ -14,53 +14,389 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "paging.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Lock/spinlock.h"
+
+extern uint8_t kernel_end[];
 
 page_entry_t page_directory[PAGE_DIRECTORY_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
-page_entry_t page_table[PAGE_TABLE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+page_entry_t page_table[KERNEL_PAGE_TABLES * PAGE_TABLE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+
+// One bit per 4 KiB frame of the identity mapped region, set = in use
+static uint32_t frame_bitmap[MAX_FRAMES / 32];
+static uint32_t frame_search_hint = 0;
+static uint32_t frames_free = 0;
+static struct spinlock frame_lock = SPINLOCK_INIT("frame_lock");
+
+static struct vm_area vm_areas[MAX_VM_AREAS];
+static uint32_t vm_area_count = 0;
+uint32_t page_faults_handled = 0;
+
+static inline void invlpg(uint32_t virtual_addr) {
+    asm volatile ("invlpg (%0)" : : "r"(virtual_addr) : "memory");
+}
 
 // Function to set page directory and page table entries
 void set_page_directory_entry(uint32_t index, uint32_t base_addr, uint32_t flags) {
     page_directory[index] = (base_addr & 0xFFFFF000) | (flags & 0xFFF);
 }
 
+// index runs across all of the kernel page tables, they are laid out back to back
 void set_page_table_entry(uint32_t index, uint32_t base_addr, uint32_t flags) {
     page_table[index] = (base_addr & 0xFFFFF000) | (flags & 0xFFF);
 }
 
+page_entry_t* get_page_dir_loc() {
+    return page_directory;
+}
+
 void map_page(uint32_t physical_addr, uint32_t virtual_addr, uint32_t flags) {
     uint32_t dir_index = (virtual_addr >> 22) & 0x3FF;
     uint32_t table_index = (virtual_addr >> 12) & 0x3FF;
+    page_entry_t *table;
 
     // Ensure the page directory entry points to a valid page table
-    if (page_directory[dir_index] & 0x1) { // Check if page directory entry is present
-        // Page table is already present, no need to create it
+    if (page_directory[dir_index] & PAGE_PRESENT) { // Check if page directory entry is present
+        table = (page_entry_t*)(page_directory[dir_index] & 0xFFFFF000);
+        // User access needs U/S in the directory entry as well as in the page
+        page_directory[dir_index] |= flags & PAGE_USER;
     } else {
-        // Page table not present, allocate and set it up
-        uint32_t page_table_addr = (uint32_t)page_table;
-        set_page_directory_entry(dir_index, page_table_addr, 0x007); // Present, RW, U/S
+        // Page table not present, allocate a frame for it (frames are identity mapped)
+        uint32_t page_table_addr = alloc_frame();
+        if (!page_table_addr) {
+            dbg_printf("[%d] Out of frames while mapping 0x%x\n", ticks, virtual_addr);
+            return;
+        }
+        memset((void*)page_table_addr, 0, PAGE_SIZE);
+        set_page_directory_entry(dir_index, page_table_addr, PAGE_PRESENT | PAGE_WRITE | (flags & PAGE_USER));
+        table = (page_entry_t*)page_table_addr;
     }
 
     // Set up the page table to point to the physical address with specified flags
-    set_page_table_entry(table_index, physical_addr, flags);
+    table[table_index] = (physical_addr & 0xFFFFF000) | (flags & 0xFFF);
+    invlpg(virtual_addr);
+}
+
+void unmap_page(uint32_t virtual_addr) {
+    uint32_t dir_index = (virtual_addr >> 22) & 0x3FF;
+    uint32_t table_index = (virtual_addr >> 12) & 0x3FF;
+
+    if (!(page_directory[dir_index] & PAGE_PRESENT)) {
+        return;
+    }
+
+    page_entry_t *table = (page_entry_t*)(page_directory[dir_index] & 0xFFFFF000);
+    table[table_index] = 0;
+    invlpg(virtual_addr);
+}
+
+// Identity maps a physical range (ACPI tables, MMIO registers) into the kernel
+// and returns a pointer to it. Regions inside the identity map are left alone.
+void* map_physical_region(uint32_t physical_addr, uint32_t size, uint32_t flags) {
+    uint32_t end = physical_addr + size;
+
+    for (uint32_t page = PAGE_ALIGN_DOWN(physical_addr); page < end && page >= PAGE_ALIGN_DOWN(physical_addr); page += PAGE_SIZE) {
+        if (page < IDENTITY_MAP_SIZE) {
+            continue;
+        }
+        if (!(get_page_entry(page) & PAGE_PRESENT)) {
+            map_page(page, page, PAGE_PRESENT | PAGE_WRITE | flags);
+        }
+    }
+    return (void*)physical_addr;
+}
+
+// Returns the raw page table entry for an address, 0 when nothing is mapped
+page_entry_t get_page_entry(uint32_t virtual_addr) {
+    uint32_t dir_index = (virtual_addr >> 22) & 0x3FF;
+    uint32_t table_index = (virtual_addr >> 12) & 0x3FF;
+
+    if (!(page_directory[dir_index] & PAGE_PRESENT)) {
+        return 0;
+    }
+
+    page_entry_t *table = (page_entry_t*)(page_directory[dir_index] & 0xFFFFF000);
+    return table[table_index];
 }
 
 // Function to initialize paging
 void init_paging() {
-    // Clear the page directory and page table
+    // Clear the page directory and page tables
     memset(page_directory, 0, sizeof(page_directory));
     memset(page_table, 0, sizeof(page_table));
 
-    // Identity map the first 4MB of memory (0x00000000 to 0x00400000)
-    for (uint32_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-        set_page_table_entry(i, i * PAGE_SIZE, 0x007); // Present, RW, U/S
+    // Identity map the first 16MB of memory (0x00000000 to 0x01000000), supervisor only.
+    // Only the pages vm_populate() backs for a vm_area are reachable from ring 3.
+    for (uint32_t i = 0; i < KERNEL_PAGE_TABLES * PAGE_TABLE_ENTRIES; i++) {
+        set_page_table_entry(i, i * PAGE_SIZE, 0x003); // Present, RW
     }
 
-    // Map the page table into the page directory
-    set_page_directory_entry(0, (uint32_t)page_table, 0x007); // Present, RW, U/S
+    // Map the page tables into the page directory
+    for (uint32_t i = 0; i < KERNEL_PAGE_TABLES; i++) {
+        set_page_directory_entry(i, (uint32_t)&page_table[i * PAGE_TABLE_ENTRIES], 0x003); // Present, RW
+    }
 
     // Map virtual address 0xc0000000 to physical address 0x00100000
-    map_page(0x00100000, 0xc0000000, 0x007); // Present, RW, U/S
+    map_page(0x00100000, 0xc0000000, 0x003); // Present, RW
 
     // Enable paging
     enable_paging((uint32_t)page_directory);
-}
\ No newline at end of file
+}
+
+static inline bool frame_in_use(uint32_t index) {
+    return frame_bitmap[index / 32] & (1u << (index % 32));
+}
+
+static inline void mark_frame(uint32_t index, bool used) {
+    if (used) {
+        frame_bitmap[index / 32] |= (1u << (index % 32));
+    } else {
+        frame_bitmap[index / 32] &= ~(1u << (index % 32));
+    }
+}
+
+static void release_range(uint32_t start, uint32_t end) {
+    uint32_t kernel_limit = PAGE_ALIGN_UP((uint32_t)kernel_end);
+
+    if (start < kernel_limit) start = kernel_limit;
+    if (end > IDENTITY_MAP_SIZE) end = IDENTITY_MAP_SIZE;
+
+    for (uint32_t addr = PAGE_ALIGN_UP(start); addr + PAGE_SIZE <= end; addr += PAGE_SIZE) {
+        if (frame_in_use(addr / PAGE_SIZE)) {
+            mark_frame(addr / PAGE_SIZE, false);
+            frames_free++;
+        }
+    }
+}
+
+void reserve_frames(uint32_t start, uint32_t end) {
+    if (end > IDENTITY_MAP_SIZE) end = IDENTITY_MAP_SIZE;
+
+    for (uint32_t addr = PAGE_ALIGN_DOWN(start); addr < end; addr += PAGE_SIZE) {
+        if (!frame_in_use(addr / PAGE_SIZE)) {
+            mark_frame(addr / PAGE_SIZE, true);
+            frames_free--;
+        }
+    }
+}
+
+// Hands out the usable RAM above the kernel image that falls inside the identity map.
+// Must run before init_paging(), which allocates page tables from here.
+void init_frame_allocator(struct multiboot_info* mb_info) {
+    memset(frame_bitmap, (char)0xFF, sizeof(frame_bitmap));
+    frames_free = 0;
+
+    if (mb_info->flags & 0x40) {
+        struct multiboot_mmap_entry* mmap = (struct multiboot_mmap_entry*)mb_info->mmap_addr;
+        for (struct multiboot_mmap_entry* entry = mmap;
+             (uint8_t*)entry < (uint8_t*)mmap + mb_info->mmap_length;
+             entry = (struct multiboot_mmap_entry*)((uint8_t*)entry + entry->size + sizeof(entry->size))) {
+            if (entry->type != MULTIBOOT_MEMORY_AVAILABLE || entry->addr_high != 0) {
+                continue;
+            }
+            uint32_t end = entry->addr_low + entry->len_low;
+            if (entry->len_high != 0 || end < entry->addr_low) {
+                end = 0xFFFFFFFF;
+            }
+            release_range(entry->addr_low, end);
+        }
+    } else if (mb_info->flags & 0x1) {
+        release_range(0x00100000, 0x00100000 + mb_info->mem_upper * 1024);
+    }
+
+    // Keep everything GRUB handed us out of the allocator
+    reserve_frames((uint32_t)mb_info, (uint32_t)mb_info + sizeof(struct multiboot_info));
+    if (mb_info->flags & 0x8) {
+        struct multiboot_mod_list *mods = (struct multiboot_mod_list*)mb_info->mods_addr;
+        reserve_frames(mb_info->mods_addr, mb_info->mods_addr + mb_info->mods_count * sizeof(struct multiboot_mod_list));
+        for (uint32_t i = 0; i < mb_info->mods_count; i++) {
+            reserve_frames(mods[i].mod_start, mods[i].mod_end);
+            if (mods[i].cmdline) {
+                reserve_frames(mods[i].cmdline, mods[i].cmdline + 1);
+            }
+        }
+    }
+    if (mb_info->flags & 0x40) {
+        reserve_frames(mb_info->mmap_addr, mb_info->mmap_addr + mb_info->mmap_length);
+    }
+
+    dbg_printf("[%d] %u free frames (%u KB)\n", ticks, frames_free, frames_free * 4);
+}
+
+uint32_t alloc_frames(uint32_t count) {
+    uint32_t run = 0;
+    uint32_t flags = spin_lock_irqsave(&frame_lock);
+
+    if (count == 0 || count > frames_free) {
+        spin_unlock_irqrestore(&frame_lock, flags);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < MAX_FRAMES; i++) {
+        uint32_t index = (frame_search_hint + i) % MAX_FRAMES;
+        if (index == 0) {
+            run = 0; // A run can't wrap around the end of the bitmap
+        }
+        if (frame_in_use(index)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            uint32_t first = index + 1 - count;
+            for (uint32_t j = first; j <= index; j++) {
+                mark_frame(j, true);
+            }
+            frames_free -= count;
+            frame_search_hint = (index + 1) % MAX_FRAMES;
+            spin_unlock_irqrestore(&frame_lock, flags);
+            return first * PAGE_SIZE;
+        }
+    }
+    spin_unlock_irqrestore(&frame_lock, flags);
+    return 0;
+}
+
+uint32_t alloc_frame() {
+    return alloc_frames(1);
+}
+
+void free_frames(uint32_t frame, uint32_t count) {
+    uint32_t flags = spin_lock_irqsave(&frame_lock);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = frame / PAGE_SIZE + i;
+        if (index < MAX_FRAMES && frame_in_use(index)) {
+            mark_frame(index, false);
+            frames_free++;
+        }
+    }
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+void free_frame(uint32_t frame) {
+    free_frames(frame, 1);
+}
+
+uint32_t free_frame_count() {
+    return frames_free;
+}
+
+bool vm_add_area(uint32_t start, uint32_t end, uint32_t flags, const uint8_t *file_data, uint32_t file_size) {
+    // Anything below IDENTITY_MAP_SIZE is already present and would never fault
+    if (vm_area_count == MAX_VM_AREAS || start >= end || start < IDENTITY_MAP_SIZE || file_size > end - start) {
+        return false;
+    }
+
+    vm_areas[vm_area_count].start = start;
+    vm_areas[vm_area_count].end = end;
+    vm_areas[vm_area_count].flags = flags;
+    vm_areas[vm_area_count].file_data = file_data;
+    vm_areas[vm_area_count].file_size = file_size;
+    vm_area_count++;
+    return true;
+}
+
+static bool vm_covered(uint32_t virtual_addr) {
+    for (uint32_t i = 0; i < vm_area_count; i++) {
+        if (vm_areas[i].start <= virtual_addr && vm_areas[i].end > virtual_addr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies a string out of the running program's vm_areas, at most size - 1 bytes,
+// and terminates it. Returns the length, or -1 once it leaves the areas, so a bad
+// pointer from ring 3 is refused instead of faulting in the kernel.
+int32_t vm_copy_string(char *buffer, uint32_t user_addr, uint32_t size) {
+    uint32_t length = 0;
+    uint32_t checked_page = 0; // Never a user page, they are all above the identity map
+
+    while (length + 1 < size) {
+        uint32_t address = user_addr + length;
+
+        if (address < user_addr) {
+            return -1;
+        }
+        if (PAGE_ALIGN_DOWN(address) != checked_page) {
+            if (!vm_covered(address) || !vm_populate(address)) {
+                return -1;
+            }
+            checked_page = PAGE_ALIGN_DOWN(address);
+        }
+        char c = *(const char*)address;
+        if (!c) {
+            break;
+        }
+        buffer[length++] = c;
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+// Backs the page holding virtual_addr with a fresh frame. A page can be shared by
+// the tail of one segment and the head of the next, so every overlapping area
+// contributes its bytes and permissions.
+bool vm_populate(uint32_t virtual_addr) {
+    uint32_t page = PAGE_ALIGN_DOWN(virtual_addr);
+    uint32_t flags = 0;
+    bool covered = false;
+
+    if (get_page_entry(page) & PAGE_PRESENT) {
+        return true;
+    }
+
+    for (uint32_t i = 0; i < vm_area_count; i++) {
+        if (vm_areas[i].start < page + PAGE_SIZE && vm_areas[i].end > page) {
+            covered = true;
+            flags |= vm_areas[i].flags;
+        }
+    }
+    if (!covered) {
+        return false;
+    }
+
+    uint32_t frame = alloc_frame();
+    if (!frame) {
+        dbg_printf("[%d] Out of frames while faulting in 0x%x\n", ticks, virtual_addr);
+        return false;
+    }
+    memset((void*)frame, 0, PAGE_SIZE);
+
+    for (uint32_t i = 0; i < vm_area_count; i++) {
+        struct vm_area *area = &vm_areas[i];
+        uint32_t from = area->start > page ? area->start : page;
+        uint32_t to = area->start + area->file_size;
+        if (to > page + PAGE_SIZE) to = page + PAGE_SIZE;
+        if (from < to) {
+            memcpy((uint8_t*)frame + (from - page), area->file_data + (from - area->start), to - from);
+        }
+    }
+
+    map_page(frame, page, PAGE_PRESENT | PAGE_USER | (flags & PAGE_WRITE));
+    return true;
+}
+
+void vm_clear_areas() {
+    for (uint32_t i = 0; i < vm_area_count; i++) {
+        for (uint32_t page = PAGE_ALIGN_DOWN(vm_areas[i].start); page < vm_areas[i].end; page += PAGE_SIZE) {
+            page_entry_t entry = get_page_entry(page);
+            if (entry & PAGE_PRESENT) {
+                unmap_page(page);
+                free_frame(entry & 0xFFFFF000);
+            }
+        }
+    }
+    vm_area_count = 0;
+}
+
+bool handle_page_fault(struct InterruptRegisters* regs) {
+    // Bit 0 of the error code means the page was present, i.e. a protection violation
+    if (regs->err_code & 0x1) {
+        return false;
+    }
+    if (!vm_populate(regs->cr2)) {
+        return false;
+    }
+    page_faults_handled++;
+    return true;
+}
@@ -17,16 +17,64 @@
 
 #include "../Headers/stdint.h"
 #include "../Headers/util.h"
+#include "../Headers/multiboot.h"
+#include "../IDT/idt.h"
 
 #define PAGE_SIZE 4096
 #define PAGE_DIRECTORY_ENTRIES 1024
 #define PAGE_TABLE_ENTRIES 1024
 
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE   0x002
+#define PAGE_USER    0x004
+#define PAGE_WRITE_THROUGH 0x008
+#define PAGE_NO_CACHE 0x010
+
+// Physical memory identity mapped for the kernel, frames are handed out from here
+#define IDENTITY_MAP_SIZE 0x01000000
+#define KERNEL_PAGE_TABLES (IDENTITY_MAP_SIZE / (PAGE_SIZE * PAGE_TABLE_ENTRIES))
+#define MAX_FRAMES (IDENTITY_MAP_SIZE / PAGE_SIZE)
+
+#define MAX_VM_AREAS 16
+
+#define PAGE_ALIGN_DOWN(a) ((a) & ~(PAGE_SIZE - 1))
+#define PAGE_ALIGN_UP(a) (((a) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
 typedef uint32_t page_entry_t;
 
+// A range of user memory that is populated on the first page fault.
+// Bytes in [start, start + file_size) come from file_data, the rest is zero filled.
+struct vm_area {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+    const uint8_t *file_data;
+    uint32_t file_size;
+};
+
+extern page_entry_t page_directory[PAGE_DIRECTORY_ENTRIES];
+extern uint32_t page_faults_handled;
+
 void set_page_directory_entry(uint32_t index, uint32_t base_addr, uint32_t flags);
 void set_page_table_entry(uint32_t index, uint32_t base_addr, uint32_t flags);
 void map_page(uint32_t physical_addr, uint32_t virtual_addr, uint32_t flags);
+void unmap_page(uint32_t virtual_addr);
+void* map_physical_region(uint32_t physical_addr, uint32_t size, uint32_t flags);
+page_entry_t get_page_entry(uint32_t virtual_addr);
 page_entry_t* get_page_dir_loc();
 void init_paging();
 extern void enable_paging(uint32_t page_directory);
+
+void init_frame_allocator(struct multiboot_info* mb_info);
+void reserve_frames(uint32_t start, uint32_t end);
+uint32_t alloc_frame();
+uint32_t alloc_frames(uint32_t count);
+void free_frame(uint32_t frame);
+void free_frames(uint32_t frame, uint32_t count);
+uint32_t free_frame_count();
+
+bool vm_add_area(uint32_t start, uint32_t end, uint32_t flags, const uint8_t *file_data, uint32_t file_size);
+bool vm_populate(uint32_t virtual_addr);
+int32_t vm_copy_string(char *buffer, uint32_t user_addr, uint32_t size);
+void vm_clear_areas();
+bool handle_page_fault(struct InterruptRegisters* regs);
@@ -0,0 +1,86 @@
+; Copyright (C) 2024 Ahmed
+;
+; This program is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+;
+; This program is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+; Application processor trampoline. init_SMP() copies everything between
+; ap_trampoline_start and ap_trampoline_end to TRAMPOLINE_BASE and fills in
+; the variables at the end, so every address here is relative to that base.
+
+TRAMPOLINE_BASE equ 0x8000
+%define TRAMPOLINE(label) (TRAMPOLINE_BASE + (label - ap_trampoline_start))
+
+section .text
+
+bits 16
+global ap_trampoline_start
+ap_trampoline_start:
+    CLI
+    CLD
+    XOR ax, ax
+    MOV ds, ax
+
+    LGDT [TRAMPOLINE(ap_gdt_ptr)]
+
+    MOV eax, cr0
+    OR eax, 0x1 ; Protected mode
+    MOV cr0, eax
+    JMP DWORD 0x08:TRAMPOLINE(ap_protected_mode)
+
+bits 32
+ap_protected_mode:
+    MOV ax, 0x10
+    MOV ds, ax
+    MOV es, ax
+    MOV fs, ax
+    MOV gs, ax
+    MOV ss, ax
+
+    ; Same page directory as the BSP
+    MOV eax, [TRAMPOLINE(ap_trampoline_cr3)]
+    MOV cr3, eax
+    MOV eax, cr0
+    OR eax, 0x80000000
+    MOV cr0, eax
+
+    MOV esp, [TRAMPOLINE(ap_trampoline_stack)]
+    PUSH DWORD [TRAMPOLINE(ap_trampoline_cpu)]
+    MOV eax, [TRAMPOLINE(ap_trampoline_entry)]
+    CALL eax ; ap_main(cpu), never returns
+
+.halt:
+    CLI
+    HLT
+    JMP .halt
+
+align 8
+ap_gdt:
+    DQ 0x0000000000000000 ; Null segment
+    DQ 0x00CF9A000000FFFF ; Kernel code segment
+    DQ 0x00CF92000000FFFF ; Kernel data segment
+ap_gdt_ptr:
+    DW 23
+    DD TRAMPOLINE(ap_gdt)
+
+align 4
+global ap_trampoline_cr3
+ap_trampoline_cr3: DD 0
+global ap_trampoline_stack
+ap_trampoline_stack: DD 0
+global ap_trampoline_cpu
+ap_trampoline_cpu: DD 0
+global ap_trampoline_entry
+ap_trampoline_entry: DD 0
+
+global ap_trampoline_end
+ap_trampoline_end:
@@ -0,0 +1,164 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "smp.h"
+#include "../ACPI/acpi.h"
+#include "../Drivers/APIC/apic.h"
+#include "../Drivers/PIT/pit.h"
+#include "../GDT/gdt.h"
+#include "../IDT/idt.h"
+#include "../Paging/paging.h"
+#include "../Scheduler/scheduler.h"
+#include "../Time/tick.h"
+#include "../Debug/bootprof.h"
+
+struct cpu cpus[MAX_CPUS];
+uint32_t cpu_count = 1;
+volatile uint32_t cpus_online = 1;
+
+static uint32_t* trampoline_var(uint8_t *symbol) {
+    return (uint32_t*)(TRAMPOLINE_BASE + (uint32_t)(symbol - ap_trampoline_start));
+}
+
+// Spins for at least ms milliseconds, the PIT has 1 ms granularity
+static void spin_ms(uint32_t ms) {
+    uint64_t wait = boot_wait_begin();
+    uint32_t start = ticks;
+    while (ticks - start <= ms) {
+        asm volatile ("pause");
+    }
+    boot_wait_end(wait);
+}
+
+// The BSP drives its scheduler from the PIT, everybody else from the LAPIC timer
+static void ap_timer_irq_handler(struct InterruptRegisters *r) {
+    (void)r;
+    tick_timer_event();
+}
+
+// Another CPU queued work for us, see enqueue_thread()
+static void ipi_irq_handler(struct InterruptRegisters *r) {
+    (void)r;
+    this_cpu()->need_resched = true;
+}
+
+static void enumerate_cpus(struct acpi_madt *madt) {
+    uint8_t *entry = (uint8_t*)madt + sizeof(struct acpi_madt);
+    uint8_t *end = (uint8_t*)madt + madt->header.length;
+
+    while (entry + sizeof(struct acpi_madt_entry) <= end) {
+        struct acpi_madt_entry *header = (struct acpi_madt_entry*)entry;
+        if (header->length < sizeof(struct acpi_madt_entry)) {
+            break;
+        }
+
+        if (header->type == ACPI_MADT_LAPIC) {
+            struct acpi_madt_lapic *lapic = (struct acpi_madt_lapic*)entry;
+            if ((lapic->flags & ACPI_MADT_LAPIC_ENABLED) && lapic->apic_id != cpus[0].apic_id) {
+                if (cpu_count < MAX_CPUS) {
+                    cpus[cpu_count].id = cpu_count;
+                    cpus[cpu_count].apic_id = lapic->apic_id;
+                    cpu_count++;
+                } else {
+                    dbg_printf("[%d] Ignoring CPU with APIC ID %u, MAX_CPUS reached\n", ticks, lapic->apic_id);
+                }
+            }
+        }
+        entry += header->length;
+    }
+}
+
+static bool start_ap(struct cpu *cpu) {
+    uint32_t stack = alloc_frames(THREAD_STACK_PAGES);
+    if (!stack) {
+        return false;
+    }
+
+    cpu->stack_top = stack + THREAD_STACK_PAGES * PAGE_SIZE;
+    *trampoline_var(ap_trampoline_stack) = cpu->stack_top;
+    *trampoline_var(ap_trampoline_cpu) = (uint32_t)cpu;
+
+    // INIT-SIPI-SIPI, the second SIPI is only needed if the first one got lost
+    lapic_send_init(cpu->apic_id);
+    spin_ms(10);
+    lapic_send_startup(cpu->apic_id, TRAMPOLINE_BASE >> 12);
+    spin_ms(1);
+    if (!cpu->online) {
+        lapic_send_startup(cpu->apic_id, TRAMPOLINE_BASE >> 12);
+    }
+
+    uint64_t wait = boot_wait_begin();
+    uint32_t start = ticks;
+    while (!cpu->online && ticks - start < 100) {
+        asm volatile ("pause");
+    }
+    boot_wait_end(wait);
+
+    if (!cpu->online) {
+        free_frames(stack, THREAD_STACK_PAGES);
+        return false;
+    }
+    return true;
+}
+
+// Brings up every enabled processor listed in the ACPI MADT. Needs paging,
+// the IDT, the PIT and the scheduler on the BSP.
+void init_SMP() {
+    struct acpi_madt *madt = (struct acpi_madt*)acpi_find_table("APIC");
+
+    init_LAPIC(madt ? madt->lapic_address : LAPIC_DEFAULT_BASE);
+    lapic_enable();
+    lapic_timer_calibrate();
+
+    cpus[0].apic_id = lapic_id();
+    cpus[0].online = true;
+
+    irq_install_handler(LAPIC_TIMER_VECTOR - 32, ap_timer_irq_handler);
+    irq_install_handler(LAPIC_IPI_VECTOR - 32, ipi_irq_handler);
+
+    if (!madt) {
+        dbg_printf("[%d] No MADT, running on the boot CPU only\n", ticks);
+        return;
+    }
+
+    enumerate_cpus(madt);
+
+    memcpy((void*)TRAMPOLINE_BASE, ap_trampoline_start, (uint32_t)(ap_trampoline_end - ap_trampoline_start));
+    *trampoline_var(ap_trampoline_cr3) = (uint32_t)page_directory;
+    *trampoline_var(ap_trampoline_entry) = (uint32_t)ap_main;
+
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        if (!start_ap(&cpus[i])) {
+            dbg_printf("[%d] CPU %u (APIC ID %u) didn't come up\n", ticks, i, cpus[i].apic_id);
+        }
+    }
+
+    dbg_printf("[%d] %u of %u CPUs online, LAPIC timer %u ticks/ms\n", ticks, cpus_online, cpu_count, lapic_ticks_per_ms);
+}
+
+// First C code run by an application processor, on the stack init_SMP() gave it
+void ap_main(struct cpu *cpu) {
+    init_cpu_GDT(cpu->id);
+    load_IDT();
+    lapic_enable();
+
+    scheduler_init_cpu();
+    lapic_timer_start(frequency);
+
+    __atomic_add_fetch(&cpus_online, 1, __ATOMIC_SEQ_CST);
+    cpu->online = true;
+
+    cpu_idle();
+}
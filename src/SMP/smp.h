@@ -0,0 +1,80 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../Scheduler/scheduler.h"
+
+#define MAX_CPUS 16
+
+// Real mode entry point of the application processors, must be 4 KiB aligned and below 1 MB
+#define TRAMPOLINE_BASE 0x8000
+
+// Per-CPU data, reached through the %gs segment that init_cpu_GDT() sets up
+struct cpu {
+    struct cpu *self; // Must stay first, this_cpu() reads %gs:0
+    uint32_t id;
+    uint32_t apic_id;
+    volatile bool online;
+    volatile bool need_resched;
+    uint32_t preempt_count;   // Spinlocks and rcu_read_lock() held, no preemption while non-zero
+    volatile uint32_t rcu_qs; // Quiescent states passed, only this CPU writes it
+    struct thread *current_thread;
+    struct thread *idle_thread;
+    struct thread *prev_thread; // Thread switched away from, finished by whoever runs next
+    bool prev_requeue;          // prev_thread was preempted and goes back on a run queue
+    uint32_t stack_top;
+    struct runqueue rq;
+    uint32_t steal_seed;
+    uint32_t context_switches;
+    uint32_t steals;
+    uint32_t wakeups; // Times the idle loop came out of hlt
+    uint64_t idle_cycles;
+    uint64_t idle_start;
+    uint64_t stats_start;
+    uint64_t idle_mark;     // idle_cycles at the last scheduler_print_idle()
+    uint64_t idle_mark_tsc;
+};
+
+extern struct cpu cpus[MAX_CPUS];
+extern uint32_t cpu_count;
+extern volatile uint32_t cpus_online;
+
+static inline struct cpu* this_cpu() {
+    struct cpu *cpu;
+    asm volatile ("movl %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// A single instruction through %gs, so migrating halfway through isn't possible
+static inline void preempt_disable() {
+    asm volatile ("incl %%gs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+static inline void preempt_enable() {
+    asm volatile ("decl %%gs:%c0" : : "i"(__builtin_offsetof(struct cpu, preempt_count)) : "memory");
+}
+
+void init_SMP();
+void ap_main(struct cpu *cpu);
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_cr3[];
+extern uint8_t ap_trampoline_stack[];
+extern uint8_t ap_trampoline_cpu[];
+extern uint8_t ap_trampoline_entry[];
@@ -0,0 +1,42 @@
+; Copyright (C) 2024 Ahmed
+;
+; This program is free software: you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+;
+; This program is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+bits 32
+
+section .text
+
+; void switch_context(uint32_t *old_esp, uint32_t new_esp)
+; Saves the callee-saved registers and EFLAGS on the current stack, stores the
+; stack pointer in *old_esp and resumes whatever was saved on new_esp.
+global switch_context
+switch_context:
+    MOV eax, [esp+4]
+    MOV edx, [esp+8]
+
+    PUSH ebp
+    PUSH ebx
+    PUSH esi
+    PUSH edi
+    PUSHFD
+
+    MOV [eax], esp
+    MOV esp, edx
+
+    POPFD
+    POP edi
+    POP esi
+    POP ebx
+    POP ebp
+    RET
@@ -0,0 +1,670 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "scheduler.h"
+#include "../Paging/paging.h"
+#include "../GDT/gdt.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Drivers/APIC/apic.h"
+#include "../SMP/smp.h"
+#include "../Time/tick.h"
+#include "../Time/clocksource.h"
+#include "../Time/timer.h"
+#include "../Log/klog.h"
+#include "../Debug/backtrace.h"
+
+static struct thread threads[MAX_THREADS];
+static struct spinlock thread_lock = SPINLOCK_INIT("thread_lock"); // Protects allocation in threads[]
+static uint32_t next_thread_id = 0;
+
+static volatile uint32_t nr_ready = 0; // Threads sitting in any run queue
+static bool scheduler_started = false;
+
+static bool cpu_allowed(struct thread *t, struct cpu *cpu) {
+    return (t->affinity >> cpu->id) & 1;
+}
+
+// Owner only, with interrupts off. A thread sits in at most one queue, so a full
+// queue means one got queued twice and overwriting the oldest slot would lose it.
+static void rq_push(struct runqueue *rq, struct thread *t) {
+    uint32_t bottom = rq->bottom;
+    if (bottom - __atomic_load_n(&rq->top, __ATOMIC_ACQUIRE) >= RUNQUEUE_SIZE) {
+        klog_emergency();
+        dbg_printf("[%d] Run queue overflow queueing thread %s, System Halted\n", ticks, t->name);
+        dump_stack();
+        klog_flush();
+        for(;;);
+    }
+    rq->slots[bottom & (RUNQUEUE_SIZE - 1)] = t;
+    __atomic_store_n(&rq->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the oldest thread, safe against any number of concurrent takers. A thief
+// passes itself as cpu and leaves threads alone that may not run there.
+static struct thread *rq_take(struct runqueue *rq, struct cpu *cpu) {
+    for (;;) {
+        uint32_t top = __atomic_load_n(&rq->top, __ATOMIC_ACQUIRE);
+        uint32_t bottom = __atomic_load_n(&rq->bottom, __ATOMIC_ACQUIRE);
+
+        if ((int32_t)(bottom - top) <= 0) {
+            return NULL;
+        }
+
+        struct thread *t = rq->slots[top & (RUNQUEUE_SIZE - 1)];
+        if (cpu && !cpu_allowed(t, cpu)) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&rq->top, &top, top + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return t;
+        }
+    }
+}
+
+static struct cpu *find_cpu_for(struct thread *t) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (cpus[i].online && cpu_allowed(t, &cpus[i])) {
+            return &cpus[i];
+        }
+    }
+    return NULL;
+}
+
+// Makes an idle CPU go through the scheduler, it won't see a timer event otherwise
+void cpu_kick(struct cpu *cpu) {
+    if (cpu != this_cpu() && cpu->current_thread == cpu->idle_thread && lapic_present()) {
+        lapic_send_ipi(cpu->apic_id, LAPIC_IPI_VECTOR);
+    }
+}
+
+// With tickless idle, hands freshly queued work to one idle CPU that can steal it
+static void kick_idle_cpu(struct thread *t) {
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (cpu->online && cpu != this_cpu() && cpu->current_thread == cpu->idle_thread && cpu_allowed(t, cpu)) {
+            cpu_kick(cpu);
+            return;
+        }
+    }
+}
+
+// Queues a READY thread, with interrupts off. Threads that may not run here go to
+// the inbox of a CPU they're allowed on, which gets kicked with an IPI.
+static void enqueue_thread(struct thread *t) {
+    struct cpu *cpu = this_cpu();
+    struct cpu *target;
+
+    __atomic_add_fetch(&nr_ready, 1, __ATOMIC_SEQ_CST);
+
+    if (cpu_allowed(t, cpu)) {
+        rq_push(&cpu->rq, t);
+        if (tickless) {
+            kick_idle_cpu(t);
+        }
+        return;
+    }
+
+    target = find_cpu_for(t);
+    if (!target) { // None of its CPUs are online, run it here rather than lose it
+        rq_push(&cpu->rq, t);
+        return;
+    }
+
+    spin_lock(&target->rq.inbox_lock);
+    t->next = target->rq.inbox;
+    target->rq.inbox = t;
+    spin_unlock(&target->rq.inbox_lock);
+
+    if (lapic_present()) {
+        lapic_send_ipi(target->apic_id, LAPIC_IPI_VECTOR);
+    }
+}
+
+static uint32_t steal_random(struct cpu *cpu) {
+    uint32_t x = cpu->steal_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    cpu->steal_seed = x;
+    return x;
+}
+
+static struct thread *pick_next_thread(struct cpu *cpu) {
+    struct thread *t;
+
+    if (cpu->rq.inbox) {
+        spin_lock(&cpu->rq.inbox_lock);
+        struct thread *inbox = cpu->rq.inbox;
+        cpu->rq.inbox = NULL;
+        spin_unlock(&cpu->rq.inbox_lock);
+
+        while (inbox) {
+            t = inbox;
+            inbox = t->next;
+            t->next = NULL;
+            rq_push(&cpu->rq, t);
+        }
+    }
+
+    // Own queue first, rerouting anything whose affinity changed while queued
+    uint32_t queued = cpu->rq.bottom - cpu->rq.top;
+    while (queued-- && (t = rq_take(&cpu->rq, NULL))) {
+        __atomic_sub_fetch(&nr_ready, 1, __ATOMIC_SEQ_CST);
+        if (cpu_allowed(t, cpu) || !find_cpu_for(t)) {
+            return t;
+        }
+        enqueue_thread(t);
+    }
+
+    if (!nr_ready || cpu_count < 2) {
+        return NULL;
+    }
+
+    // Steal, starting from a random victim so idle CPUs don't all hit the same one
+    uint32_t start = steal_random(cpu) % cpu_count;
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu *victim = &cpus[(start + i) % cpu_count];
+        if (victim == cpu || !victim->online) {
+            continue;
+        }
+        t = rq_take(&victim->rq, cpu);
+        if (t) {
+            __atomic_sub_fetch(&nr_ready, 1, __ATOMIC_SEQ_CST);
+            cpu->steals++;
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Runs on the new thread right after a switch, once prev's stack is no longer in use
+static void finish_switch() {
+    struct cpu *cpu = this_cpu();
+    struct thread *prev = cpu->prev_thread;
+
+    if (!prev) {
+        return;
+    }
+    cpu->prev_thread = NULL;
+
+    if (prev->state == THREAD_DEAD) {
+        if (prev->stack_base) {
+            free_frames(prev->stack_base, THREAD_STACK_PAGES);
+        }
+        prev->on_cpu = false;
+        __atomic_store_n(&prev->state, THREAD_UNUSED, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // prev->state can't be trusted here, a waker may already have flipped it
+    __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+    if (cpu->prev_requeue) {
+        enqueue_thread(prev);
+    }
+}
+
+// Queues a thread a waker just moved to READY, with interrupts off
+static void wake_thread(struct thread *t) {
+    // It may still be switching away on another CPU
+    while (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+        asm volatile ("pause");
+    }
+    enqueue_thread(t);
+}
+
+static struct thread *alloc_thread(const char *name) {
+    struct thread *t = NULL;
+
+    spin_lock(&thread_lock);
+    for (uint32_t i = 0; i < MAX_THREADS; i++) {
+        if (threads[i].state == THREAD_UNUSED) {
+            t = &threads[i];
+            memset(t, 0, sizeof(struct thread));
+            t->id = next_thread_id++;
+            t->state = THREAD_BLOCKED;
+            break;
+        }
+    }
+    spin_unlock(&thread_lock);
+
+    if (t) {
+        for (uint32_t c = 0; c < THREAD_NAME_LEN - 1 && name[c]; c++) {
+            t->name[c] = name[c];
+        }
+        t->affinity = CPU_MASK_ALL;
+    }
+    return t;
+}
+
+static void thread_start() {
+    finish_switch();
+    enable_interrupts();
+
+    struct thread *self = this_cpu()->current_thread;
+    self->entry(self->arg);
+    thread_exit();
+}
+
+static struct thread *spawn_thread(const char *name, void (*entry)(void *arg), void *arg, uint32_t affinity, bool runnable) {
+    uint32_t stack = alloc_frames(THREAD_STACK_PAGES);
+    if (!stack) {
+        return NULL;
+    }
+
+    struct thread *t = alloc_thread(name);
+    if (!t) {
+        free_frames(stack, THREAD_STACK_PAGES);
+        return NULL;
+    }
+
+    t->stack_base = stack;
+    t->esp0 = stack + THREAD_STACK_PAGES * PAGE_SIZE;
+    t->entry = entry;
+    t->arg = arg;
+    t->affinity = affinity;
+
+    // Initial frame popped by switch_context(), it "returns" into thread_start()
+    uint32_t *sp = (uint32_t*)t->esp0;
+    *--sp = 0;                        // Return address of thread_start, never used
+    *--sp = (uint32_t)thread_start;
+    *--sp = 0;                        // ebp
+    *--sp = 0;                        // ebx
+    *--sp = 0;                        // esi
+    *--sp = 0;                        // edi
+    *--sp = 0x002;                    // EFLAGS, interrupts stay off until thread_start
+    t->esp = (uint32_t)sp;
+
+    if (runnable) {
+        uint32_t flags = interrupts_save();
+        t->state = THREAD_READY;
+        enqueue_thread(t);
+        interrupts_restore(flags);
+    }
+    return t;
+}
+
+void cpu_idle() {
+    struct cpu *cpu = this_cpu(); // Idle threads are pinned
+
+    for (;;) {
+        disable_interrupts();
+        if (cpu->need_resched) {
+            schedule();
+            continue;
+        }
+        tick_idle_enter();
+        asm volatile ("sti; hlt");
+        cpu->wakeups++;
+        cpu->rcu_qs++;
+    }
+}
+
+static void idle_loop(void *arg) {
+    (void)arg;
+    cpu_idle();
+}
+
+static void init_cpu_stats(struct cpu *cpu) {
+    cpu->steal_seed = 0x9E3779B9 * (cpu->id + 1);
+    cpu->stats_start = rdtsc();
+    cpu->idle_mark_tsc = cpu->stats_start;
+}
+
+// Turns the boot context into the first thread and creates the BSP's idle thread.
+// Needs the frame allocator, the per-CPU GDT and the PIT.
+void init_scheduler() {
+    struct cpu *cpu = this_cpu();
+    struct thread *boot = alloc_thread("main");
+
+    boot->state = THREAD_RUNNING;
+    boot->on_cpu = true;
+    boot->slice = TIME_SLICE_TICKS;
+    boot->esp0 = get_kernel_stack();
+    cpu->current_thread = boot;
+
+    cpu->idle_thread = spawn_thread("idle", idle_loop, NULL, 1 << cpu->id, false);
+    cpu->idle_thread->state = THREAD_READY;
+    init_cpu_stats(cpu);
+    scheduler_started = true;
+}
+
+// Application processors: the context running ap_main() becomes this CPU's idle thread
+void scheduler_init_cpu() {
+    struct cpu *cpu = this_cpu();
+    uint32_t flags = interrupts_save();
+    struct thread *idle = alloc_thread("idle");
+
+    idle->state = THREAD_RUNNING;
+    idle->on_cpu = true;
+    idle->affinity = 1 << cpu->id;
+    cpu->idle_thread = idle;
+    cpu->current_thread = idle;
+    init_cpu_stats(cpu);
+    cpu->idle_start = rdtsc();
+
+    interrupts_restore(flags);
+}
+
+bool scheduler_running() {
+    return scheduler_started;
+}
+
+struct thread *thread_current() {
+    return this_cpu()->current_thread;
+}
+
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg) {
+    return spawn_thread(name, entry, arg, CPU_MASK_ALL, true);
+}
+
+struct thread *thread_create_affinity(const char *name, void (*entry)(void *arg), void *arg, uint32_t affinity) {
+    return spawn_thread(name, entry, arg, affinity, true);
+}
+
+// Queued threads are rerouted when they're next picked, the caller migrates right away
+void thread_set_affinity(struct thread *t, uint32_t affinity) {
+    if (!affinity) {
+        return;
+    }
+    t->affinity = affinity;
+    if (t == thread_current() && !cpu_allowed(t, this_cpu())) {
+        thread_yield();
+    }
+}
+
+// Picks the next thread to run, with interrupts off. The caller has already set
+// its state if it's giving up the CPU; a RUNNING caller keeps it when there's nothing
+// else to do and gets requeued by finish_switch() otherwise.
+static void reschedule() {
+    struct cpu *cpu = this_cpu();
+    struct thread *prev = cpu->current_thread;
+    struct thread *next;
+    bool must_run = prev->state == THREAD_RUNNING && cpu_allowed(prev, cpu);
+
+    cpu->need_resched = false;
+    cpu->rcu_qs++; // Never reached from an RCU read side
+
+    next = pick_next_thread(cpu);
+    if (!next) {
+        if (must_run && prev != cpu->idle_thread) {
+            prev->slice = TIME_SLICE_TICKS;
+            return;
+        }
+        next = cpu->idle_thread;
+    }
+    if (next == prev) {
+        return;
+    }
+
+    cpu->prev_requeue = prev->state == THREAD_RUNNING && prev != cpu->idle_thread;
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+    }
+    next->state = THREAD_RUNNING;
+    next->slice = TIME_SLICE_TICKS;
+    next->on_cpu = true;
+
+    uint64_t now = rdtsc();
+    if (prev == cpu->idle_thread) {
+        cpu->idle_cycles += now - cpu->idle_start;
+        tick_idle_exit();
+    }
+    if (next == cpu->idle_thread) {
+        cpu->idle_start = now;
+    }
+
+    cpu->current_thread = next;
+    cpu->prev_thread = prev;
+    cpu->context_switches++;
+
+    prev->esp0 = get_kernel_stack();
+    if (next->esp0) {
+        set_kernel_stack(next->esp0);
+    }
+
+    switch_context(&prev->esp, next->esp);
+
+    // Back on prev's stack, possibly much later and on another CPU
+    finish_switch();
+}
+
+void schedule() {
+    uint32_t flags = interrupts_save();
+    reschedule();
+    interrupts_restore(flags);
+}
+
+void thread_yield() {
+    schedule();
+}
+
+void thread_exit() {
+    interrupts_save();
+    this_cpu()->current_thread->state = THREAD_DEAD;
+    reschedule();
+    for (;;);
+}
+
+void thread_block() {
+    uint32_t flags = interrupts_save();
+    this_cpu()->current_thread->state = THREAD_BLOCKED;
+    reschedule();
+    interrupts_restore(flags);
+}
+
+void thread_unblock(struct thread *t) {
+    uint32_t flags = interrupts_save();
+    enum thread_state blocked = THREAD_BLOCKED;
+
+    // Only one waker gets to queue it
+    if (__atomic_compare_exchange_n(&t->state, &blocked, THREAD_READY, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        wake_thread(t);
+        if (this_cpu()->current_thread == this_cpu()->idle_thread) {
+            this_cpu()->need_resched = true;
+        }
+    }
+
+    interrupts_restore(flags);
+}
+
+static void sleep_timer_callback(void *arg) {
+    struct thread *t = arg;
+    uint32_t flags = interrupts_save();
+    enum thread_state sleeping = THREAD_SLEEPING;
+
+    if (__atomic_compare_exchange_n(&t->state, &sleeping, THREAD_READY, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        wake_thread(t);
+    }
+    interrupts_restore(flags);
+}
+
+void thread_sleep(uint32_t tick) {
+    struct timer timer;
+    uint32_t flags = interrupts_save();
+
+    // The timer may fire on the BSP before we're off this CPU, wake_thread() copes
+    this_cpu()->current_thread->state = THREAD_SLEEPING;
+    timer_setup(&timer, sleep_timer_callback, this_cpu()->current_thread);
+    timer_add(&timer, tick);
+
+    reschedule();
+    interrupts_restore(flags);
+}
+
+// Called from the timer IRQ of every CPU with interrupts off. The switch itself
+// happens in irq_handler() once the interrupt has been acknowledged.
+void scheduler_tick() {
+    struct cpu *cpu = this_cpu();
+    struct thread *current = cpu->current_thread;
+
+    if (!scheduler_started || !current) {
+        return;
+    }
+
+    if (current == cpu->idle_thread) {
+        if (nr_ready || cpu->rq.inbox) {
+            cpu->need_resched = true;
+        }
+        return;
+    }
+
+    if (current->slice > 0) {
+        current->slice--;
+    }
+    if (current->slice == 0 && nr_ready) {
+        cpu->need_resched = true;
+    }
+}
+
+static uint64_t cpu_idle_cycles(struct cpu *cpu, uint64_t now) {
+    uint64_t idle = cpu->idle_cycles;
+    if (cpu->current_thread == cpu->idle_thread) {
+        idle += now - cpu->idle_start;
+    }
+    return idle;
+}
+
+// Share of time spent in the idle thread since the previous call, per CPU
+void scheduler_print_idle() {
+    uint64_t now = rdtsc();
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (!cpu->online || !cpu->current_thread) {
+            continue;
+        }
+
+        uint64_t idle = cpu_idle_cycles(cpu, now);
+        uint64_t total = now - cpu->idle_mark_tsc;
+        uint32_t idle_percent = total ? (uint32_t)((idle - cpu->idle_mark) * 100 / total) : 0;
+        cpu->idle_mark = idle;
+        cpu->idle_mark_tsc = now;
+
+        dbg_printf("[%d] CPU %u: %u%% idle\n", ticks, cpu->id, idle_percent);
+    }
+}
+
+void scheduler_print_stats() {
+    uint64_t now = rdtsc();
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (!cpu->online || !cpu->current_thread) {
+            continue;
+        }
+
+        uint64_t idle = cpu_idle_cycles(cpu, now);
+        uint64_t total = now - cpu->stats_start;
+        uint32_t idle_percent = total ? (uint32_t)(idle * 100 / total) : 0;
+
+        dbg_printf("[%d] CPU %u: %u switches, %u steals, %u%% idle\n",
+                   ticks, cpu->id, cpu->context_switches, cpu->steals, idle_percent);
+    }
+}
+
+static volatile uint32_t bench_remaining = 0;
+
+static void bench_partner(void *arg) {
+    (void)arg;
+    while (bench_remaining) {
+        thread_yield();
+    }
+}
+
+// Ping-pongs between the caller and a partner thread with thread_yield()
+void run_context_switch_benchmark(uint32_t iterations) {
+    bench_remaining = iterations;
+
+    if (!thread_create("bench", bench_partner, NULL)) {
+        dbg_printf("[%d] Context switch benchmark: can't create thread\n", ticks);
+        return;
+    }
+
+    uint32_t switches_before = this_cpu()->context_switches;
+    uint64_t start_ns = ktime_get();
+    uint64_t start = rdtsc();
+    while (bench_remaining) {
+        bench_remaining--;
+        thread_yield();
+    }
+    uint64_t cycles = rdtsc() - start;
+    uint64_t ns = ktime_get() - start_ns;
+    uint32_t switches = this_cpu()->context_switches - switches_before;
+
+    thread_yield(); // Let the partner see the counter hit zero and exit
+
+    if (switches) {
+        dbg_printf("[%d] Context switch: %u switches, %u cycles/switch, %u ns/switch\n",
+                   ticks, switches, (uint32_t)(cycles / switches), (uint32_t)(ns / switches));
+    }
+}
+
+#define SCALING_BENCH_CHUNKS 32
+#define SCALING_BENCH_ITERATIONS 4000000
+
+static volatile uint32_t scaling_remaining = 0;
+static volatile uint32_t scaling_sink = 0;
+
+static void scaling_worker(void *arg) {
+    uint32_t x = (uint32_t)arg | 1;
+
+    for (uint32_t i = 0; i < SCALING_BENCH_ITERATIONS; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+
+    __atomic_add_fetch(&scaling_sink, x, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&scaling_remaining, 1, __ATOMIC_SEQ_CST);
+}
+
+// Runs the same batch of compute chunks restricted to the first 1..N online CPUs
+void run_scaling_benchmark() {
+    uint64_t baseline = 0;
+    uint32_t mask = 0;
+    uint32_t used = 0;
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        mask |= 1 << i;
+        used++;
+
+        scaling_remaining = SCALING_BENCH_CHUNKS;
+        uint64_t start = ktime_get();
+        for (uint32_t c = 0; c < SCALING_BENCH_CHUNKS; c++) {
+            if (!thread_create_affinity("scale", scaling_worker, (void*)(c + 1), mask)) {
+                __atomic_sub_fetch(&scaling_remaining, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+        while (scaling_remaining) {
+            thread_sleep(1);
+        }
+        uint64_t ns = ktime_get() - start;
+        if (!ns) {
+            ns = 1;
+        }
+
+        if (!baseline) {
+            baseline = ns;
+        }
+        uint32_t speedup = (uint32_t)(baseline * 100 / ns);
+        dbg_printf("[%d] Scaling: %u CPU(s), %u us, speedup %u.%u%u\n",
+                   ticks, used, (uint32_t)(ns / NSEC_PER_USEC), speedup / 100, speedup / 10 % 10, speedup % 10);
+    }
+
+    scheduler_print_stats();
+}
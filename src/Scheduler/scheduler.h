@@ -0,0 +1,86 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../Lock/spinlock.h"
+
+#define MAX_THREADS 64
+#define THREAD_STACK_PAGES 2
+#define THREAD_NAME_LEN 16
+#define TIME_SLICE_TICKS 10
+#define RUNQUEUE_SIZE 128 // Power of two, twice MAX_THREADS for headroom
+#define CPU_MASK_ALL 0xFFFFFFFF
+
+enum thread_state {
+    THREAD_UNUSED = 0,
+    THREAD_RUNNING,
+    THREAD_READY,
+    THREAD_BLOCKED,
+    THREAD_SLEEPING,
+    THREAD_DEAD
+};
+
+struct thread {
+    uint32_t esp;        // Saved kernel stack pointer, switch_context() relies on it being first
+    uint32_t esp0;       // TSS ring 0 stack while this thread runs
+    uint32_t stack_base; // Frames backing the stack, 0 for the boot thread
+    uint32_t id;
+    volatile enum thread_state state;
+    uint32_t slice;      // Ticks left before preemption
+    struct thread *next; // Sleep list / inbox link
+    uint32_t affinity;   // Bitmask of CPU ids the thread may run on
+    volatile bool on_cpu; // Still running or being switched away from, wakers wait for it to clear
+    void (*entry)(void *arg);
+    void *arg;
+    char name[THREAD_NAME_LEN];
+};
+
+// Per-CPU lock-free run queue. Only the owning CPU pushes at the bottom; the owner
+// and thieves take from the top with a CAS, so local order stays round robin.
+struct runqueue {
+    volatile uint32_t top;
+    volatile uint32_t bottom;
+    struct thread *volatile slots[RUNQUEUE_SIZE];
+    struct spinlock inbox_lock;
+    struct thread *inbox; // Threads handed over by other CPUs because of affinity
+};
+
+struct cpu;
+
+void init_scheduler();
+void scheduler_init_cpu();
+void cpu_idle();
+void cpu_kick(struct cpu *cpu);
+struct thread *thread_current();
+struct thread *thread_create(const char *name, void (*entry)(void *arg), void *arg);
+struct thread *thread_create_affinity(const char *name, void (*entry)(void *arg), void *arg, uint32_t affinity);
+void thread_set_affinity(struct thread *t, uint32_t affinity);
+void thread_yield();
+void thread_exit();
+void thread_block();
+void thread_unblock(struct thread *t);
+void thread_sleep(uint32_t tick);
+void scheduler_tick();
+void schedule();
+bool scheduler_running();
+void scheduler_print_stats();
+void scheduler_print_idle();
+void run_context_switch_benchmark(uint32_t iterations);
+void run_scaling_benchmark();
+
+extern void switch_context(uint32_t *old_esp, uint32_t new_esp);
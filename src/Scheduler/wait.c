@@ -0,0 +1,164 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "wait.h"
+#include "scheduler.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Time/tick.h"
+
+void wait_queue_init(struct wait_queue *wq) {
+    spin_lock_init(&wq->lock, "wait_queue");
+    wq->head = NULL;
+    wq->tail = &wq->head;
+}
+
+void wait_entry_init(struct wait_entry *entry) {
+    entry->thread = scheduler_running() ? thread_current() : NULL;
+    entry->next = NULL;
+    entry->pprev = NULL;
+    entry->flags = interrupts_save();
+    entry->has_timeout = false;
+    entry->timed_out = false;
+}
+
+static void wait_timeout_callback(void *arg) {
+    struct wait_entry *entry = arg;
+    entry->timed_out = true;
+    thread_unblock(entry->thread);
+}
+
+// Call before the first prepare_to_wait(). The timer only wakes the thread,
+// wait_timed_out() also checks the deadline itself in case timers can't run yet.
+void wait_set_timeout(struct wait_entry *entry, uint32_t ms) {
+    tick_update();
+    entry->deadline = ticks + ms;
+    entry->has_timeout = true;
+    if (entry->thread) {
+        timer_setup(&entry->timer, wait_timeout_callback, entry);
+        timer_add(&entry->timer, ms);
+    }
+}
+
+bool wait_timed_out(struct wait_entry *entry) {
+    if (!entry->has_timeout) {
+        return false;
+    }
+    if (entry->timed_out) {
+        return true;
+    }
+    tick_update();
+    return (int32_t)(ticks - entry->deadline) >= 0;
+}
+
+static void dequeue_entry(struct wait_queue *wq, struct wait_entry *entry) {
+    *entry->pprev = entry->next;
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    } else {
+        wq->tail = entry->pprev;
+    }
+    entry->next = NULL;
+    entry->pprev = NULL;
+}
+
+// Queues the caller and marks it blocked, with interrupts off. The caller then
+// checks its condition and either breaks out or calls wait_schedule().
+void prepare_to_wait(struct wait_queue *wq, struct wait_entry *entry) {
+    disable_interrupts();
+
+    spin_lock(&wq->lock);
+    if (!entry->pprev) {
+        entry->next = NULL;
+        entry->pprev = wq->tail;
+        *wq->tail = entry;
+        wq->tail = &entry->next;
+    }
+    spin_unlock(&wq->lock);
+
+    if (entry->thread) {
+        entry->thread->state = THREAD_BLOCKED;
+    }
+}
+
+// Blocks until a wake-up or the timeout, may return spuriously
+void wait_schedule(struct wait_entry *entry) {
+    if (entry->thread) {
+        schedule();
+    } else {
+        asm volatile ("sti; hlt; cli");
+    }
+}
+
+void finish_wait(struct wait_queue *wq, struct wait_entry *entry) {
+    spin_lock(&wq->lock);
+    if (entry->pprev) {
+        dequeue_entry(wq, entry);
+    }
+    spin_unlock(&wq->lock);
+
+    if (entry->thread) {
+        enum thread_state blocked = THREAD_BLOCKED;
+        // A waker that already claimed us is waiting for us to leave the CPU, let it queue us
+        if (!__atomic_compare_exchange_n(&entry->thread->state, &blocked, THREAD_RUNNING, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            schedule();
+        }
+    }
+
+    interrupts_restore(entry->flags);
+
+    if (entry->has_timeout && entry->thread) {
+        timer_cancel(&entry->timer);
+    }
+}
+
+static bool wake_first(struct wait_queue *wq) {
+    struct wait_entry *entry;
+    struct thread *thread = NULL;
+    uint32_t flags = interrupts_save();
+
+    spin_lock(&wq->lock);
+    entry = wq->head;
+    if (entry) {
+        thread = entry->thread;
+        dequeue_entry(wq, entry);
+    }
+    spin_unlock(&wq->lock);
+
+    if (thread) {
+        thread_unblock(thread);
+    }
+    interrupts_restore(flags);
+    return entry != NULL;
+}
+
+void wake_up_one(struct wait_queue *wq) {
+    wake_first(wq);
+}
+
+// Only wakes the threads queued on entry, not ones that re-queue meanwhile
+void wake_up_all(struct wait_queue *wq) {
+    uint32_t count = 0;
+    uint32_t flags = interrupts_save();
+
+    spin_lock(&wq->lock);
+    for (struct wait_entry *entry = wq->head; entry; entry = entry->next) {
+        count++;
+    }
+    spin_unlock(&wq->lock);
+
+    while (count-- && wake_first(wq));
+    interrupts_restore(flags);
+}
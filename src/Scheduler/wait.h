@@ -0,0 +1,83 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+#include "../Time/timer.h"
+#include "../Lock/spinlock.h"
+
+struct thread;
+
+struct wait_entry {
+    struct thread *thread;
+    struct wait_entry *next;
+    struct wait_entry **pprev; // NULL while not queued
+    uint32_t flags;            // Interrupt state from before the wait
+    struct timer timer;
+    uint32_t deadline;
+    bool has_timeout;
+    volatile bool timed_out;
+};
+
+// FIFO of waiting threads, wake_up_one() takes the oldest
+struct wait_queue {
+    struct spinlock lock;
+    struct wait_entry *head;
+    struct wait_entry **tail;
+};
+
+#define WAIT_QUEUE_INIT(name) { SPINLOCK_INIT(#name), NULL, &(name).head }
+
+void wait_queue_init(struct wait_queue *wq);
+void wait_entry_init(struct wait_entry *entry);
+void wait_set_timeout(struct wait_entry *entry, uint32_t ms);
+bool wait_timed_out(struct wait_entry *entry);
+void prepare_to_wait(struct wait_queue *wq, struct wait_entry *entry);
+void wait_schedule(struct wait_entry *entry);
+void finish_wait(struct wait_queue *wq, struct wait_entry *entry);
+void wake_up_one(struct wait_queue *wq);
+void wake_up_all(struct wait_queue *wq);
+
+// Interrupts stay off from the first condition check until finish_wait(), so a
+// wake-up from an IRQ on this CPU can't slip in between the check and the block.
+// Before the scheduler runs these fall back to hlt.
+#define wait_event(wq, condition) do {           \
+    struct wait_entry __wait;                    \
+    wait_entry_init(&__wait);                    \
+    for (;;) {                                   \
+        prepare_to_wait(&(wq), &__wait);         \
+        if (condition) break;                    \
+        wait_schedule(&__wait);                  \
+    }                                            \
+    finish_wait(&(wq), &__wait);                 \
+} while (0)
+
+// Evaluates to whether condition came true before ms ran out
+#define wait_event_timeout(wq, condition, ms) __extension__ ({ \
+    struct wait_entry __wait;                                  \
+    bool __done;                                               \
+    wait_entry_init(&__wait);                                  \
+    wait_set_timeout(&__wait, (ms));                           \
+    for (;;) {                                                 \
+        prepare_to_wait(&(wq), &__wait);                       \
+        if ((__done = (condition)) || wait_timed_out(&__wait)) \
+            break;                                             \
+        wait_schedule(&__wait);                                \
+    }                                                          \
+    finish_wait(&(wq), &__wait);                               \
+    __done;                                                    \
+})
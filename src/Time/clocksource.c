@@ -0,0 +1,90 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "clocksource.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/VGA/vga.h"
+
+static struct clocksource *current_clocksource = NULL;
+static uint64_t clocksource_base = 0; // Counter value at ktime 0
+
+// Largest shift that keeps mult in 32 bits, for the most precise conversion
+static void clocksource_set_scale(struct clocksource *cs) {
+    for (uint32_t shift = 32; shift > 0; shift--) {
+        uint64_t mult = ((uint64_t)NSEC_PER_MSEC << shift) / cs->khz;
+        if (mult <= 0xFFFFFFFF) {
+            cs->mult = (uint32_t)mult;
+            cs->shift = shift;
+            return;
+        }
+    }
+    cs->mult = NSEC_PER_MSEC / cs->khz;
+    cs->shift = 0;
+}
+
+// The switch keeps ktime continuous, the new counter starts at the old one's current time
+void clocksource_register(struct clocksource *cs) {
+    if (!cs->khz) {
+        return;
+    }
+    clocksource_set_scale(cs);
+
+    if (current_clocksource && current_clocksource->rating >= cs->rating) {
+        return;
+    }
+
+    uint32_t flags = interrupts_save();
+    uint64_t now = ktime_get();
+    uint64_t cycles = cs->read();
+
+    // Back-date the base so the new source reads the same ktime
+    clocksource_base = cycles - (now / NSEC_PER_MSEC * cs->khz + (now % NSEC_PER_MSEC) * cs->khz / NSEC_PER_MSEC);
+    current_clocksource = cs;
+    interrupts_restore(flags);
+
+    dbg_printf("[%d] Clocksource: %s, %u kHz\n", ticks, cs->name, cs->khz);
+}
+
+struct clocksource *clocksource_current() {
+    return current_clocksource;
+}
+
+// 64x32 bit multiply split in two, the full product needs 96 bits
+uint64_t clocksource_cyc2ns(struct clocksource *cs, uint64_t cycles) {
+    uint64_t low = (uint64_t)(uint32_t)cycles * cs->mult;
+    uint64_t high = (cycles >> 32) * cs->mult;
+
+    if (cs->shift == 0) {
+        return low + (high << 32);
+    }
+    return (low >> cs->shift) + (high << (32 - cs->shift));
+}
+
+// Nanoseconds since the first clocksource was registered, 0 before that
+uint64_t ktime_get() {
+    struct clocksource *cs = current_clocksource;
+    if (!cs) {
+        return 0;
+    }
+    return clocksource_cyc2ns(cs, cs->read() - clocksource_base);
+}
+
+uint32_t ktime_get_us() {
+    return (uint32_t)(ktime_get() / NSEC_PER_USEC);
+}
+
+uint32_t ktime_get_ms() {
+    return (uint32_t)(ktime_get() / NSEC_PER_MSEC);
+}
@@ -0,0 +1,39 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
+
+// A free-running counter. ktime_get() uses the registered one with the highest rating.
+struct clocksource {
+    const char *name;
+    uint64_t (*read)();
+    uint32_t khz;
+    uint32_t rating;
+    uint32_t mult;  // ns = cycles * mult >> shift
+    uint32_t shift;
+};
+
+void clocksource_register(struct clocksource *cs);
+struct clocksource *clocksource_current();
+uint64_t clocksource_cyc2ns(struct clocksource *cs, uint64_t cycles);
+uint64_t ktime_get();
+uint32_t ktime_get_us();
+uint32_t ktime_get_ms();
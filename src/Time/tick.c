@@ -0,0 +1,156 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "tick.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/APIC/apic.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Scheduler/scheduler.h"
+#include "../SMP/smp.h"
+#include "clocksource.h"
+#include "timer.h"
+
+// Once set, the timers run in one-shot mode: busy CPUs get an event every TICK_MS
+// for preemption, idle CPUs only for the next sleeper (BSP) or not at all (APs).
+// ticks is then derived from ktime instead of counted.
+volatile bool tickless = false;
+
+static void (*bsp_oneshot)(uint32_t ms) = pit_oneshot;
+static uint64_t tick_last_ns = 0;
+static struct spinlock tick_lock = SPINLOCK_INIT("tick_lock");
+
+static void program_event(uint32_t ms) {
+    if (this_cpu()->id == 0) {
+        bsp_oneshot(ms);
+    } else {
+        lapic_timer_oneshot(ms);
+    }
+}
+
+// Switches every CPU to one-shot timers. Needs a clocksource, the periodic PIT
+// running and, for the APs, a calibrated LAPIC timer.
+void init_tickless() {
+    uint32_t flags;
+
+    if (!clocksource_current()) {
+        dbg_printf("[%d] No clocksource, staying periodic\n", ticks);
+        return;
+    }
+
+    flags = interrupts_save();
+    tick_last_ns = ktime_get();
+    tickless = true;
+    bsp_oneshot(TICK_MS);
+    interrupts_restore(flags);
+
+    // The APs pick it up from their next periodic interrupt
+    dbg_printf("[%d] Tickless mode on, %s clocksource\n", ticks, clocksource_current()->name);
+}
+
+// The device behind IRQ0, the PIT unless something better took the line over
+void tick_set_bsp_oneshot(void (*oneshot)(uint32_t ms)) {
+    bsp_oneshot = oneshot;
+}
+
+// Catches ticks up with ktime, whoever loses the race just uses the winner's value
+void tick_update() {
+    if (!tickless) {
+        return;
+    }
+
+    uint32_t flags = interrupts_save();
+    if (spin_trylock(&tick_lock)) {
+        uint64_t elapsed = (ktime_get() - tick_last_ns) / NSEC_PER_MSEC;
+        if (elapsed) {
+            tick_last_ns += elapsed * NSEC_PER_MSEC;
+            ticks += (uint32_t)elapsed;
+        }
+        spin_unlock(&tick_lock);
+    }
+    interrupts_restore(flags);
+}
+
+// Timer interrupt on any CPU, after ticks is current
+void tick_timer_event() {
+    struct cpu *cpu = this_cpu();
+
+    if (tickless && cpu->id != 0) {
+        tick_update();
+    }
+
+    if (cpu->id == 0) { // The wheel runs on BSP time
+        timer_tick();
+    }
+    scheduler_tick();
+
+    if (tickless && (cpu->current_thread != cpu->idle_thread || cpu->need_resched)) {
+        program_event(TICK_MS);
+    }
+}
+
+// Called by the idle loop with interrupts off, right before hlt
+void tick_idle_enter() {
+    uint32_t wake;
+
+    if (!tickless) {
+        return;
+    }
+
+    if (this_cpu()->id != 0) {
+        lapic_timer_stop(); // Work for this CPU comes with an IPI
+        return;
+    }
+
+    if (timer_next_expiry(&wake)) {
+        tick_update();
+        int32_t delta = (int32_t)(wake - ticks);
+        bsp_oneshot(delta > 0 ? (uint32_t)delta : TICK_MS);
+    }
+    // No timers: the one-shot device stays quiet until something reprograms it
+}
+
+// Called by the scheduler when a CPU switches away from its idle thread
+void tick_idle_exit() {
+    if (!tickless) {
+        return;
+    }
+
+    tick_update();
+    program_event(TICK_MS);
+}
+
+// Counts how often each CPU leaves hlt over ms milliseconds
+void tick_measure_wakeups(uint32_t ms) {
+    uint32_t before[MAX_CPUS];
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        before[i] = cpus[i].wakeups;
+    }
+    uint32_t start = ticks;
+    thread_sleep(ms);
+    tick_update();
+    uint32_t elapsed = ticks - start;
+    if (!elapsed) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < cpu_count; i++) {
+        if (!cpus[i].online) {
+            continue;
+        }
+        dbg_printf("[%d] CPU %u: %u wakeups/s (%s)\n", ticks, i,
+                   (cpus[i].wakeups - before[i]) * 1000 / elapsed, tickless ? "tickless" : "periodic");
+    }
+}
@@ -0,0 +1,31 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+#define TICK_MS 1 // Event spacing while a CPU has something to run
+
+extern volatile bool tickless;
+
+void init_tickless();
+void tick_set_bsp_oneshot(void (*oneshot)(uint32_t ms));
+void tick_update();
+void tick_timer_event();
+void tick_idle_enter();
+void tick_idle_exit();
+void tick_measure_wakeups(uint32_t ms);
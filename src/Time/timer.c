@@ -0,0 +1,339 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "timer.h"
+#include "tick.h"
+#include "clocksource.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Paging/paging.h"
+#include "../Scheduler/scheduler.h"
+#include "../SMP/smp.h"
+
+#define ROOT_MASK  (TIMER_ROOT_SIZE - 1)
+#define LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define LEVEL_INDEX(jiffies, level) (((jiffies) >> (TIMER_ROOT_BITS + (level) * TIMER_LEVEL_BITS)) & LEVEL_MASK)
+
+#define time_after_eq(a, b) ((int32_t)((a) - (b)) >= 0)
+
+static struct timer *root[TIMER_ROOT_SIZE];
+static struct timer *levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static uint32_t timer_jiffies = 0;  // Next tick the wheel will process
+static uint32_t next_expiry = 0;    // No timer fires before this, may be early
+static uint32_t timer_count = 0;
+static struct timer *volatile running_timer = NULL;
+static struct spinlock timer_lock = SPINLOCK_INIT("timer_lock");
+static struct thread *timer_thread = NULL;
+
+static void link_timer(struct timer **bucket, struct timer *t) {
+    t->next = *bucket;
+    if (t->next) {
+        t->next->pprev = &t->next;
+    }
+    *bucket = t;
+    t->pprev = bucket;
+}
+
+static void unlink_timer(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Picks the bucket from how far away the timer is, needs timer_lock
+static void enqueue_timer(struct timer *t) {
+    uint32_t expires = t->expires;
+    uint32_t delta = expires - timer_jiffies;
+    struct timer **bucket;
+
+    if ((int32_t)delta < 0) { // Already due, runs on the next pass
+        bucket = &root[timer_jiffies & ROOT_MASK];
+    } else if (delta < (1 << TIMER_ROOT_BITS)) {
+        bucket = &root[expires & ROOT_MASK];
+    } else if (delta < (1 << (TIMER_ROOT_BITS + TIMER_LEVEL_BITS))) {
+        bucket = &levels[0][LEVEL_INDEX(expires, 0)];
+    } else if (delta < (1 << (TIMER_ROOT_BITS + 2 * TIMER_LEVEL_BITS))) {
+        bucket = &levels[1][LEVEL_INDEX(expires, 1)];
+    } else if (delta < (1 << (TIMER_ROOT_BITS + 3 * TIMER_LEVEL_BITS))) {
+        bucket = &levels[2][LEVEL_INDEX(expires, 2)];
+    } else {
+        bucket = &levels[3][LEVEL_INDEX(expires, 3)];
+    }
+    link_timer(bucket, t);
+}
+
+// Redistributes one slot of a level into the finer ones, returns the slot index
+// so the caller knows whether the next level up wrapped too
+static uint32_t cascade(uint32_t level, uint32_t index) {
+    struct timer *list = levels[level][index];
+    levels[level][index] = NULL;
+
+    while (list) {
+        struct timer *t = list;
+        list = t->next;
+        enqueue_timer(t);
+    }
+    return index;
+}
+
+// Earliest root slot with something in it, or the next cascade if the root is
+// empty. Needs timer_lock.
+static void update_next_expiry() {
+    for (uint32_t i = 0; i < TIMER_ROOT_SIZE; i++) {
+        uint32_t jiffies = timer_jiffies + i;
+        if (root[jiffies & ROOT_MASK]) {
+            next_expiry = jiffies;
+            return;
+        }
+        if (i && !(jiffies & ROOT_MASK)) {
+            next_expiry = jiffies; // Something may cascade into the root here
+            return;
+        }
+    }
+    next_expiry = timer_jiffies + TIMER_ROOT_SIZE;
+}
+
+// Processes every tick up to ticks, dropping the lock around each callback
+static void run_timers() {
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    while (time_after_eq(ticks, timer_jiffies)) {
+        uint32_t index = timer_jiffies & ROOT_MASK;
+        struct timer *work;
+
+        if (!index &&
+            !cascade(0, LEVEL_INDEX(timer_jiffies, 0)) &&
+            !cascade(1, LEVEL_INDEX(timer_jiffies, 1)) &&
+            !cascade(2, LEVEL_INDEX(timer_jiffies, 2))) {
+            cascade(3, LEVEL_INDEX(timer_jiffies, 3));
+        }
+        timer_jiffies++;
+
+        // Move the slot to a local head so timer_cancel() keeps working on it
+        work = root[index];
+        root[index] = NULL;
+        if (work) {
+            work->pprev = &work;
+        }
+
+        while (work) {
+            struct timer *t = work;
+            void (*callback)(void *arg) = t->callback;
+            void *arg = t->arg;
+
+            unlink_timer(t);
+            timer_count--;
+            running_timer = t;
+
+            spin_unlock_irqrestore(&timer_lock, flags);
+            callback(arg);
+            flags = spin_lock_irqsave(&timer_lock);
+
+            running_timer = NULL;
+        }
+    }
+
+    update_next_expiry();
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+static bool timers_due() {
+    return timer_count && time_after_eq(ticks, next_expiry);
+}
+
+static void timer_thread_main(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        run_timers();
+
+        // Pinned to the BSP, so the tick can't sneak in between the check and the block
+        uint32_t flags = interrupts_save();
+        if (!timers_due()) {
+            thread_block();
+        }
+        interrupts_restore(flags);
+    }
+}
+
+// Needs the scheduler, the timer thread lives on the BSP next to the tick
+void init_timers() {
+    timer_jiffies = ticks;
+    next_expiry = ticks;
+    timer_thread = thread_create_affinity("timer", timer_thread_main, NULL, 1 << 0);
+    if (!timer_thread) {
+        dbg_printf("[%d] Can't create the timer thread\n", ticks);
+    }
+}
+
+void timer_setup(struct timer *t, void (*callback)(void *arg), void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->arg = arg;
+}
+
+// Arms t to fire in ms milliseconds, re-arming it if it's already pending
+void timer_add(struct timer *t, uint32_t ms) {
+    bool earlier;
+    uint32_t flags = interrupts_save();
+
+    tick_update();
+    spin_lock(&timer_lock);
+
+    if (t->pprev) {
+        unlink_timer(t);
+        timer_count--;
+    }
+    t->expires = ticks + (ms ? ms : 1);
+    enqueue_timer(t);
+
+    earlier = !timer_count || !time_after_eq(t->expires, next_expiry);
+    if (earlier) {
+        next_expiry = t->expires;
+    }
+    timer_count++;
+
+    spin_unlock(&timer_lock);
+
+    // An idle BSP may have its next event set later than this, or not at all
+    if (earlier && tickless) {
+        cpu_kick(&cpus[0]);
+    }
+    interrupts_restore(flags);
+}
+
+// O(1) unlink. Waits for a running callback to finish, so t can go out of scope
+// right after. Returns whether the timer was still pending.
+bool timer_cancel(struct timer *t) {
+    bool pending = false;
+    uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+    if (t->pprev) {
+        unlink_timer(t);
+        timer_count--;
+        pending = true;
+    }
+    spin_unlock_irqrestore(&timer_lock, flags);
+
+    // The callback may have been preempted on this very CPU, so let it finish
+    if (thread_current() != timer_thread) {
+        while (running_timer == t) {
+            thread_yield();
+        }
+    }
+    return pending;
+}
+
+bool timer_pending(struct timer *t) {
+    return t->pprev != NULL;
+}
+
+// BSP timer interrupt, after ticks is current
+void timer_tick() {
+    if (timer_thread && timers_due()) {
+        thread_unblock(timer_thread);
+    }
+}
+
+// For tickless idle: the tick the BSP has to be awake for, if any
+bool timer_next_expiry(uint32_t *tick) {
+    if (!timer_count) {
+        return false;
+    }
+    *tick = next_expiry;
+    return true;
+}
+
+static void timeout_callback(void *arg) {
+    ((struct timeout*)arg)->expired = true;
+}
+
+void timeout_start(struct timeout *t, uint32_t ms) {
+    t->expired = false;
+    timer_setup(&t->timer, timeout_callback, t);
+    timer_add(&t->timer, ms);
+}
+
+// Also compares against ticks directly, in case the timer thread can't run yet
+bool timeout_expired(struct timeout *t) {
+    if (t->expired) {
+        return true;
+    }
+    tick_update();
+    return time_after_eq(ticks, t->timer.expires);
+}
+
+void timeout_stop(struct timeout *t) {
+    timer_cancel(&t->timer);
+}
+
+static volatile uint32_t bench_fired = 0;
+
+static void bench_callback(void *arg) {
+    (void)arg;
+    __atomic_add_fetch(&bench_fired, 1, __ATOMIC_RELAXED);
+}
+
+// Adds and cancels count timers spread over every level, then lets count short
+// timers run out to exercise cascading and the callback path
+void run_timer_benchmark(uint32_t count) {
+    uint32_t pages = CEIL_DIV(count * sizeof(struct timer), PAGE_SIZE);
+    uint32_t frames = alloc_frames(pages);
+    if (!frames) {
+        dbg_printf("[%d] Timer benchmark: can't allocate %u timers\n", ticks, count);
+        return;
+    }
+    struct timer *timers = (struct timer*)frames;
+    uint32_t seed = 0x12345678;
+
+    for (uint32_t i = 0; i < count; i++) {
+        timer_setup(&timers[i], bench_callback, NULL);
+    }
+
+    uint64_t start = ktime_get();
+    for (uint32_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        timer_add(&timers[i], 1000 + (seed >> 8) % 0x1000000); // Past the root, up to ~4.6 hours
+    }
+    uint64_t add_ns = ktime_get() - start;
+
+    start = ktime_get();
+    for (uint32_t i = 0; i < count; i++) {
+        timer_cancel(&timers[i]);
+    }
+    uint64_t cancel_ns = ktime_get() - start;
+
+    dbg_printf("[%d] Timer wheel: %u timers, add %u ns, cancel %u ns each\n",
+               ticks, count, (uint32_t)(add_ns / count), (uint32_t)(cancel_ns / count));
+
+    bench_fired = 0;
+    start = ktime_get();
+    for (uint32_t i = 0; i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        timer_add(&timers[i], 1 + (seed >> 8) % 600); // Crosses one cascade
+    }
+    while (bench_fired < count) {
+        thread_sleep(10);
+    }
+    uint64_t run_ns = ktime_get() - start;
+
+    dbg_printf("[%d] Timer wheel: %u timers fired in %u ms\n", ticks, count, (uint32_t)(run_ns / NSEC_PER_MSEC));
+    free_frames(frames, pages);
+}
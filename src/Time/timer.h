@@ -0,0 +1,56 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+// Hierarchical timer wheel in ticks: a 256 slot root for the next 256 ms, then
+// four 64 slot levels that cascade down as time reaches them
+#define TIMER_ROOT_BITS  8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE  (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS     4
+
+// Callbacks run in the timer thread, with interrupts on and no locks held
+struct timer {
+    struct timer *next;
+    struct timer **pprev; // NULL while not queued
+    uint32_t expires;
+    void (*callback)(void *arg);
+    void *arg;
+};
+
+// An I/O deadline for polling loops
+struct timeout {
+    struct timer timer;
+    volatile bool expired;
+};
+
+void init_timers();
+void timer_setup(struct timer *t, void (*callback)(void *arg), void *arg);
+void timer_add(struct timer *t, uint32_t ms);
+bool timer_cancel(struct timer *t);
+bool timer_pending(struct timer *t);
+void timer_tick();
+bool timer_next_expiry(uint32_t *tick);
+
+void timeout_start(struct timeout *t, uint32_t ms);
+bool timeout_expired(struct timeout *t);
+void timeout_stop(struct timeout *t);
+
+void run_timer_benchmark(uint32_t count);
@@ -0,0 +1,105 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "tsc.h"
+#include "clocksource.h"
+#include "../Drivers/PIT/pit.h"
+#include "../Drivers/VGA/vga.h"
+#include "../Log/klog.h"
+#include "../Debug/bootprof.h"
+
+uint32_t tsc_khz = 0;
+bool tsc_invariant = false;
+
+static uint64_t tsc_read() {
+    return rdtsc();
+}
+
+static struct clocksource tsc_clocksource = {
+    .name = "tsc",
+    .read = tsc_read,
+};
+
+// Times a TSC_CALIBRATE_MS one-shot on PIT channel 2, polling its output pin so
+// no interrupt is needed. Returns the TSC frequency in kHz, 0 on failure.
+static uint32_t calibrate_once() {
+    uint32_t count = PIT_FREQUENCY / 1000 * TSC_CALIBRATE_MS;
+    uint8_t port_b = inb(PIT_PORT_B);
+
+    // Gate on, speaker off
+    outb(PIT_PORT_B, (port_b & ~PIT_PORT_B_SPEAKER) | PIT_PORT_B_GATE2);
+
+    outb(PIT_COMMAND, PIT_CMD_CHANNEL2 | PIT_CMD_LOHI | PIT_CMD_MODE0 | PIT_CMD_BINARY);
+    outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL2, (uint8_t)((count >> 8) & 0xFF)); // Counting starts here
+
+    uint64_t wait = boot_wait_begin();
+    uint64_t start = rdtsc();
+    uint32_t polls = 0;
+    while (!(inb(PIT_PORT_B) & PIT_PORT_B_OUT2)) {
+        polls++;
+    }
+    uint64_t cycles = rdtsc() - start;
+    boot_wait_end(wait);
+
+    outb(PIT_PORT_B, port_b);
+
+    if (polls < 100) { // Channel 2 isn't there or fired right away
+        return 0;
+    }
+
+    // count / PIT_FREQUENCY seconds elapsed
+    return (uint32_t)(cycles * PIT_FREQUENCY / count / 1000);
+}
+
+// Calibrates the TSC against PIT channel 2 and registers it as a clocksource.
+// Needs nothing else, so it can run first thing at boot.
+void init_TSC() {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEATURE_TSC)) {
+        dbg_printf("[%d] No TSC\n", ticks);
+        return;
+    }
+
+    cpuid(CPUID_EXT_MAX, &eax, &ebx, &ecx, &edx);
+    if (eax >= CPUID_EXT_POWER) {
+        cpuid(CPUID_EXT_POWER, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = edx & CPUID_INVARIANT_TSC;
+    }
+
+    // The lowest reading is the one least disturbed by SMIs and VM exits
+    for (uint32_t i = 0; i < TSC_CALIBRATE_RUNS; i++) {
+        uint32_t khz = calibrate_once();
+        if (khz && (!tsc_khz || khz < tsc_khz)) {
+            tsc_khz = khz;
+        }
+    }
+
+    if (!tsc_khz) {
+        klog(KLOG_ERR, "[%d] TSC calibration failed\n", ticks);
+        return;
+    }
+
+    // A TSC that changes speed with P-states or stops in C-states is only a last resort
+    tsc_clocksource.khz = tsc_khz;
+    tsc_clocksource.rating = tsc_invariant ? 300 : 100;
+    clocksource_register(&tsc_clocksource);
+
+    if (!tsc_invariant) {
+        dbg_printf("[%d] TSC isn't invariant, ktime may drift with frequency changes\n", ticks);
+    }
+}
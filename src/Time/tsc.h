@@ -0,0 +1,33 @@
+// Copyright (C) 2024 Ahmed
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "../Headers/stdint.h"
+#include "../Headers/util.h"
+
+#define CPUID_FEATURES        0x00000001
+#define CPUID_FEATURE_TSC     (1 << 4)  // EDX
+#define CPUID_EXT_MAX         0x80000000
+#define CPUID_EXT_POWER       0x80000007
+#define CPUID_INVARIANT_TSC   (1 << 8)  // EDX of CPUID_EXT_POWER
+
+#define TSC_CALIBRATE_MS   10
+#define TSC_CALIBRATE_RUNS 5
+
+extern uint32_t tsc_khz;
+extern bool tsc_invariant;
+
+void init_TSC();
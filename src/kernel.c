@@ -14,19 +14,48 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "Drivers/ATA/ata.h"
+#include "Drivers/PS2/mouse.h"
+#include "Drivers/Serial/serial.h"
 #include "Headers/multiboot.h"
+#include "Headers/format.h"
 #include "GDT/gdt.h"
 #include "Paging/paging.h"
+#include "ELF/elf.h"
+#include "Scheduler/scheduler.h"
+#include "ACPI/acpi.h"
+#include "SMP/smp.h"
+#include "Drivers/HPET/hpet.h"
+#include "Time/tick.h"
+#include "Time/tsc.h"
+#include "Time/clocksource.h"
+#include "Time/timer.h"
+#include "Lock/spinlock.h"
+#include "Lock/rcu.h"
+#include "Log/klog.h"
+#include "Log/ftrace.h"
+#include "Debug/profile.h"
+#include "Debug/bootprof.h"
 
 extern void test_ints();
 
+// Build with BENCHMARKS=1 to run the benchmarks during boot
+#ifdef BENCHMARKS
+#define benchmark(call) boot_step(call)
+#else
+#define benchmark(call) do { } while (0)
+#endif
+
 void main(uint32_t magic, struct multiboot_info* mb_info) {
     struct DriveInfo drive_info;
     char buffer[24576];
 
-    (void)magic; (void)mb_info;
+    (void)magic;
 
+    boot_profile_start();
     clear_screen();
+    // Polled until IRQ 4 is installed
+    boot_step(init_serial(SERIAL_DEFAULT_BAUD));
+    boot_step(init_klog_sinks());
     dbg_puts("\033[2J\033[H");
 
     printf("RetroFlex OS  Copyright (C) 2024 Ahmed\n");
@@ -39,44 +68,124 @@ void main(uint32_t magic, struct multiboot_info* mb_info) {
     dbg_printf("This is free software, and you are welcome to redistribute it\n");
     dbg_printf("under certain conditions; type 'show c' for details.\n\n");
 
-    dbg_printf("[%d] Initializing GDT\n",ticks);
-    init_GDT();
+    dbg_printf("[%u us] Calibrating TSC\n", ktime_get_us());
+    boot_step(init_TSC());
+
+    dbg_printf("[%u us] Initializing GDT\n", ktime_get_us());
+    boot_step(init_GDT());
+
+    dbg_printf("[%u us] Initializing Frame Allocator\n", ktime_get_us());
+    boot_step(init_frame_allocator(mb_info));
+
+    dbg_printf("[%u us] Initializing Paging\n", ktime_get_us());
+    boot_step(init_paging());
+
+    dbg_printf("[%u us] Initializing IDT\n", ktime_get_us());
+    boot_step(init_IDT());
+
+    dbg_printf("[%u us] Initializing PIT\n", ktime_get_us());
+    boot_step(init_PIT(1000));
+
+    dbg_printf("[%u us] Installing PIT IRQ\n", ktime_get_us());
+    boot_step(install_PIT_irq());
+
+    dbg_printf("[%u us] Installing serial IRQ\n", ktime_get_us());
+    boot_step(install_serial_irq());
+
+    dbg_printf("[%u us] Initializing Scheduler\n", ktime_get_us());
+    boot_step(init_scheduler());
 
-    dbg_printf("[%d] Initializing Paging\n",ticks);
-    init_paging();
+    dbg_printf("[%u us] Initializing Timers\n", ktime_get_us());
+    boot_step(init_timers());
+    boot_step(init_rcu());
+    boot_step(init_klog());
+    benchmark(run_context_switch_benchmark(10000));
 
-    dbg_printf("[%d] Initializing IDT\n",ticks);
-    init_IDT();
+    dbg_printf("[%u us] Initializing ACPI\n", ktime_get_us());
+    boot_step(init_ACPI());
 
-    dbg_printf("[%d] Initializing PIT\n",ticks);
-    init_PIT(1000);
+    dbg_printf("[%u us] Initializing HPET\n", ktime_get_us());
+    boot_phase_begin("init_HPET()");
+    bool hpet = init_HPET();
+    boot_phase_end();
+    if (hpet) {
+        // The HPET comparator has no divisor rounding, it keeps the tick at 1 ms
+        boot_step(hpet_take_over_tick());
+        benchmark(run_tick_jitter_benchmark());
+    }
+
+    dbg_printf("[%u us] Initializing SMP\n", ktime_get_us());
+    boot_step(init_SMP());
+
+    // Where the benchmarks below spend their time
+    benchmark(profile_start());
+    benchmark(run_scaling_benchmark());
+    benchmark(run_rcu_benchmark(1000000));
 
-    dbg_printf("[%d] Installing PIT IRQ\n",ticks);
-    install_PIT_irq();
+    benchmark(tick_measure_wakeups(500));
+    dbg_printf("[%u us] Switching to tickless idle\n", ktime_get_us());
+    boot_step(init_tickless());
+    benchmark(tick_measure_wakeups(500));
+    benchmark(run_timer_benchmark(100000));
+    benchmark(run_serial_benchmark(16384));
+    benchmark(run_console_benchmark(1000));
+    benchmark(run_format_benchmark(100000));
+    benchmark(profile_report(15));
 
-    dbg_printf("[%d] Initializing PS/2 Controller\n",ticks);
-    ps2_init();
+    dbg_printf("[%u us] Initializing PS/2 Controller\n", ktime_get_us());
+    boot_step(ps2_init());
 
-    dbg_printf("[%d] Installing PS/2 Controller IRQ\n",ticks);
-    install_keyboard_irq();
+    dbg_printf("[%u us] Installing PS/2 Controller IRQ\n", ktime_get_us());
+    boot_step(install_keyboard_irq());
 
-    dbg_printf("[%d] Reading RTC\n",ticks);
-    read_rtc();
+    // The handler goes in first, reporting starts as soon as the mouse is enabled
+    dbg_printf("[%u us] Initializing PS/2 mouse\n", ktime_get_us());
+    boot_step(install_mouse_irq());
+    boot_step(init_mouse());
+
+    dbg_printf("[%u us] Reading RTC\n", ktime_get_us());
+    boot_step(read_rtc());
 
     printf("Time %d:%d:%d\n", hour, minute, second);
 
     printf("Date %d/%d/%d\n", day, month, current_year);
 
-    dbg_printf("[%d] Checking ATA controller\n", ticks);
-    if(!check_ata_controller())
-	    dbg_printf("[%d] Didn't Find ATA controller\n", ticks);
+    dbg_printf("[%u us] Installing ATA IRQs\n", ktime_get_us());
+    boot_step(install_ata_irq());
+
+    scheduler_print_idle();
+    dbg_printf("[%u us] Checking ATA controller\n", ktime_get_us());
+    boot_phase_begin("check_ata_controller()");
+    bool ata = check_ata_controller();
+    boot_phase_end();
+    if(!ata)
+	    dbg_printf("[%u us] Didn't Find ATA controller\n", ktime_get_us());
 
-    identify_drive(&drive_info, false, false);
-    read_sector_chs(0, 0, 1, buffer, 24576, &drive_info);
+    boot_step(identify_drive(&drive_info, false, false));
+    boot_step(read_sector_chs(0, 0, 1, buffer, 24576, &drive_info));
     print_drive_info(&drive_info);
+    boot_report();
+    scheduler_print_idle(); // Mostly idle while waiting on the drive
+    lock_stats_print();
+    ftrace_dump_chrome();
+    dbg_printf("[%u us] %u key events dropped, %u mouse events dropped, %u log records dropped, %u serial bytes dropped\n",
+               ktime_get_us(), ps2_dropped_keys(), mouse_dropped_events(), klog_dropped(), serial_dropped());
     for(int i = 0; i < 24576; i++){
         dbg_printf("%x ", (char)buffer[i]);
     }
     putc('\n');
-    return;
+
+    // The first multiboot module, if any, is run as the init program
+    if ((mb_info->flags & 0x8) && mb_info->mods_count > 0) {
+        struct multiboot_mod_list *mod = (struct multiboot_mod_list*)mb_info->mods_addr;
+        const char *argv[] = { mod->cmdline ? (const char*)mod->cmdline : "init", NULL };
+        const char *envp[] = { "PATH=/bin", NULL };
+
+        dbg_printf("[%u us] Running init module\n", ktime_get_us());
+        int32_t status = elf_exec((const void*)mod->mod_start, mod->mod_end - mod->mod_start, argv, envp);
+        printf("init exited with status %d\n", status);
+    }
+
+    // Leave the CPU to the other threads, the idle thread halts when there are none
+    thread_exit();
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Copyright (C) 2024 Ahmed
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Writes the kernel symbol table (src/Debug/ksyms.h) as C.
+
+    nm -n build/kernel | ksyms.py > build/ksyms.c
+    ksyms.py --empty > build/ksyms.c
+
+The first link has no table yet. It sits in .rodata, after .text, so linking it
+in doesn't move any function and one more link gets the addresses right.
+"""
+
+import sys
+
+TEXT_TYPES = "TtWw"
+
+
+def read_symbols(lines):
+    """Functions inside [kernel_text_start, kernel_text_end), one name per address."""
+    symbols = {}
+    start = end = None
+    for line in lines:
+        fields = line.split()
+        if len(fields) != 3 or fields[1] not in TEXT_TYPES:
+            continue
+        address, kind, name = int(fields[0], 16), fields[1], fields[2]
+        if name == "kernel_text_start":
+            start = address
+        elif name == "kernel_text_end":
+            end = address
+        elif address not in symbols or (kind.isupper() and not symbols[address][1].isupper()):
+            symbols[address] = (name, kind)  # Globals win over local aliases
+    if start is None or end is None:
+        sys.exit("ksyms.py: kernel_text_start/kernel_text_end missing from the nm output")
+    return [(address, name) for address, (name, _) in sorted(symbols.items()) if start <= address < end]
+
+
+def main():
+    symbols = [] if sys.argv[1:] == ["--empty"] else read_symbols(sys.stdin)
+
+    out = sys.stdout
+    out.write("// Generated by tools/ksyms.py, do not edit\n\n")
+    out.write('#include "Debug/ksyms.h"\n\n')
+    out.write("const uint32_t ksym_count = %u;\n\n" % len(symbols))
+    out.write("const uint32_t ksym_addresses[] = {\n")
+    for address, _ in symbols or [(0, None)]:
+        out.write("    0x%08x,\n" % address)
+    out.write("};\n\n")
+    out.write("const char *const ksym_names[] = {\n")
+    for _, name in symbols or [(0, "")]:
+        out.write('    "%s",\n' % name)
+    out.write("};\n")
+
+
+if __name__ == "__main__":
+    main()
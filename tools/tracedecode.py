@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+# Copyright (C) 2024 Ahmed
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""Turns a serial or debug port capture from a TRACE=1 kernel back into text.
+
+Plain log text passes through. Binary events (src/Log/trace.h) carry the address
+of their format string and the raw argument words, the format is read from the
+kernel ELF and applied here.
+
+    tracedecode.py build/kernel build/trace.bin [--tsc-khz N]
+"""
+
+import argparse
+import re
+import struct
+import sys
+
+TRACE_MAGIC = 0xFF
+FRAME = struct.Struct("<BBHQ")  # magic, cpu, length, timestamp
+
+SHT_NOBITS = 8
+SHF_ALLOC = 0x2
+
+CONVERSION = re.compile(rb"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|z)?([diouxXpcs%])")
+
+
+class Image:
+    """The loaded sections of a 32-bit ELF, addressed like the kernel sees them."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF" or data[4] != 1:
+            sys.exit(f"{path}: not a 32-bit ELF")
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            (_, sh_type, flags, addr, offset, size) = struct.unpack_from("<IIIIII", data, shoff + i * shentsize)
+            if flags & SHF_ALLOC and sh_type != SHT_NOBITS and size:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def string(self, address):
+        for base, contents in self.sections:
+            if base <= address < base + len(contents):
+                start = address - base
+                end = contents.find(b"\0", start)
+                return contents[start:end if end >= 0 else len(contents)]
+        return None
+
+
+def signed(value, bits):
+    value &= (1 << bits) - 1
+    return value - (1 << bits) if value >> (bits - 1) else value
+
+
+def format_event(image, fmt, words):
+    """printf() on the host, pulling arguments off the words the kernel stored."""
+    words = list(words)
+
+    def word():
+        return words.pop(0) if words else 0
+
+    def convert(match):
+        flags, width, precision, length, spec = match.groups()
+        if spec == b"%":
+            return b"%"
+        if width == b"*":
+            width = str(signed(word(), 32)).encode()
+        if precision == b"*":
+            precision = str(signed(word(), 32)).encode()
+        spec_text = b"%" + flags + (width or b"") + (b"." + precision if precision is not None else b"")
+
+        if spec == b"s":
+            address = word()
+            text = image.string(address)
+            if text is None:
+                text = b"<string at 0x%08x>" % address
+            return (spec_text + b"s") % text
+        if spec == b"c":
+            return (spec_text + b"c") % (word() & 0xFF)
+
+        value = word()
+        if length == b"ll":
+            value |= word() << 32
+        bits = {b"hh": 8, b"h": 16, b"ll": 64}.get(length, 32)
+        if spec in b"di":
+            return (spec_text + b"d") % signed(value, bits)
+        value &= (1 << bits) - 1
+        if spec == b"u":
+            return (spec_text + b"d") % value
+        if spec == b"p":
+            return b"0x%08x" % value
+        return (spec_text + spec) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode(image, stream, out, tsc_khz):
+    pos = 0
+    while pos < len(stream):
+        frame_start = stream.find(bytes([TRACE_MAGIC]), pos)
+        if frame_start < 0:
+            out.write(stream[pos:])
+            return
+        out.write(stream[pos:frame_start])
+        if frame_start + FRAME.size > len(stream):
+            return  # Capture cut mid-frame
+        _, cpu, length, timestamp = FRAME.unpack_from(stream, frame_start)
+        payload = stream[frame_start + FRAME.size:frame_start + FRAME.size + length]
+        pos = frame_start + FRAME.size + length
+        if len(payload) < length or length < 4:
+            return
+
+        words = struct.unpack_from(f"<{length // 4}I", payload)
+        fmt = image.string(words[0])
+        if fmt is None:
+            out.write(b"<unknown format at 0x%08x>\n" % words[0])
+            continue
+        if tsc_khz:
+            out.write(b"(%u.%06u cpu%u) " % (timestamp // (tsc_khz * 1000), timestamp * 1000 // tsc_khz % 1000000, cpu))
+        out.write(format_event(image, fmt, words[1:]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("kernel", help="the kernel ELF that produced the capture")
+    parser.add_argument("capture", help="raw serial or debug port output")
+    parser.add_argument("--tsc-khz", type=int, default=0, help="prefix events with seconds since reset and the CPU")
+    args = parser.parse_args()
+
+    image = Image(args.kernel)
+    with open(args.capture, "rb") as f:
+        stream = f.read()
+    decode(image, stream, sys.stdout.buffer, args.tsc_khz)
+
+
+if __name__ == "__main__":
+    main()